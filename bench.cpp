@@ -0,0 +1,157 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <cxxopts.hpp>
+
+#include <Devices/Bus.hpp>
+#include <Devices/MappedPhysicalMemory.hpp>
+#include <Hart.hpp>
+
+// Measures the fast path of a hart on a fixed loop of ALU, load, store and
+// branch instructions, or of common instruction pairs, most of which the
+// hart fuses, and prints where HartState's fields landed, so that layout
+// and fast path changes can be compared run against run.
+
+// The same words run as RV32 and RV64, for --loop mixed:
+//     lui t0, 0x10
+// loop:
+//     addi a0, a0, 1
+//     add a1, a1, a0
+//     xor a2, a2, a1
+//     sw a1, 0(t0)
+//     lw a3, 0(t0)
+//     slli a4, a3, 3
+//     sub a5, a4, a2
+//     andi a6, a5, 0xff
+//     bne a6, zero, skip
+//     addi a7, a7, 1
+// skip:
+//     j loop
+constexpr __uint32_t benchLoop[] = {
+    0x000102b7, 0x00150513, 0x00a585b3, 0x00b64633, 0x00b2a023, 0x0002a683,
+    0x00369713, 0x40c707b3, 0x0ff7f813, 0x00081463, 0x00188893, 0xfd9ff06f
+};
+
+// And for --loop idioms:
+//     lui t0, 0x10
+// loop:
+//     lui a0, 0x12345
+//     addi a0, a0, 0x678
+//     auipc a1, 0
+//     addi a1, a1, 16
+//     slli a2, a0, 16
+//     srli a2, a2, 16
+//     auipc t1, 0
+//     jalr zero, 8(t1)
+//     addi a4, a4, 1
+//     j loop
+constexpr __uint32_t idiomLoop[] = {
+    0x000102b7, 0x12345537, 0x67850513, 0x00000597, 0x01058593, 0x01051613,
+    0x01065613, 0x00000317, 0x00830067, 0x00170713, 0xfddff06f
+};
+constexpr __uint64_t benchLoopAddress = 0x80000000;
+
+template<typename XLEN_t>
+void PrintLayout(Hart<XLEN_t>* hart) {
+    char* base = (char*)&hart->state;
+    auto at = [base](const void* field) { return (long)((char*)field - base); };
+    std::cout << "HartState<" << 8*sizeof(XLEN_t) << ">: " << sizeof(hart->state) << " bytes,"
+              << " pc at " << at(&hart->state.pc)
+              << ", regs at " << at(&hart->state.regs)
+              << ", privilegeMode at " << at(&hart->state.privilegeMode)
+              << ", mstatus at " << at(&hart->state.mstatus)
+              << ", mip at " << at(&hart->state.mip)
+              << ", cold CSRs from " << at(&hart->state.resetVector)
+              << ", state " << ((uintptr_t)base % 64 == 0 ? "is" : "is not") << " line aligned"
+              << std::endl;
+}
+
+template<typename XLEN_t>
+void RunBench(const __uint32_t* loop, __uint64_t loopBytes, __uint64_t instructions, unsigned int repeats) {
+
+    Bus bus;
+    MappedPhysicalMemory mem(0x100000000);
+    bus.AddDevice64((Device*)&mem, 0, 0xffffffff);
+    bus.Write64(benchLoopAddress, loopBytes, (char*)loop);
+
+    std::unique_ptr<Hart<XLEN_t>> hart = std::make_unique<Hart<XLEN_t>>(&bus, RISCV::stringToExtensions("imacsu"));
+    hart->state.resetVector = benchLoopAddress;
+    hart->Reset();
+    PrintLayout(hart.get());
+
+    // Fill the icache and translation caches before timing anything
+    for (unsigned int i = 0; i < 100; i++) {
+        hart->Tick();
+    }
+
+    std::vector<double> mips;
+    for (unsigned int repeat = 0; repeat < repeats; repeat++) {
+        __uint64_t retired = 0;
+        auto start = std::chrono::steady_clock::now();
+        while (retired < instructions) {
+            retired += hart->Tick();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        mips.push_back((double)retired / seconds / 1000000.0);
+    }
+    std::sort(mips.begin(), mips.end());
+    std::cout << "RV" << 8*sizeof(XLEN_t) << (fixedISA<XLEN_t> ? " (fixed ISA)" : "") << ": median " << mips[mips.size()/2]
+              << " MIPS, best " << mips.back() << " MIPS over " << repeats << " runs of "
+              << instructions << " instructions" << std::endl;
+}
+
+int main(int argc, char **argv) {
+
+    cxxopts::Options options("grim-bench", "Measure the speed of GRIM's hart fast path");
+    options.add_options()
+    ("x,mxlen", "Width to measure, one of (32, 64), or both if left out", cxxopts::value<std::string>())
+    ("l,loop", "Loop to run, one of (mixed, idioms) (default mixed)", cxxopts::value<std::string>())
+    ("n,instructions", "Instructions per run (default 100000000)", cxxopts::value<__uint64_t>())
+    ("r,repeats", "Number of runs to take the median and best of (default 5)", cxxopts::value<unsigned int>())
+    ("h,help", "Print help message");
+
+    cxxopts::ParseResult parsed_arguments = options.parse(argc, argv);
+
+    if (parsed_arguments.count("help")) {
+        std::cout << options.help() << std::endl;
+        return 0;
+    }
+
+    __uint64_t instructions = 100000000;
+    if (parsed_arguments.count("instructions")) {
+        instructions = parsed_arguments["instructions"].as<__uint64_t>();
+    }
+
+    unsigned int repeats = 5;
+    if (parsed_arguments.count("repeats")) {
+        repeats = parsed_arguments["repeats"].as<unsigned int>();
+        if (repeats == 0) {
+            std::cerr << "Fatal: --repeats must be at least one" << std::endl;
+            return 1;
+        }
+    }
+
+    std::string mxlen = parsed_arguments.count("mxlen") ? parsed_arguments["mxlen"].as<std::string>() : "";
+    if (mxlen != "" && mxlen != "32" && mxlen != "64") {
+        std::cerr << "Fatal: --mxlen must be 32 or 64" << std::endl;
+        return 1;
+    }
+    std::string loopName = parsed_arguments.count("loop") ? parsed_arguments["loop"].as<std::string>() : "mixed";
+    if (loopName != "mixed" && loopName != "idioms") {
+        std::cerr << "Fatal: --loop must be mixed or idioms" << std::endl;
+        return 1;
+    }
+    const __uint32_t* loop = loopName == "mixed" ? benchLoop : idiomLoop;
+    __uint64_t loopBytes = loopName == "mixed" ? sizeof(benchLoop) : sizeof(idiomLoop);
+
+    if (mxlen != "64") {
+        RunBench<__uint32_t>(loop, loopBytes, instructions, repeats);
+    }
+    if (mxlen != "32") {
+        RunBench<__uint64_t>(loop, loopBytes, instructions, repeats);
+    }
+    return 0;
+}
@@ -1,10 +1,20 @@
 #include <iostream>
 #include <chrono>
 #include <array>
+#include <atomic>
+#include <barrier>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
 
 #include <cxxopts.hpp>
 
 #include <ElfFile.hpp>
+#include <EventQueue.hpp>
+#include <EventScheduler.hpp>
 #include <Devices/Bus.hpp>
 #include <Devices/IOLogger.hpp>
 #include <Devices/MappedPhysicalMemory.hpp>
@@ -13,7 +23,14 @@
 #include <Devices/ProxyKernelServer.hpp>
 #include <Devices/UART.hpp>
 #include <Hart.hpp>
+#include <HostPlacement.hpp>
+#include <ParkingLot.hpp>
 #include <PrintStates.hpp>
+#include <QuantumScheduling.hpp>
+#include <ReservationSet.hpp>
+#include <Trace/TraceFilter.hpp>
+#include <Trace/TraceTrigger.hpp>
+#include <Trace/TraceWriter.hpp>
 
 __uint64_t MaskForSize(__uint64_t size) {
     if (size > (__uint64_t)1 << 63) // TODO this assumes Address is 64 bit
@@ -23,52 +40,89 @@ __uint64_t MaskForSize(__uint64_t size) {
     return nextPo2 - 1;
 }
 
+// Returned by a ticker when a trace trigger (or a break it armed) fires, so
+// the run loop can switch tracing on or off and pick a new ticker.
+constexpr unsigned int traceTriggerEvent = 0x7ACE7ACE;
+
+// Set from the SIGUSR1 handler, toggles tracing at the next check.
+volatile std::sig_atomic_t trace_signal_pending = 0;
+
+void trace_signal_handler(int) {
+    trace_signal_pending = 1;
+}
+
+// How often a lone hart's WFI moved time forward to the next event, and how
+// far in instructions.
+struct IdleStats {
+    __uint64_t fastForwards = 0;
+    __uint64_t skippedTime = 0;
+};
+
 // Note: These parameters could be constexpr-if'd but that breaks pedantry, and
 //       the compiler does the right thing in O3.
-template <typename MXLEN_t, bool limit_cycles, bool check_events, bool print_regs, bool print_disasm, bool print_details>
+template <typename MXLEN_t, bool limit_cycles, bool check_events, bool print_regs, bool print_disasm, bool print_details, bool trace_binary>
 unsigned int tick_until(
         Hart<MXLEN_t> *hart,
         CoreLocalInterruptor* clint,
-        std::queue<unsigned int> *eq,
+        EventScheduler *scheduler,
+        EventQueue *eq,
         std::ostream *out,
-        unsigned int *ticks,
-        unsigned int cycle_limit,
-        unsigned int event_check_freq,
+        TraceWriter *tracer,
+        __uint64_t *ticks,
+        __uint64_t cycle_limit,
+        __uint64_t trigger_at,
+        IdleStats *idle,
         bool useRegAbiNames) {
 
     while (true) {
 
+        if ((*ticks) >= trigger_at || trace_signal_pending || hart->BreakPending()) [[ unlikely ]] {
+            return traceTriggerEvent;
+        }
+
         if constexpr (print_details) {
-            PrintArchDetails<MXLEN_t>(&hart->state, out);
+            PrintArchDetails(&hart->state, out);
         }
 
         if constexpr (print_regs) {
-            PrintRegisters<MXLEN_t>(&hart->state, out, useRegAbiNames, 4);
+            PrintRegisters(&hart->state, out, useRegAbiNames, 4);
         }
 
-        if constexpr (print_disasm) {
-            if constexpr (limit_cycles || check_events) {
-                (*ticks) += hart->TickOnceAndPrintDisasm(&std::cout);
-            } else {
-                hart->TickOnceAndPrintDisasm(&std::cout);
-            }
+        // Ticks are always counted now, since count triggers depend on them,
+        // and the fast path is held short of the next trigger and the next
+        // scheduled device event.
+        unsigned int ran;
+        if constexpr (trace_binary) {
+            ran = hart->TickOnceAndTrace(tracer);
+        } else if constexpr (print_disasm) {
+            ran = hart->TickOnceAndPrintDisasm(&std::cout);
         } else {
-            if constexpr (limit_cycles || check_events) {
-                (*ticks) += hart->Tick();
-            } else {
-                hart->Tick();
+            __uint64_t until_trigger = trigger_at - (*ticks);
+            ran = hart->Tick(scheduler->Headroom(until_trigger < 0xFFFFFFFF ? (unsigned int)until_trigger : 0xFFFFFFFF));
+        }
+        (*ticks) += ran;
+        scheduler->Advance(ran);
+
+        clint->UpdateInterrupts((unsigned int)hart->state.mhartid, &hart->state);
+        if (idle != nullptr) {
+            // WFI with nothing pending can only end at a device event, so go
+            // straight to the next one
+            char *watched;
+            if (hart->TakeIdle(&watched) == Hart<MXLEN_t>::Idle::Wfi && !hart->state.InterruptPending()) [[ unlikely ]] {
+                __uint64_t skipped = scheduler->SkipToNextDeadline();
+                if (skipped > 0) {
+                    idle->fastForwards++;
+                    idle->skippedTime += skipped;
+                    clint->UpdateInterrupts((unsigned int)hart->state.mhartid, &hart->state);
+                }
             }
         }
-
-        clint->Tick();
+        hart->state.ServiceInterrupts();
 
         if constexpr (check_events) {
-            if ((*ticks) % event_check_freq == 0) {
-                if (!eq->empty()) {
-                    unsigned int event = eq->front();
-                    eq->pop();
-                    return event;
-                }
+            unsigned int event;
+            if (eq->Pending() && eq->Pop(&event)) [[ unlikely ]] {
+                return event;
             }
         }
 
@@ -81,35 +135,212 @@ unsigned int tick_until(
 }
 
 template <typename MXLEN_t>
-using tick_func = unsigned int (*)(Hart<MXLEN_t>*, CoreLocalInterruptor*, std::queue<unsigned int>*, std::ostream*, unsigned int*, unsigned int, unsigned int, bool);
+using tick_func = unsigned int (*)(Hart<MXLEN_t>*, CoreLocalInterruptor*, EventScheduler*, EventQueue*, std::ostream*, TraceWriter*, __uint64_t*, __uint64_t, __uint64_t, IdleStats*, bool);
 
 template<typename MXLEN_t, unsigned int TickerHash>
-constexpr std::array<tick_func<MXLEN_t>, 32> add_tickers(std::array<tick_func<MXLEN_t>, 32> arr) {
-    if constexpr (TickerHash < 32) {
-        constexpr bool limit_cycles  = TickerHash & 0b10000;
-        constexpr bool check_events  = TickerHash & 0b01000;
-        constexpr bool print_regs    = TickerHash & 0b00100;
-        constexpr bool print_disasm  = TickerHash & 0b00010;
-        constexpr bool print_details = TickerHash & 0b00001;
-        arr[TickerHash] = tick_until<MXLEN_t, limit_cycles, check_events, print_regs, print_disasm, print_details>;
+constexpr std::array<tick_func<MXLEN_t>, 64> add_tickers(std::array<tick_func<MXLEN_t>, 64> arr) {
+    if constexpr (TickerHash < 64) {
+        constexpr bool trace_binary  = TickerHash & 0b100000;
+        constexpr bool limit_cycles  = TickerHash & 0b010000;
+        constexpr bool check_events  = TickerHash & 0b001000;
+        constexpr bool print_regs    = TickerHash & 0b000100;
+        constexpr bool print_disasm  = TickerHash & 0b000010;
+        constexpr bool print_details = TickerHash & 0b000001;
+        arr[TickerHash] = tick_until<MXLEN_t, limit_cycles, check_events, print_regs, print_disasm, print_details, trace_binary>;
         return add_tickers<MXLEN_t, TickerHash + 1>(arr);
     }
     return arr;
 }
 
 template <typename MXLEN_t>
-constexpr std::array<tick_func<MXLEN_t>, 32> gen_tickers() {
-    std::array<tick_func<MXLEN_t>, 32> result = {0};
+constexpr std::array<tick_func<MXLEN_t>, 64> gen_tickers() {
+    std::array<tick_func<MXLEN_t>, 64> result = {0};
     result = add_tickers<MXLEN_t, 0>(result);
     return result;
 }
 
-constexpr unsigned int hash_tick_params(bool limit_cycles, bool check_events, bool print_regs, bool print_disasm, bool print_details) {
-    return (limit_cycles  ? 0b10000 : 0b00000) |
-           (check_events  ? 0b01000 : 0b00000) |
-           (print_regs    ? 0b00100 : 0b00000) |
-           (print_disasm  ? 0b00010 : 0b00000) |
-           (print_details ? 0b00001 : 0b00000);
+constexpr unsigned int hash_tick_params(bool limit_cycles, bool check_events, bool print_regs, bool print_disasm, bool print_details, bool trace_binary) {
+    return (trace_binary  ? 0b100000 : 0b000000) |
+           (limit_cycles  ? 0b010000 : 0b000000) |
+           (check_events  ? 0b001000 : 0b000000) |
+           (print_regs    ? 0b000100 : 0b000000) |
+           (print_disasm  ? 0b000010 : 0b000000) |
+           (print_details ? 0b000001 : 0b000000);
+}
+
+// How often the main thread of a free-running multi-hart run looks at the
+// event queue and the cycle limit.
+constexpr std::chrono::microseconds smpPollInterval(100);
+
+// Default number of instructions each hart runs between barriers.
+constexpr unsigned int defaultQuantum = 10000;
+
+// Default number of instructions hart zero retires per tick of mtime.
+constexpr unsigned int defaultTimebase = 100;
+
+// Longest a parked hart thread sleeps before looking at its interrupts again.
+constexpr std::chrono::microseconds parkTimeout(100);
+
+// Sleeps the thread of a hart that went idle in a free-running run. A spin
+// gets one nap, after which the hart runs and may spin and park again, while
+// WFI keeps napping until an interrupt is pending or the run stops. Hart zero
+// keeps time while it sleeps, if only a block's worth per nap.
+template <typename MXLEN_t>
+void park_hart(Hart<MXLEN_t> *hart, typename Hart<MXLEN_t>::Idle idle, char *watched, CoreLocalInterruptor *clint, EventScheduler *scheduler, ParkingLot *lot, std::atomic<bool> *stop, HartStats *stats) {
+    unsigned int hartid = (unsigned int)hart->state.mhartid;
+    if (idle == Hart<MXLEN_t>::Idle::Wfi && hart->state.InterruptPending()) {
+        return;
+    }
+    auto parked = std::chrono::steady_clock::now();
+    stats->parks++;
+    do {
+        lot->Park(hartid, watched, parkTimeout);
+        if (hartid == 0) {
+            scheduler->Advance(Hart<MXLEN_t>::fastLoopTicks);
+        }
+        clint->UpdateInterrupts(hartid, &hart->state);
+    } while (idle == Hart<MXLEN_t>::Idle::Wfi && !hart->state.InterruptPending() && !stop->load(std::memory_order_relaxed));
+    hart->state.ServiceInterrupts();
+    stats->parkedNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - parked).count();
+}
+
+// Body of each host thread in a free-running multi-hart run: the fast Tick()
+// loop, taking CLINT interrupts between blocks. Hart zero also keeps time,
+// stopping its blocks short at the next scheduled event. With a parking lot,
+// idle harts park there.
+template <typename MXLEN_t>
+void hart_thread(Hart<MXLEN_t> *hart, CoreLocalInterruptor *clint, EventScheduler *scheduler, ParkingLot *lot, std::atomic<bool> *stop, const ThreadPinning *pinning, HartStats *stats) {
+    unsigned int hartid = (unsigned int)hart->state.mhartid;
+    stats->pinned = pinning->PinCurrentThread(hartid);
+    __uint64_t retired = 0;
+    while (!stop->load(std::memory_order_relaxed)) {
+        if (hartid == 0) {
+            unsigned int ran = hart->Tick(scheduler->Headroom(Hart<MXLEN_t>::fastLoopTicks));
+            retired += ran;
+            scheduler->Advance(ran);
+        } else {
+            retired += hart->Tick();
+        }
+        clint->UpdateInterrupts(hartid, &hart->state);
+        hart->state.ServiceInterrupts();
+        stats->retired.store(retired, std::memory_order_relaxed);
+        if (lot != nullptr) {
+            char *watched;
+            typename Hart<MXLEN_t>::Idle idle = hart->TakeIdle(&watched);
+            if (idle != Hart<MXLEN_t>::Idle::None) [[ unlikely ]] {
+                park_hart(hart, idle, watched, clint, scheduler, lot, stop, stats);
+            }
+        }
+    }
+    stats->node = CurrentHostNode();
+}
+
+// Body of each host thread in a quantum-scheduled multi-hart run. Every hart
+// runs exactly quantum instructions, in blocks of at most fastLoopTicks, and
+// then waits for the rest at the barrier. CLINT interrupts are only sampled
+// after it, so no hart's view of time or IPIs runs more than a quantum ahead
+// of another's.
+template <typename MXLEN_t, typename Barrier>
+void quantum_hart_thread(Hart<MXLEN_t> *hart, CoreLocalInterruptor *clint, EventScheduler *scheduler, Barrier *barrier, std::atomic<bool> *stop, unsigned int quantum, bool park, const ThreadPinning *pinning, HartStats *stats) {
+    unsigned int hartid = (unsigned int)hart->state.mhartid;
+    stats->pinned = pinning->PinCurrentThread(hartid);
+    __uint64_t retired = 0;
+    while (true) {
+        run_quantum(hart, scheduler, quantum, park, stats);
+        retired += quantum;
+        stats->retired.store(retired, std::memory_order_relaxed);
+
+        auto arrived = std::chrono::steady_clock::now();
+        barrier->arrive_and_wait();
+        stats->barrierWaitNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - arrived).count();
+
+        if (stop->load(std::memory_order_relaxed)) {
+            stats->node = CurrentHostNode();
+            return;
+        }
+        clint->UpdateInterrupts(hartid, &hart->state);
+        hart->state.ServiceInterrupts();
+    }
+}
+
+// Runs every hart on a host thread of its own until an event arrives or, if
+// there is a limit, the harts have retired cycle_limit instructions between
+// them. With a quantum, the harts meet at a barrier after every quantum
+// instructions and *barriers counts the meetings; without one, they run free.
+// Idle harts park in the lot unless it is null. Returns the event, or zero
+// for the limit.
+template <typename MXLEN_t>
+unsigned int tick_harts(
+        std::vector<std::unique_ptr<Hart<MXLEN_t>>> *harts,
+        CoreLocalInterruptor *clint,
+        EventScheduler *scheduler,
+        EventQueue *eq,
+        std::vector<HartStats> *stats,
+        __uint64_t *barriers,
+        __uint64_t *ticks,
+        __uint64_t cycle_limit,
+        bool check_events,
+        unsigned int quantum,
+        ParkingLot *lot,
+        const ThreadPinning *pinning) {
+
+    std::atomic<bool> stop = false;
+    unsigned int event = 0;
+
+    auto total = [stats]() {
+        __uint64_t sum = 0;
+        for (HartStats& hartStats : *stats) {
+            sum += hartStats.retired.load(std::memory_order_relaxed);
+        }
+        return sum;
+    };
+
+    if (quantum > 0) {
+        // Runs on the last hart to arrive, while the others wait
+        auto end_of_quantum = [&]() noexcept {
+            (*barriers)++;
+            if (check_events && eq->Pending() && eq->Pop(&event)) {
+                stop = true;
+            } else if (cycle_limit > 0 && total() > cycle_limit) {
+                stop = true;
+            }
+        };
+        std::barrier barrier(harts->size(), end_of_quantum);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < harts->size(); i++) {
+            threads.emplace_back(quantum_hart_thread<MXLEN_t, decltype(barrier)>,
+                                 (*harts)[i].get(), clint, scheduler, &barrier, &stop, quantum, lot != nullptr, pinning, &(*stats)[i]);
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        *ticks = total();
+        return event;
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < harts->size(); i++) {
+        threads.emplace_back(hart_thread<MXLEN_t>, (*harts)[i].get(), clint, scheduler, lot, &stop, pinning, &(*stats)[i]);
+    }
+
+    while (true) {
+        std::this_thread::sleep_for(smpPollInterval);
+        if (check_events && eq->Pending() && eq->Pop(&event)) {
+            break;
+        }
+        if (cycle_limit > 0 && total() > cycle_limit) {
+            break;
+        }
+    }
+
+    stop = true;
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    *ticks = total();
+    return event;
 }
 
 template <typename MXLEN_t>
@@ -126,7 +357,7 @@ void run_simulation(cxxopts::ParseResult parsed_arguments) {
         fs_root = parsed_arguments["root"].as<std::string>();
     }
 
-    unsigned int cycle_limit = 0;
+    __uint64_t cycle_limit = 0;
     if (parsed_arguments.count("cycles")) {
         cycle_limit = parsed_arguments["cycles"].as<unsigned int>();
     }
@@ -155,19 +386,119 @@ void run_simulation(cxxopts::ParseResult parsed_arguments) {
         dtb_filename = parsed_arguments["dtb"].as<std::string>();
     }
 
-    bool ignore_events = parsed_arguments.count("ignore-events");
-    unsigned int check_events_every = 1000;
-    if (parsed_arguments.count("check-events-every")) {
-        check_events_every = parsed_arguments["check-events-every"].as<unsigned int>();
-        if (ignore_events) {
-            std::cerr << "Warning: --check-events-every is being overridden by --ignore-events, is this what you want?" << std::endl;
+    std::string trace_filename = "";
+    if (parsed_arguments.count("trace")) {
+        trace_filename = parsed_arguments["trace"].as<std::string>();
+        if (print_disasm) {
+            std::cerr << "Warning: --trace replaces -p d; disassemble the trace offline with grim-tracedump." << std::endl;
+            print_disasm = false;
         }
     }
 
+    TraceFormat trace_format = TraceFormat::Compressed;
+    if (parsed_arguments.count("trace-format")) {
+        std::string traceFormatString = parsed_arguments["trace-format"].as<std::string>();
+        if (traceFormatString == "raw") {
+            trace_format = TraceFormat::Raw;
+        } else if (traceFormatString != "compressed") {
+            std::cerr << "Fatal: Unknown trace format: " << traceFormatString << std::endl;
+            return;
+        }
+    }
+
+    TraceTrigger trace_start, trace_stop;
+    if (parsed_arguments.count("trace-start") &&
+        !trace_start.Parse(parsed_arguments["trace-start"].as<std::string>())) {
+        std::cerr << "Fatal: Can't parse --trace-start trigger" << std::endl;
+        return;
+    }
+    if (parsed_arguments.count("trace-stop") &&
+        !trace_stop.Parse(parsed_arguments["trace-stop"].as<std::string>())) {
+        std::cerr << "Fatal: Can't parse --trace-stop trigger" << std::endl;
+        return;
+    }
+    TraceFilter trace_filter;
+    bool trace_filtered = false;
+    if (parsed_arguments.count("trace-pc")) {
+        trace_filtered = true;
+        if (!trace_filter.ParsePcRanges(parsed_arguments["trace-pc"].as<std::string>())) {
+            std::cerr << "Fatal: Can't parse --trace-pc ranges" << std::endl;
+            return;
+        }
+    }
+    if (parsed_arguments.count("trace-priv")) {
+        trace_filtered = true;
+        if (!trace_filter.ParsePrivileges(parsed_arguments["trace-priv"].as<std::string>())) {
+            std::cerr << "Fatal: Can't parse --trace-priv modes" << std::endl;
+            return;
+        }
+    }
+    if (parsed_arguments.count("trace-asid")) {
+        trace_filtered = true;
+        trace_filter.matchAsid = true;
+        trace_filter.asid = parsed_arguments["trace-asid"].as<unsigned int>();
+    }
+
+    if (trace_start.kind == TraceTrigger::Kind::Pc && trace_stop.kind == TraceTrigger::Kind::Pc &&
+        trace_start.value == trace_stop.value) {
+        std::cerr << "Fatal: --trace-start and --trace-stop can't watch the same pc" << std::endl;
+        return;
+    }
+
+    unsigned int num_harts = 1;
+    if (parsed_arguments.count("harts")) {
+        num_harts = parsed_arguments["harts"].as<unsigned int>();
+        if (num_harts == 0) {
+            std::cerr << "Fatal: A system needs at least one hart" << std::endl;
+            return;
+        }
+    }
+    unsigned int quantum = defaultQuantum;
+    if (parsed_arguments.count("quantum")) {
+        quantum = parsed_arguments["quantum"].as<unsigned int>();
+    }
+    unsigned int timebase = defaultTimebase;
+    if (parsed_arguments.count("timebase")) {
+        timebase = parsed_arguments["timebase"].as<unsigned int>();
+        if (timebase == 0) {
+            std::cerr << "Fatal: --timebase must be at least one instruction per mtime tick" << std::endl;
+            return;
+        }
+    }
+    bool deterministic = parsed_arguments.count("deterministic");
+    if (deterministic && quantum == 0) {
+        std::cerr << "Fatal: --deterministic needs a quantum to hand the harts over at" << std::endl;
+        return;
+    }
+    if (num_harts > 1) {
+        if (print_regs || print_disasm || print_details || print_mem || !trace_filename.empty()) {
+            std::cerr << "Warning: Tracing and printing of [d]isassembly, [r]egisters, details and [m]emory only work with one hart, ignoring them." << std::endl;
+        }
+        print_regs = print_disasm = print_details = print_mem = false;
+        trace_filename = "";
+    }
+
+    bool check_events = !parsed_arguments.count("ignore-events");
+    bool park = num_harts > 1 && !parsed_arguments.count("no-park");
+    bool fast_forward = !parsed_arguments.count("no-fast-forward");
+
+    ThreadPinning pinning;
+    if (parsed_arguments.count("pin") && !pinning.Parse(parsed_arguments["pin"].as<std::string>())) {
+        std::cerr << "Fatal: --pin takes CPU lists separated by colons, one per hart, as in 0:1:2-3" << std::endl;
+        return;
+    }
+    MemoryPlacement placement;
+    if (parsed_arguments.count("numa") && !placement.Parse(parsed_arguments["numa"].as<std::string>())) {
+        std::cerr << "Fatal: --numa takes bind:LIST or interleave:LIST, with a list of node numbers such as 0,1 or 0-3" << std::endl;
+        return;
+    }
+    bool print_placement = parsed_arguments.count("pin") || parsed_arguments.count("numa");
+
     // -- System Construction --
 
     Bus bus;
-    std::queue<unsigned int> eq;
+    EventQueue eq;
+    EventScheduler scheduler;
 
     IOLogger iologger(&bus, &std::cout); // TODO a locking stream
     iologger.SetPrintContents(true);
@@ -176,17 +507,28 @@ void run_simulation(cxxopts::ParseResult parsed_arguments) {
 
     MappedPhysicalMemory mem(0x100000000);
     bus.AddDevice32((Device*)&mem, 0, 0xffffffff);
+    // Before anything touches RAM, since pages stay where they're first placed
+    if (!placement.Apply(mem.HostStart(), mem.HostSize())) {
+        std::cerr << "Fatal: Couldn't place guest RAM on the --numa nodes: " << strerror(errno) << std::endl;
+        return;
+    }
 
-    Hart<MXLEN_t> *hart;
-    hart = new Hart<MXLEN_t>(hartDevice, RISCV::stringToExtensions("imacsu"));
+    // Everything on the system bus but memory, so that each hart of a
+    // multi-hart system can map the same devices on a bus of its own.
+    struct DeviceMapping { Device *device; __uint32_t address; __uint32_t sizeMinusOne; };
+    std::vector<DeviceMapping> deviceMappings;
+    auto map_device = [&bus, &deviceMappings](Device *device, __uint32_t address, __uint32_t sizeMinusOne) {
+        bus.AddDevice32(device, address, sizeMinusOne);
+        deviceMappings.push_back({ device, address, sizeMinusOne });
+    };
 
     UART uart;
-    bus.AddDevice32(&uart, 0x01000000, 0xf);
-    CoreLocalInterruptor clint;
-    bus.AddDevice32(&clint, 0x02000000, 0xfffff);
+    map_device(&uart, 0x01000000, 0xf);
+    CoreLocalInterruptor clint(&scheduler, num_harts, timebase);
+    map_device(&clint, 0x02000000, 0xfffff);
     const __uint32_t shutdownEvent = 0x0D15EA5E;
     PowerButton powerButton(&eq, shutdownEvent);
-    bus.AddDevice32(&powerButton, 0x01000010, 0xf);
+    map_device(&powerButton, 0x01000010, 0xf);
 
     ProxyKernelServer pkServer(hartDevice, &eq, shutdownEvent);
     pkServer.SetCommandLine(arg_string);
@@ -210,7 +552,7 @@ void run_simulation(cxxopts::ParseResult parsed_arguments) {
         if (elf.sections[sid].name.compare(".htif") == 0) {
             std::cout << "    Setting up simulated device on behalf of proxy kernel" << std::endl;
             __uint64_t mask = MaskForSize(elf.sectionHeaders[sid].sh_size);
-            bus.AddDevice32(&pkServer, elf.sectionHeaders[sid].sh_addr, mask);
+            map_device(&pkServer, elf.sectionHeaders[sid].sh_addr, mask);
         }
 
         if (elf.sections[sid].name.compare(".tohost") == 0) {
@@ -237,8 +579,41 @@ void run_simulation(cxxopts::ParseResult parsed_arguments) {
                             elf.sections[sid].bytes.data());
     }
 
-    hart->state.resetVector = elf.elfHeader.e_entry;
-    hart->Reset();
+    // -- Build the Harts --
+
+    // A lone hart uses the system bus. Otherwise each hart gets a bus and a
+    // view of memory of its own, since the DMI hint a device hands back after
+    // each access is per device, and harts on other threads would race on it.
+    std::vector<std::unique_ptr<MappedPhysicalMemory>> memViews;
+    std::vector<std::unique_ptr<Bus>> hartBuses;
+    std::vector<std::unique_ptr<Hart<MXLEN_t>>> harts;
+    ReservationSet reservations(num_harts);
+    ParkingLot parkingLot(num_harts);
+    if (park) {
+        clint.WakeOnSoftwareInterrupt(&parkingLot);
+    }
+    for (unsigned int hartid = 0; hartid < num_harts; hartid++) {
+        Device *target = hartDevice;
+        if (num_harts > 1) {
+            memViews.emplace_back(new MappedPhysicalMemory(&mem));
+            hartBuses.emplace_back(new Bus());
+            hartBuses.back()->AddDevice32(memViews.back().get(), 0, 0xffffffff);
+            for (DeviceMapping& mapping : deviceMappings) {
+                hartBuses.back()->AddDevice32(mapping.device, mapping.address, mapping.sizeMinusOne);
+            }
+            target = hartBuses.back().get();
+        }
+        harts.emplace_back(new Hart<MXLEN_t>(target, RISCV::stringToExtensions("imacsu")));
+        harts.back()->state.mhartid = hartid;
+        if (num_harts > 1) {
+            harts.back()->ShareReservations(&reservations);
+            harts.back()->ShareParkingLot(park ? &parkingLot : nullptr);
+        }
+        harts.back()->state.resetVector = elf.elfHeader.e_entry;
+        harts.back()->Reset();
+        harts.back()->state.regs[10] = hartid;
+    }
+    Hart<MXLEN_t> *hart = harts[0].get();
 
     // TODO make a bytes file loader class - also this is naive and non-optimal
     if (!dtb_filename.empty()) {
@@ -268,24 +643,115 @@ void run_simulation(cxxopts::ParseResult parsed_arguments) {
         hartDevice->Write32(0xf0000000, size, bytes);
         delete[] bytes;
 
-        hart->state.regs[11] = 0xf0000000;
+        for (std::unique_ptr<Hart<MXLEN_t>>& eachHart : harts) {
+            eachHart->state.regs[11] = 0xf0000000;
+        }
+    }
+
+    // -- Set Up Tracing --
+
+    TraceWriter *tracer = nullptr;
+    if (!trace_filename.empty()) {
+        TraceFileHeader header(trace_format, sizeof(MXLEN_t), hart->state.misa.extensions);
+        tracer = new TraceWriter(trace_filename, header);
+        if (!tracer->IsOpen()) {
+            std::cerr << "Fatal: Can't open trace file for writing: " << trace_filename << std::endl;
+            delete tracer;
+            return;
+        }
     }
 
     // -- Run the Simulation --
 
-    unsigned int ticks = 0;
+    __uint64_t ticks = 0;
     unsigned int event = 0;
-
-    constexpr std::array<tick_func<MXLEN_t>, 32> tickers = gen_tickers<MXLEN_t>();
-    unsigned int tick_hash = hash_tick_params(cycle_limit > 0, check_events_every > 0, print_regs, print_disasm, print_details);
-    tick_func<MXLEN_t> tick = tickers[tick_hash];
+    std::vector<HartStats> hartStats(num_harts);
+    __uint64_t barriers = 0;
+    IdleStats idleStats;
+
+    constexpr std::array<tick_func<MXLEN_t>, 64> tickers = gen_tickers<MXLEN_t>();
+
+    // Tracing starts right away unless there's a trigger to wait for. While
+    // tracing is off the run uses an untraced ticker, and only the trigger
+    // for the next switch is armed.
+    // With a filter, tracing keeps the untraced ticker and the hart itself
+    // traces the matching instructions from its fast path.
+    bool tracing = tracer != nullptr && trace_start.kind == TraceTrigger::Kind::None;
+    bool filtering = false;
+    if (tracer != nullptr) {
+        std::signal(SIGUSR1, trace_signal_handler);
+    }
 
     std::cout << "Begin Simulation" << std::endl;
 
+    // Harts that share the main thread all run where hart zero would
+    bool threaded = num_harts > 1 && !deterministic;
+    if (!threaded) {
+        hartStats[0].pinned = pinning.PinCurrentThread(0);
+    }
+
     auto begin = std::chrono::high_resolution_clock::now();
-    event = tick(hart, &clint, &eq, &std::cout, &ticks, cycle_limit, check_events_every, useRegAbiNames);
+    if (num_harts > 1) {
+        if (deterministic) {
+            event = tick_harts_deterministic<MXLEN_t>(&harts, &clint, &scheduler, &eq, &hartStats, &barriers, &ticks, cycle_limit, check_events, quantum, park);
+        } else {
+            event = tick_harts<MXLEN_t>(&harts, &clint, &scheduler, &eq, &hartStats, &barriers, &ticks, cycle_limit, check_events, quantum, park ? &parkingLot : nullptr, &pinning);
+        }
+    } else {
+        while (true) {
+            TraceTrigger armed = tracer == nullptr ? TraceTrigger() : (tracing ? trace_stop : trace_start);
+            __uint64_t trigger_at = ~(__uint64_t)0;
+            if (filtering != (tracing && trace_filtered)) {
+                filtering = tracing && trace_filtered;
+                hart->SetTraceFilter(filtering ? tracer : nullptr, &trace_filter);
+            }
+            hart->ClearBreaks();
+            switch (armed.kind) {
+            case TraceTrigger::Kind::Count:
+                if (armed.value > ticks) {
+                    trigger_at = armed.value;
+                }
+                break;
+            case TraceTrigger::Kind::Pc:
+                hart->SetBreakpoint(armed.value);
+                break;
+            case TraceTrigger::Kind::Privilege:
+                hart->BreakOnPrivilegeChange(true);
+                break;
+            default:
+                break;
+            }
+
+            unsigned int tick_hash = hash_tick_params(cycle_limit > 0, check_events, print_regs, print_disasm, print_details, tracing && !filtering);
+            tick_func<MXLEN_t> tick = tickers[tick_hash];
+            event = tick(hart, &clint, &scheduler, &eq, &std::cout, tracer, &ticks, cycle_limit, trigger_at, fast_forward ? &idleStats : nullptr, useRegAbiNames);
+            if (event != traceTriggerEvent) {
+                break;
+            }
+
+            bool fired = trace_signal_pending ||
+                         ticks >= trigger_at ||
+                         armed.kind == TraceTrigger::Kind::Pc ||
+                         (armed.kind == TraceTrigger::Kind::Privilege && hart->state.privilegeMode == armed.value);
+            trace_signal_pending = 0;
+            if (fired) {
+                tracing = !tracing;
+                std::cout << "Tracing " << (tracing ? "started" : "stopped") << " at instruction "
+                          << std::dec << ticks << std::endl;
+            }
+        }
+        hart->ClearBreaks();
+        hart->SetTraceFilter(nullptr, nullptr);
+    }
     auto end = std::chrono::high_resolution_clock::now();
 
+    if (tracer != nullptr) {
+        tracer->Close();
+        std::cout << "Wrote " << std::dec << tracer->RecordsWritten()
+                  << " trace records to " << trace_filename << std::endl;
+        delete tracer;
+    }
+
     if (print_summary) {
 
         if (event != 0) {
@@ -297,10 +763,16 @@ void run_simulation(cxxopts::ParseResult parsed_arguments) {
                       << std::endl;
         }
 
-        std::cout << "Final hart state:" << std::endl;
-        PrintArchDetails<MXLEN_t>(&hart->state, &std::cout);
-        PrintRegisters<MXLEN_t>(&hart->state, &std::cout, useRegAbiNames, 4);
-        std::cout << std::endl;
+        for (std::unique_ptr<Hart<MXLEN_t>>& eachHart : harts) {
+            if (num_harts > 1) {
+                std::cout << "Final state of hart " << std::dec << (unsigned int)eachHart->state.mhartid << ":" << std::endl;
+            } else {
+                std::cout << "Final hart state:" << std::endl;
+            }
+            PrintArchDetails(&eachHart->state, &std::cout);
+            PrintRegisters(&eachHart->state, &std::cout, useRegAbiNames, 4);
+            std::cout << std::endl;
+        }
 
     }
 
@@ -315,6 +787,61 @@ void run_simulation(cxxopts::ParseResult parsed_arguments) {
         std::cout << "Instructions retired: " << std::dec << ticks << std::endl;
         std::cout << "Run time: " << std::dec << seconds << "s" << std::endl;
         std::cout << "MIPS: " << mips << std::endl;
+        if (num_harts > 1 && quantum > 0) {
+            std::cout << "Barriers: " << std::dec << barriers << ", one every " << quantum << " instructions per hart" << std::endl;
+            for (unsigned int i = 0; i < num_harts && !deterministic; i++) {
+                double waited = (double)hartStats[i].barrierWaitNanoseconds/1000000000.0;
+                std::cout << "Hart " << i << " waited at barriers: " << waited << "s ("
+                          << 100.0 * waited / seconds << "%)" << std::endl;
+            }
+        }
+        if (num_harts == 1 && fast_forward) {
+            std::cout << "WFI fast-forwards: " << std::dec << idleStats.fastForwards
+                      << ", skipping " << idleStats.skippedTime << " instructions' worth of time" << std::endl;
+        }
+        for (unsigned int i = 0; i < num_harts && park; i++) {
+            std::cout << "Hart " << std::dec << i << " went idle " << hartStats[i].parks << " times";
+            if (quantum > 0) {
+                std::cout << ", giving up " << hartStats[i].skippedTicks << " instructions of its quanta" << std::endl;
+            } else {
+                double parked = (double)hartStats[i].parkedNanoseconds/1000000000.0;
+                std::cout << ", parked for " << parked << "s (" << 100.0 * parked / seconds << "%)" << std::endl;
+            }
+        }
+    }
+
+    if (print_placement) {
+        // Harts without a thread of their own ran on the main one
+        if (!threaded) {
+            hartStats[0].node = CurrentHostNode();
+        }
+        std::vector<__uint64_t> pagesPerNode;
+        std::cout << std::endl;
+        std::cout << "Placement Summary" << std::endl;
+        if (!MemoryPlacement::SampleNodes(mem.HostStart(), mem.HostSize(), &pagesPerNode)) {
+            std::cout << "Guest RAM placement unknown: " << strerror(errno) << std::endl;
+        } else {
+            __uint64_t resident = 0;
+            std::cout << "Sampled resident guest RAM pages by node:";
+            for (unsigned int node = 0; node < pagesPerNode.size(); node++) {
+                if (pagesPerNode[node] > 0) {
+                    std::cout << " " << std::dec << node << ": " << pagesPerNode[node];
+                    resident += pagesPerNode[node];
+                }
+            }
+            std::cout << std::endl;
+            for (unsigned int i = 0; i < num_harts; i++) {
+                HartStats *stats = &hartStats[threaded ? i : 0];
+                std::cout << "Hart " << std::dec << i << (stats->pinned ? "" : " (pinning failed)");
+                if (stats->node < 0 || (unsigned int)stats->node >= pagesPerNode.size() || resident == 0) {
+                    std::cout << std::endl;
+                    continue;
+                }
+                __uint64_t remote = resident - pagesPerNode[stats->node];
+                std::cout << " ended on node " << stats->node << ", "
+                          << 100.0 * (double)remote / (double)resident << "% of sampled pages remote" << std::endl;
+            }
+        }
     }
 }
 
@@ -331,7 +858,22 @@ int main(int argc, char **argv) {
     ("a,args", "Argument string returned by getmainvars system call", cxxopts::value<std::string>())
     ("r,root", "Host directory to serve as the simulated file system's root", cxxopts::value<std::string>())
     ("c,cycles", "Number of cycles to run, 0 for unlimited", cxxopts::value<unsigned int>())
-    ("e,check-events-every", "Number of cycles between checking the event queue", cxxopts::value<unsigned int>())
+    ("n,harts", "Number of harts, each run on a host thread of its own", cxxopts::value<unsigned int>())
+    ("q,quantum", "Instructions each hart runs between barriers when there are several, 0 to let them run free (default 10000)", cxxopts::value<unsigned int>())
+    ("timebase", "Instructions hart zero retires per tick of the CLINT's mtime (default 100)", cxxopts::value<unsigned int>())
+    ("ignore-events", "Keep running when a device raises an event, like a request to shut down")
+    ("pin", "Pin hart threads to host CPUs, a CPU list per hart separated by colons, as in 0:1:2-3", cxxopts::value<std::string>())
+    ("numa", "Place guest RAM on host NUMA nodes, as bind:LIST or interleave:LIST", cxxopts::value<std::string>())
+    ("no-fast-forward", "Run a lone hart's WFI as a NOP instead of moving time to the next timer event")
+    ("no-park", "Keep the host threads of harts idling in WFI or spin loops running")
+    ("deterministic", "Run several harts on one host thread, a quantum each in turn, so every run of the same program is the same")
+    ("t,trace", "File to write a binary instruction trace into, see grim-tracedump", cxxopts::value<std::string>())
+    ("trace-format", "Format of the --trace file, one of (compressed, raw)", cxxopts::value<std::string>())
+    ("trace-start", "Wait to trace until a trigger: count:N, pc:ADDRESS, priv:[msu] or signal (SIGUSR1 always toggles)", cxxopts::value<std::string>())
+    ("trace-stop", "Stop tracing at a trigger, same forms as --trace-start", cxxopts::value<std::string>())
+    ("trace-pc", "Only trace pcs in these ranges, as FIRST-LAST[,FIRST-LAST...]", cxxopts::value<std::string>())
+    ("trace-priv", "Only trace in these privilege modes, any of the letters m, s and u", cxxopts::value<std::string>())
+    ("trace-asid", "Only trace in this address space, by satp ASID", cxxopts::value<unsigned int>())
     ("p,print", "String matching /[drtcms]*/ for [d]isassembly, [r]egisters, [t]iming, system [c]alls, [m]emory transcations and a final [s]ummary", cxxopts::value<std::string>())
     ("h,help", "Print help message");
 
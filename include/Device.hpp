@@ -13,8 +13,15 @@ public:
 
     void *hint = nullptr;
 
+    // Devices aren't ticked. One with something to do at a point in time
+    // takes the EventScheduler and registers a callback with it instead.
     virtual inline void Reset() { };
-    virtual inline unsigned int Tick() { return 1; };
+
+    // For memory the host can reach directly: the range of addresses around
+    // address that map onto one contiguous host mapping, and the host address
+    // of *first, so a hart can access them without transactions. False for
+    // anything else, such as registers with side effects.
+    virtual bool DirectRange(__uint64_t address, __uint64_t* first, __uint64_t* last, char** host) { return false; }
 
     /*
      * Generic transaction helper function template. Instantiates as one of the
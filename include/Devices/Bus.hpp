@@ -1,6 +1,7 @@
 #pragma once
 
 #include <Device.hpp>
+#include <algorithm>
 #include <vector>
 #include <iostream>
 #include <iomanip>
@@ -19,6 +20,25 @@ public:
     virtual __uint64_t Fetch64(__uint64_t startAddress, __uint64_t size, char* buf) override { return TransactInternal<__uint64_t, AccessType::X>(startAddress, size, buf); }
     virtual __uint128_t Fetch128(__uint128_t startAddress, __uint128_t size, char* buf) override { return TransactInternal<__uint128_t, AccessType::X>(startAddress, size, buf); }
 
+    // The part of a direct range of the device at address that isn't
+    // covered by another device.
+    virtual bool DirectRange(__uint64_t address, __uint64_t* first, __uint64_t* last, char** host) override {
+        for (BusMapping<__uint64_t> &candidate : mappings64) {
+            if (address >= candidate.first && address <= candidate.last) {
+                __uint64_t deviceFirst, deviceLast;
+                char* deviceHost;
+                if (!candidate.target->DirectRange(address - candidate.deviceStart, &deviceFirst, &deviceLast, &deviceHost)) {
+                    return false;
+                }
+                *first = std::max(candidate.first, candidate.deviceStart + deviceFirst);
+                *last = std::min(candidate.last, candidate.deviceStart + deviceLast);
+                *host = deviceHost + (*first - candidate.deviceStart - deviceFirst);
+                return true;
+            }
+        }
+        return false;
+    }
+
     void AddDevice32(Device *dev, __uint32_t address, __uint32_t sizeMinusOne) {
         AddDevice<__uint32_t>(dev, address, sizeMinusOne);
         AddDevice<__uint64_t>(dev, address, sizeMinusOne);
@@ -1,68 +1,223 @@
 #pragma once
 
-#include <Device.hpp>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
 
+#include <Device.hpp>
+#include <EventScheduler.hpp>
+#include <HartState.hpp>
+#include <ParkingLot.hpp>
+#include <RiscV.hpp>
+
+/*
+ * SiFive style CLINT, with a software interrupt register (msip) and a timer
+ * compare register (mtimecmp) per hart, and one shared mtime. mtime isn't
+ * stored; it's virtual time divided by the timebase, plus whatever offset the
+ * guest wrote into it. Each armed mtimecmp is an event in the scheduler, and
+ * only when it comes due is the hart's timer line raised, so nothing compares
+ * mtime against mtimecmp in between.
+ *
+ * Harts on different host threads write each other's msip to send IPIs and
+ * their own mtimecmp to arm timers, so the registers and lines are atomic, and
+ * each hart samples its own lines between blocks with UpdateInterrupts().
+ */
 class CoreLocalInterruptor : public Device {
 
 private:
 
-    __uint32_t msip[5];
-    __uint64_t mtimecmp[5];
-    __uint64_t mtime;
+    static constexpr __uint32_t msipBase = 0x0000; // Must stay at zero, see Decode()
+    static constexpr __uint32_t mtimecmpBase = 0x4000;
+    static constexpr __uint32_t mtimeAddress = 0xbff8;
+
+    EventScheduler* scheduler;
+    __uint64_t ticksPerMtime;
+    unsigned int harts;
+    std::unique_ptr<std::atomic<__uint32_t>[]> msip;
+    std::unique_ptr<std::atomic<__uint64_t>[]> mtimecmp;
+    std::unique_ptr<std::atomic<bool>[]> mtiPending;
+    std::unique_ptr<unsigned int[]> timerEvents; // Scheduler ids, by hart
+    std::atomic<__uint64_t> mtimeOffset = 0;
+    std::mutex timerLock; // Serializes rescheduling
+    ParkingLot* parking = nullptr;
+
+    // Finds the register holding startAddress, and the byte offset into it.
+    // Accesses are 4 or 8 bytes and may not straddle two registers. mtime
+    // isn't a register, so it isn't found here.
+    template<typename REG_t>
+    inline std::atomic<REG_t>* Decode(__uint32_t startAddress, __uint32_t size, unsigned int* offset) {
+        __uint32_t base = 0;
+        std::atomic<REG_t>* reg = nullptr;
+        if constexpr (sizeof(REG_t) == 4) {
+            if (startAddress < msipBase + 4*harts) {
+                base = msipBase + (startAddress & ~(__uint32_t)3);
+                reg = &msip[startAddress/4];
+            }
+        } else {
+            if (startAddress >= mtimecmpBase && startAddress < mtimecmpBase + 8*harts) {
+                base = mtimecmpBase + ((startAddress - mtimecmpBase) & ~(__uint32_t)7);
+                reg = &mtimecmp[(startAddress - mtimecmpBase)/8];
+            }
+        }
+        if (reg == nullptr || (size != 4 && size != 8) || startAddress - base + size > sizeof(REG_t)) {
+            return nullptr;
+        }
+        *offset = startAddress - base;
+        return reg;
+    }
+
+    inline bool IsMtime(__uint32_t startAddress, __uint32_t size) {
+        return startAddress >= mtimeAddress && (size == 4 || size == 8) && startAddress + size <= mtimeAddress + 8;
+    }
+
+    template<typename REG_t>
+    static inline void ReadBytes(std::atomic<REG_t>* reg, unsigned int offset, __uint32_t size, char* dst) {
+        REG_t value = reg->load();
+        memcpy(dst, (char*)&value + offset, size);
+    }
+
+    // Writes part or all of a register without losing a racing write to the
+    // rest of it. Only the bits in mask are writable.
+    template<typename REG_t>
+    static inline void WriteBytes(std::atomic<REG_t>* reg, unsigned int offset, __uint32_t size, char* src, REG_t mask) {
+        REG_t expected = reg->load();
+        REG_t desired;
+        do {
+            desired = expected;
+            memcpy((char*)&desired + offset, src, size);
+            desired = (desired & mask) | (expected & ~mask);
+        } while (!reg->compare_exchange_weak(expected, desired));
+    }
+
+    // Raises the hart's timer line if its mtimecmp has been reached, and
+    // otherwise schedules the moment it will be. Runs when mtimecmp or mtime
+    // is written, and as the scheduled event itself.
+    void Reschedule(unsigned int hartid) {
+        std::lock_guard<std::mutex> guard(timerLock);
+        __uint64_t deadline = mtimecmp[hartid].load();
+        __uint64_t now = Mtime();
+        if (deadline <= now) {
+            mtiPending[hartid].store(true, std::memory_order_release);
+            scheduler->Cancel(timerEvents[hartid]);
+            if (parking != nullptr) {
+                parking->Wake(hartid);
+            }
+            return;
+        }
+        mtiPending[hartid].store(false, std::memory_order_release);
+        __uint64_t mtimeTicksLeft = deadline - now;
+        __uint64_t tickStart = scheduler->Now() - scheduler->Now() % ticksPerMtime;
+        if (mtimeTicksLeft > (EventScheduler::never - tickStart) / ticksPerMtime) {
+            // Disarmed, or as good as
+            scheduler->Cancel(timerEvents[hartid]);
+            return;
+        }
+        scheduler->Schedule(timerEvents[hartid], tickStart + mtimeTicksLeft * ticksPerMtime);
+    }
 
 public:
-    
-    virtual __uint32_t Read32(__uint32_t startAddress, __uint32_t size, char* dst) override {
 
-        if (size != 4) {
-            // TODO logging and 64bit
-            return 0;
+    // The timebase is how many ticks of virtual time, which is to say
+    // instructions retired by hart zero, make one tick of mtime.
+    CoreLocalInterruptor(EventScheduler* eventScheduler, unsigned int numHarts = 1, __uint64_t timebase = 1) :
+        scheduler(eventScheduler),
+        ticksPerMtime(timebase == 0 ? 1 : timebase),
+        harts(numHarts),
+        msip(new std::atomic<__uint32_t>[numHarts]),
+        mtimecmp(new std::atomic<__uint64_t>[numHarts]),
+        mtiPending(new std::atomic<bool>[numHarts]),
+        timerEvents(new unsigned int[numHarts]) {
+        for (unsigned int i = 0; i < harts; i++) {
+            timerEvents[i] = scheduler->Register([this, i]() { Reschedule(i); });
         }
-        
-        __uint32_t value = 0;
-
-        if (startAddress < 0x4000) {
-            unsigned int msip_idx = startAddress/4;
-            if (msip_idx <= 4)
-                value = msip[msip_idx];
-        } else if (startAddress < 0xb000) {
-            unsigned int mtimecmp_idx = (startAddress-0x4000)/8;
-            if (mtimecmp_idx <= 4)
-                value = mtimecmp[mtimecmp_idx];
-        } else if (startAddress == 0xbff8) {
-            value = mtime;
+        Reset();
+    }
+
+    virtual void Reset() override {
+        mtimeOffset = 0 - scheduler->Now() / ticksPerMtime;
+        for (unsigned int i = 0; i < harts; i++) {
+            msip[i] = 0;
+            mtimecmp[i] = ~(__uint64_t)0;
+            Reschedule(i);
         }
+    }
 
-        *((__uint32_t*)dst) = value;
+    inline __uint64_t Mtime() {
+        return scheduler->Now() / ticksPerMtime + mtimeOffset.load(std::memory_order_relaxed);
+    }
+
+    // Wakes a parked hart as soon as another raises its software interrupt,
+    // or its timer comes due.
+    void WakeOnSoftwareInterrupt(ParkingLot* lot) {
+        parking = lot;
+    }
+
+    // Samples the software and timer interrupt lines of one hart into its
+    // mip. Returns true if either line changed.
+    bool UpdateInterrupts(unsigned int hartid, RISCV::interruptReg* mip) {
+        if (hartid >= harts) {
+            return false;
+        }
+        bool msi = msip[hartid].load(std::memory_order_acquire) & 1;
+        bool mti = mtiPending[hartid].load(std::memory_order_acquire);
+        if (msi == mip->msi && mti == mip->mti) [[ likely ]] {
+            return false;
+        }
+        mip->msi = msi;
+        mip->mti = mti;
+        return true;
+    }
+
+    // The same for a whole hart, whose interrupt summary has to follow mip.
+    template<typename XLEN_t, typename Owner>
+    inline void UpdateInterrupts(unsigned int hartid, HartState<XLEN_t, Owner>* state) {
+        if (UpdateInterrupts(hartid, &state->mip)) {
+            state->UpdateInterruptSummary();
+        }
+    }
+
+    virtual __uint32_t Read32(__uint32_t startAddress, __uint32_t size, char* dst) override {
+
+        unsigned int offset;
+        if (std::atomic<__uint32_t>* reg = Decode<__uint32_t>(startAddress, size, &offset)) {
+            ReadBytes(reg, offset, size, dst);
+        } else if (std::atomic<__uint64_t>* reg = Decode<__uint64_t>(startAddress, size, &offset)) {
+            ReadBytes(reg, offset, size, dst);
+        } else if (IsMtime(startAddress, size)) {
+            __uint64_t now = Mtime();
+            memcpy(dst, (char*)&now + (startAddress - mtimeAddress), size);
+        } else {
+            memset(dst, 0, size);
+        }
         return size;
-        
+
     }
     virtual __uint64_t Read64(__uint64_t startAddress, __uint64_t size, char* dst) override { return Read32(startAddress & 0xffffffff, size, dst); }
     virtual __uint128_t Read128(__uint128_t startAddress, __uint128_t size, char* dst) override { return Read32(startAddress & 0xffffffff, size, dst); }
 
     virtual __uint32_t Write32(__uint32_t startAddress, __uint32_t size, char* src) override {
 
-        if (size != 4) {
-            // TODO logging and 64bit
-            return 0;
+        unsigned int offset;
+        if (std::atomic<__uint32_t>* reg = Decode<__uint32_t>(startAddress, size, &offset)) {
+            // Only bit zero of msip is implemented
+            WriteBytes<__uint32_t>(reg, offset, size, src, 1);
+            if (parking != nullptr && (reg->load() & 1)) {
+                parking->Wake(startAddress/4);
+            }
+        } else if (std::atomic<__uint64_t>* reg = Decode<__uint64_t>(startAddress, size, &offset)) {
+            WriteBytes<__uint64_t>(reg, offset, size, src, ~(__uint64_t)0);
+            Reschedule((startAddress - mtimecmpBase)/8);
+        } else if (IsMtime(startAddress, size)) {
+            __uint64_t now = Mtime();
+            memcpy((char*)&now + (startAddress - mtimeAddress), src, size);
+            mtimeOffset = now - scheduler->Now() / ticksPerMtime;
+            for (unsigned int i = 0; i < harts; i++) {
+                Reschedule(i);
+            }
         }
-
-        __uint32_t value = *((__uint32_t*)src);
-
-        if (startAddress < 0x4000) {
-            unsigned int msip_idx = startAddress/4;
-            if (msip_idx <= 4)
-                msip[msip_idx] = value;
-        } else if (startAddress < 0xb000) {
-            unsigned int mtimecmp_idx = (startAddress-0x4000)/8;
-            if (mtimecmp_idx <= 4)
-                mtimecmp[mtimecmp_idx] = value;
-        } else if (startAddress == 0xbff8) {
-            mtime = value;
-        }
-
         return size;
-        
+
     }
 
     virtual __uint64_t Write64(__uint64_t startAddress, __uint64_t size, char* src) override { return Write32(startAddress & 0xffffffff, size, src); }
@@ -70,7 +225,5 @@ public:
     virtual __uint32_t Fetch32(__uint32_t startAddress, __uint32_t size, char* dst) override { return 0; }
     virtual __uint64_t Fetch64(__uint64_t startAddress, __uint64_t size, char* dst) override { return 0; }
     virtual __uint128_t Fetch128(__uint128_t startAddress, __uint128_t size, char* dst) override { return 0; }
-    virtual unsigned int Tick() override { return 1; }
-
 
 };
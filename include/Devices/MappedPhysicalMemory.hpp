@@ -11,7 +11,7 @@
 class MappedPhysicalMemory final : public Device {
 
 public:
-    MappedPhysicalMemory(__uint64_t size) {
+    MappedPhysicalMemory(__uint64_t size) : memSize(size) {
         memStartAddress = (char*)mmap(
             NULL,
             size,
@@ -22,6 +22,25 @@ public:
         assert(memStartAddress != MAP_FAILED);
     }
 
+    // Another view of the same memory with a hint of its own, so harts on
+    // different threads don't race on the hint of a shared device.
+    MappedPhysicalMemory(MappedPhysicalMemory* shared) : memStartAddress(shared->memStartAddress), memSize(shared->memSize) { }
+
+    // The host mapping, for placing it on NUMA nodes and finding out where
+    // it ended up.
+    char* HostStart() { return memStartAddress; }
+    __uint64_t HostSize() { return memSize; }
+
+    virtual bool DirectRange(__uint64_t address, __uint64_t* first, __uint64_t* last, char** host) override {
+        if (address >= memSize) {
+            return false;
+        }
+        *first = 0;
+        *last = memSize - 1;
+        *host = memStartAddress;
+        return true;
+    }
+
     virtual __uint32_t Read32(__uint32_t startAddress, __uint32_t size, char* buf) override {
         return TransactInternal<__uint32_t, AccessType::R>(startAddress, size, buf);
     }
@@ -61,6 +80,7 @@ public:
 private:
 
     char* memStartAddress;
+    __uint64_t memSize;
 
     template <typename T, AccessType accessType>
     inline T TransactInternal(T startAddress, T size, char* buf) {
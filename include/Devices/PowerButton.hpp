@@ -1,18 +1,18 @@
 #pragma once
 
 #include <Device.hpp>
-#include <queue>
+#include <EventQueue.hpp>
 
 class PowerButton : public Device {
 
 private:
 
-    std::queue<unsigned int> *events;
+    EventQueue *events;
     __uint32_t shutdownEvent;
 
 public:
     
-    PowerButton(std::queue<unsigned int> *eq, __uint32_t shutdownEventNumber) : events(eq), shutdownEvent(shutdownEventNumber) { }
+    PowerButton(EventQueue *eq, __uint32_t shutdownEventNumber) : events(eq), shutdownEvent(shutdownEventNumber) { }
     virtual __uint32_t Read32(__uint32_t startAddress, __uint32_t size, char* dst) override { return 0; }
     virtual __uint32_t Write32(__uint32_t startAddress, __uint32_t size, char* src) override {
         if (size != 4) {
@@ -20,7 +20,7 @@ public:
             return 0;
         }
         // __uint32_t value = *((__uint32_t*)src);
-        events->push(shutdownEvent);
+        events->Push(shutdownEvent);
         return size;
     }
     virtual __uint64_t Write64(__uint64_t startAddress, __uint64_t size, char* src) override { return Write32(startAddress & 0xffffffff, size, src); }
@@ -7,7 +7,6 @@
 #include <unordered_map>
 #include <iostream>
 #include <fstream>
-#include <queue>
 #include <filesystem>
 #include <fcntl.h>
 
@@ -134,7 +133,7 @@ private:
 
 public:
 
-    ProxyKernelServer(Device *systemBus, std::queue<unsigned int> *eq, __uint32_t shutdownEventNumber) : bus(systemBus), events(eq), shutdownEvent(shutdownEventNumber) { }
+    ProxyKernelServer(Device *systemBus, EventQueue *eq, __uint32_t shutdownEventNumber) : bus(systemBus), events(eq), shutdownEvent(shutdownEventNumber) { }
 
     virtual __uint32_t Read32(__uint32_t startAddress, __uint32_t size, char* dst) override {
         // TODO proper bounds checks
@@ -188,7 +187,7 @@ public:
 private:
 
     Device *bus;
-    std::queue<unsigned int> *events;
+    EventQueue *events;
 
     __uint8_t state[16];
 
@@ -297,7 +296,7 @@ private:
         return openFiles[fd];
     }
     __uint64_t sys_exit(__uint64_t arg0, __uint64_t arg1, __uint64_t arg2, __uint64_t arg3, __uint64_t arg4, __uint64_t arg5, __uint64_t arg6) {
-        events->push(shutdownEvent);
+        events->Push(shutdownEvent);
         return 0;
     }
 
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+/*
+ * Events that devices raise for the run loop, like a guest asking to shut
+ * down. Any hart's thread may push, and only the run loop pops, so this is a
+ * bounded lock-free multi-producer, single-consumer ring. Each slot carries a
+ * sequence number that says whether it is free for the producer that claimed
+ * it or ready for the consumer. Pending() is a single relaxed load, cheap
+ * enough for the run loop to call after every block.
+ */
+class EventQueue {
+
+    static constexpr size_t capacity = 64;
+    static_assert((capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+    static constexpr size_t mask = capacity - 1;
+
+    struct Slot {
+        std::atomic<size_t> sequence;
+        unsigned int event;
+    };
+
+    Slot slots[capacity];
+
+    alignas(64) std::atomic<size_t> enqueuePosition = 0; // Claimed by producers
+    alignas(64) size_t dequeuePosition = 0; // Only the consumer touches this
+
+public:
+
+    EventQueue() {
+        for (size_t i = 0; i < capacity; i++) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns false, dropping the event, if the queue is full. Nothing pushes
+    // more than a handful of events before the run loop stops, so that only
+    // happens when the run loop isn't listening anyway.
+    bool Push(unsigned int event) {
+        size_t position = enqueuePosition.load(std::memory_order_relaxed);
+        while (true) {
+            Slot* slot = &slots[position & mask];
+            ptrdiff_t lag = (ptrdiff_t)(slot->sequence.load(std::memory_order_acquire) - position);
+            if (lag == 0) {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    slot->event = event;
+                    slot->sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (lag < 0) {
+                // The consumer hasn't freed this slot from the last lap
+                return false;
+            } else {
+                position = enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // True if some producer has claimed a slot the consumer hasn't popped.
+    // Consumer side only.
+    inline bool Pending() const {
+        return enqueuePosition.load(std::memory_order_relaxed) != dequeuePosition;
+    }
+
+    // Takes the oldest event, if it has been published. Consumer side only.
+    bool Pop(unsigned int* event) {
+        Slot* slot = &slots[dequeuePosition & mask];
+        if (slot->sequence.load(std::memory_order_acquire) != dequeuePosition + 1) {
+            return false;
+        }
+        *event = slot->event;
+        slot->sequence.store(dequeuePosition + capacity, std::memory_order_release);
+        dequeuePosition++;
+        return true;
+    }
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+/*
+ * Virtual time, and the device events due at points in it. Time is counted in
+ * instructions retired by the hart that keeps time, hart zero, whose thread
+ * alone advances it. Devices register a callback once and then schedule or
+ * cancel it from any thread, say when a hart writes a timer compare register.
+ * The run loop holds the hart's fast path short of NextDeadline(), so no
+ * device costs anything between its events, however many are attached.
+ *
+ * Events sit in a min-heap. Rescheduling doesn't dig the old entry out; each
+ * client's generation goes up instead and stale entries are dropped when they
+ * reach the top.
+ */
+class EventScheduler {
+
+public:
+
+    static constexpr __uint64_t never = ~(__uint64_t)0;
+    using Callback = std::function<void()>;
+
+private:
+
+    struct Entry {
+        __uint64_t when;
+        unsigned int client;
+        __uint64_t generation;
+        bool operator>(const Entry& other) const { return when > other.when; }
+    };
+
+    struct Client {
+        Callback callback;
+        __uint64_t generation = 0;
+    };
+
+    std::mutex lock;
+    std::vector<Client> clients;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+
+    std::atomic<__uint64_t> now = 0;
+    std::atomic<__uint64_t> nextDeadline = never;
+
+    // Drops stale entries from the top and republishes the next deadline.
+    // Call with the lock held.
+    void Settle() {
+        while (!heap.empty() && heap.top().generation != clients[heap.top().client].generation) {
+            heap.pop();
+        }
+        nextDeadline.store(heap.empty() ? never : heap.top().when, std::memory_order_release);
+    }
+
+public:
+
+    // Returns the id to schedule the callback by. Register every client
+    // before the run starts.
+    unsigned int Register(Callback callback) {
+        std::lock_guard<std::mutex> guard(lock);
+        clients.push_back({ callback });
+        return (unsigned int)clients.size() - 1;
+    }
+
+    // Calls the client's callback once virtual time reaches when, instead of
+    // whenever it was scheduled for before. A time already past is due at
+    // the next advance.
+    void Schedule(unsigned int client, __uint64_t when) {
+        std::lock_guard<std::mutex> guard(lock);
+        heap.push({ when, client, ++clients[client].generation });
+        Settle();
+    }
+
+    void Cancel(unsigned int client) {
+        std::lock_guard<std::mutex> guard(lock);
+        clients[client].generation++;
+        Settle();
+    }
+
+    inline __uint64_t Now() const {
+        return now.load(std::memory_order_relaxed);
+    }
+
+    inline __uint64_t NextDeadline() const {
+        return nextDeadline.load(std::memory_order_acquire);
+    }
+
+    // How far the timekeeper may run before something is due, capped at max.
+    inline unsigned int Headroom(unsigned int max) const {
+        __uint64_t deadline = NextDeadline();
+        __uint64_t current = Now();
+        if (deadline <= current) {
+            return 1;
+        }
+        return deadline - current < max ? (unsigned int)(deadline - current) : max;
+    }
+
+    // Timekeeper only.
+    inline void Advance(__uint64_t ticks) {
+        __uint64_t current = now.load(std::memory_order_relaxed) + ticks;
+        now.store(current, std::memory_order_relaxed);
+        if (current >= NextDeadline()) [[ unlikely ]] {
+            RunDue();
+        }
+    }
+
+    // Jumps time to the next deadline and runs what's due there, for a
+    // timekeeper with nothing to do until then. Returns how far time moved.
+    // Timekeeper only.
+    __uint64_t SkipToNextDeadline() {
+        __uint64_t deadline = NextDeadline();
+        __uint64_t current = Now();
+        if (deadline == never || deadline <= current) {
+            return 0;
+        }
+        Advance(deadline - current);
+        return deadline - current;
+    }
+
+    // Runs the callbacks of everything due, including anything they schedule
+    // for a time already past. Callbacks run without the lock held, so they
+    // may schedule. Timekeeper only.
+    void RunDue() {
+        while (true) {
+            Callback callback;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                Settle();
+                if (heap.empty() || heap.top().when > Now()) {
+                    return;
+                }
+                callback = clients[heap.top().client].callback;
+                heap.pop();
+                Settle();
+            }
+            callback();
+        }
+    }
+};
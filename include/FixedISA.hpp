@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+#include <RiscV.hpp>
+
+// Harts normally let the guest rewrite misa, turning extensions off and on
+// again and redecoding with them. Firmware that never does can run on harts
+// built for one fixed extension set per width instead, with, say,
+// -DGRIM_FIXED_ISA32=imc -DGRIM_FIXED_ISA64=imac. Then misa always reads as
+// that set at the hart's own width, whatever the hart was constructed to
+// support, and writes to it are ignored. What depends on it, like trap
+// delegation, trap return and counter visibility, folds to constants, and
+// every hart of the width decodes through one shared set of tables.
+#define GRIM_FIXED_ISA_STRING(isa) GRIM_FIXED_ISA_STRINGIFY(isa)
+#define GRIM_FIXED_ISA_STRINGIFY(isa) #isa
+
+// Zero means the width isn't fixed
+template<typename XLEN_t>
+inline constexpr __uint32_t fixedExtensions = 0;
+
+#ifdef GRIM_FIXED_ISA32
+template<>
+inline constexpr __uint32_t fixedExtensions<__uint32_t> = RISCV::stringToExtensions(GRIM_FIXED_ISA_STRING(GRIM_FIXED_ISA32));
+#endif
+
+#ifdef GRIM_FIXED_ISA64
+template<>
+inline constexpr __uint32_t fixedExtensions<__uint64_t> = RISCV::stringToExtensions(GRIM_FIXED_ISA_STRING(GRIM_FIXED_ISA64));
+#endif
+
+template<typename XLEN_t>
+inline constexpr bool fixedISA = fixedExtensions<XLEN_t> != 0;
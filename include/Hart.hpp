@@ -1,11 +1,18 @@
 #pragma once
 
 #include <type_traits>
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <iomanip>
+#include <memory>
 
 #include <Device.hpp>
+#include <ParkingLot.hpp>
+#include <ReservationSet.hpp>
 #include <RiscVDecoder.hpp>
+#include <Trace/TraceFilter.hpp>
+#include <Trace/TraceWriter.hpp>
 
 template<typename XLEN_t>
 struct Translation {
@@ -15,13 +22,13 @@ struct Translation {
     RISCV::TrapCause generatedTrap;
 };
 
-// TODO accelerated WFI states?
 template<typename XLEN_t>
 class Hart {
 
     static constexpr bool print_physical_pc = true;
     static constexpr bool print_transactions = false;
     static constexpr bool icache_disabled = false;
+    static constexpr bool fusion_disabled = false;
     static constexpr bool memcache_disabled = false;
     static constexpr bool print_pagewalks = false && sizeof(XLEN_t) <= 8;
 
@@ -31,64 +38,345 @@ private:
 
     static constexpr unsigned int cacheBits = 12;
     static constexpr unsigned int icacheBits = 12;
-    static constexpr unsigned int fastLoopTicks = 1000;
     struct TranslationCacheEntry { char *hostPageStart; XLEN_t virtPageStart; XLEN_t validThrough; };
     TranslationCacheEntry cacheR[1 << cacheBits];
     TranslationCacheEntry cacheW[1 << cacheBits];
     TranslationCacheEntry cacheX[1 << cacheBits];
+    // fusedEncoding is the second half of a fused pair, see fusions, and
+    // zero for an entry holding a single instruction.
     struct ICacheEntry {
         XLEN_t full_pc;
         __uint32_t encoding = 0;
+        __uint32_t fusedEncoding = 0;
         DecodedInstruction<XLEN_t> instruction = nullptr;
     };
     ICacheEntry icache[1<<icacheBits];
+
+    static inline unsigned int ICacheIndex(XLEN_t pc) {
+        return (pc >> 1) & ((1<<icacheBits)-1);
+    }
+
+    // Compilers pair some instructions so often that the pair is worth one
+    // icache entry: building a constant or address with lui, c.lui or auipc
+    // then an add, and zero-extending with a shift left then right. None of
+    // these can trap, so a trap never lands between the halves. auipc then
+    // jalr, for a far call, isn't fused: without C, jalr to a target that
+    // isn't 4-byte aligned traps after auipc retired. A fill that finds the
+    // first half of one followed by the second caches a handler running
+    // both, one after the other through the same functions as apart, so any
+    // registers will do and the state between them is never seen.
+    // Tick() only runs a fused entry with room in the block for both.
+    template<DecodedInstruction<XLEN_t> first, DecodedInstruction<XLEN_t> second>
+    static void ExecuteFused(__uint32_t encoding, Hart* hart) {
+        __uint32_t secondEncoding = hart->icache[ICacheIndex(hart->state.pc)].fusedEncoding;
+        first(encoding, hart);
+        second(secondEncoding, hart);
+    }
+
+    struct Fusion {
+        DecodedInstruction<XLEN_t> first;
+        DecodedInstruction<XLEN_t> second;
+        DecodedInstruction<XLEN_t> fused;
+    };
+    template<DecodedInstruction<XLEN_t> first, DecodedInstruction<XLEN_t> second>
+    static constexpr Fusion Fuse() {
+        return { first, second, ExecuteFused<first, second> };
+    }
+    static constexpr Fusion fusions[] = {
+        Fuse<ex_lui<XLEN_t>, ex_addi<XLEN_t>>(),
+        Fuse<ex_lui<XLEN_t>, ex_addiw<XLEN_t>>(),
+        Fuse<ex_clui<XLEN_t>, ex_caddi<XLEN_t>>(),
+        Fuse<ex_auipc<XLEN_t>, ex_addi<XLEN_t>>(),
+        Fuse<ex_slli<XLEN_t>, ex_srli<XLEN_t>>(),
+        Fuse<ex_cslli<XLEN_t>, ex_csrli<XLEN_t>>(),
+    };
+    // The paging mode in effect for fetches and for loads and stores, which
+    // is Bare whenever the privilege they're made at is M. MPRV only moves
+    // loads and stores. Worked out again on a change to satp, mstatus or
+    // privilege, so that accesses don't have to.
+    RISCV::PagingMode fetchPaging = RISCV::PagingMode::Bare;
+    RISCV::PagingMode dataPaging = RISCV::PagingMode::Bare;
+
+    // Without paging an address is physical, so RAM is reached through a
+    // window onto its host mapping, skipping the translation caches: one
+    // bounds check and an add. A window opens on the first slow access to
+    // RAM, asking the bus how far the RAM goes, and is shut, span zero,
+    // while paging is on. span leaves room for the widest access.
+    struct DirectWindow { XLEN_t start = 0; XLEN_t span = 0; char* host = nullptr; };
+    static constexpr XLEN_t directWindowSlack = 16;
+    DirectWindow fetchWindow;
+    DirectWindow dataWindow;
+
+    struct DecodeTables {
+        std::array<DecodedInstruction<XLEN_t>, 1 << 20> uncompressed_inst_lut;
+        std::array<DecodedInstruction<XLEN_t>, 1 << 16> compressed_inst_lut;
+
+        void Configure(__uint32_t extensions, RISCV::XlenMode mxlen) {
+            for (__uint32_t packed_instruction = 0; packed_instruction < (1<<20); packed_instruction++) {
+                __uint32_t unpacked_encoding = 0b11 |
+                    ((0b00000000000000011111 & packed_instruction) << 2) |
+                    ((0b00000000000011100000 & packed_instruction) << 7) |
+                    ((0b11111111111100000000 & packed_instruction) << 12);
+                uncompressed_inst_lut[packed_instruction] = decode_instruction<XLEN_t>(unpacked_encoding, extensions, mxlen).executionFunction;
+            }
+            for (__uint32_t encoded = 0; encoded < 1<<16; encoded++) {
+                if ((encoded & 0b11) != 0b11) {
+                    compressed_inst_lut[encoded] = decode_instruction<XLEN_t>(encoded, extensions, mxlen).executionFunction;
+                }
+            }
+        }
+    };
+
+    // With a fixed ISA every hart of the width decodes alike, so they share
+    // tables built once, and otherwise each hart has its own to rebuild when
+    // misa changes.
+    static const DecodeTables* SharedDecodeTables() {
+        static const std::unique_ptr<DecodeTables> shared = []() {
+            std::unique_ptr<DecodeTables> tables = std::make_unique<DecodeTables>();
+            tables->Configure(fixedExtensions<XLEN_t>, RISCV::xlenTypeToMode<XLEN_t>());
+            return tables;
+        }();
+        return shared.get();
+    }
+    struct NoDecodeTables { };
+    [[no_unique_address]] std::conditional_t<fixedISA<XLEN_t>, NoDecodeTables, DecodeTables> ownDecodeTables;
+    const DecodeTables* decodeTables;
     __uint32_t configured_extensions;
     RISCV::XlenMode configured_mxlen;
-    std::array<DecodedInstruction<XLEN_t>, 1 << 20> uncompressed_inst_lut;
-    std::array<DecodedInstruction<XLEN_t>, 1 << 16> compressed_inst_lut;
+
+    // Set by every trap, so the tracing tick can tell an instruction that
+    // trapped from one that wrote its rd
+    bool trapped = false;
+
+    // Breaks stop Tick() before an instruction so the run loop can change
+    // tickers. They're only checked on icache misses, so a watched pc is never
+    // let into the icache and a requested break flushes it.
+    static constexpr XLEN_t noBreakpoint = ~(XLEN_t)0; // Odd, so never a pc
+    XLEN_t breakpointPc = noBreakpoint;
+    bool breakRequested = false;
+    bool breakOnPrivilegeChange = false;
+
+    // LR/SC reservation. reservedHost is the host address of the reserved
+    // word, or null if it isn't in DMI-capable RAM.
+    static constexpr XLEN_t noReservation = ~(XLEN_t)0; // Odd, so never aligned
+    XLEN_t reservedAddress = noReservation;
+    unsigned int reservedBytes = 0;
+    char* reservedHost = nullptr;
+    __uint64_t reservedValue = 0;
+    // Shared by every hart of a multi-hart system, see ShareReservations()
+    ReservationSet* reservations = nullptr;
+    unsigned int reservationSlot = 0;
+
+    // Idle detection, see NoteBackwardBranch()
+    static constexpr unsigned int spinThreshold = 64;
+    static constexpr XLEN_t noDataAddress = ~(XLEN_t)0;
+    // Address of the last load, LR included, since the last backward branch.
+    // Stores needn't set it: they restart the count through NoteStore().
+    XLEN_t spinLoadAddress = noDataAddress;
+    XLEN_t spinPc = 0;
+    XLEN_t spinAddress = noDataAddress;
+    unsigned int spinIterations = 0;
+    XLEN_t spinRegs[RISCV::NumRegs];
+    ParkingLot* parking = nullptr; // Told about stores, see ShareParkingLot()
+    // The last load that missed the translation caches, and where it went
+    XLEN_t slowReadAddress = noDataAddress;
+    char* slowReadHost = nullptr;
+
+    // Instructions retired by earlier blocks, and by this one as of its last
+    // icache miss, which is as often as the fast path can afford to say.
+    // Instructions touching the counters are kept out of the icache, so when
+    // they run the count is exact.
+    __uint64_t retired = 0;
+    unsigned int retiredThisBlock = 0;
+
+    static constexpr bool TouchesCounters(__uint32_t encoding) {
+        __uint32_t csr = encoding >> 20;
+        return (encoding & 0x7f) == 0x73 && (encoding & 0x3000) != 0 &&
+            ((csr & 0xf60) == RISCV::CSRAddress::MCYCLE || (csr & 0xf60) == RISCV::CSRAddress::CYCLE ||
+             csr == RISCV::CSRAddress::MCOUNTINHIBIT);
+    }
+
+    inline bool Cacheable(__uint32_t encoding) {
+        return state.pc != breakpointPc && !TouchesCounters(encoding);
+    }
+
+    // Counts of the performance events in countedPerformanceEvents, for the
+    // hpm counters. The others stay zero, and counting them is a no-op.
+    __uint64_t eventCounts[NumPerformanceEvents] = { };
+
+    template<PerformanceEvent event>
+    inline void CountEvent() {
+        if constexpr (performanceEventCounted(event)) {
+            eventCounts[event]++;
+        }
+    }
+
+    // Filtered tracing, see SetTraceFilter()
+    TraceWriter* filterTracer = nullptr;
+    const TraceFilter* traceFilter = nullptr;
+
+    static void TraceTrampoline(__uint32_t encoding, Hart* hart) {
+        hart->ExecuteAndTrace(encoding, hart->Decode(encoding), hart->filterTracer);
+    }
 
 public:
 
-    HartState<XLEN_t> state;
+    static constexpr unsigned int fastLoopTicks = 1000;
+
+    HartState<XLEN_t, Hart> state;
 
     Hart(Device* bus, __uint32_t maximalExtensions) :
         target(bus),
         configured_extensions(0),
         configured_mxlen(RISCV::XlenMode::XL128),
-        state(maximalExtensions) {
-        state.implCallback = std::bind(&Hart::Callback, this, std::placeholders::_1);
+        state(maximalExtensions, this) {
+        if constexpr (fixedISA<XLEN_t>) {
+            decodeTables = SharedDecodeTables();
+        } else {
+            decodeTables = &ownDecodeTables;
+        }
         // TODO callback for changing XLENs
         Reset();
     };
 
-    inline unsigned int Tick() {
-        for (unsigned int i = 0; i < fastLoopTicks; i++) {
+    // Runs up to maxTicks (at most fastLoopTicks) instructions, stopping early
+    // at a break. Returns the number of instructions run.
+    inline unsigned int Tick(unsigned int maxTicks = fastLoopTicks) {
+        unsigned int ticks = maxTicks < fastLoopTicks ? maxTicks : fastLoopTicks;
+        for (unsigned int i = 0; i < ticks; i++) {
 
-            unsigned int icacheIndex = (state.pc >> 1) & ((1<<icacheBits)-1);
+            unsigned int icacheIndex = ICacheIndex(state.pc);
             if constexpr (!icache_disabled) {
                 ICacheEntry *inst = &icache[icacheIndex];
                 if (inst->instruction != nullptr && inst->full_pc == state.pc) [[ likely ]] {
-                    inst->instruction(inst->encoding, this);
-                    continue;
+                    if (inst->fusedEncoding == 0) [[ likely ]] {
+                        inst->instruction(inst->encoding, this);
+                        continue;
+                    }
+                    // A fused pair is two instructions, and at the end of a
+                    // block the first runs alone, as though missed
+                    if (i + 1 < ticks) {
+                        inst->instruction(inst->encoding, this);
+                        i++;
+                        continue;
+                    }
                 }
             }
+            CountEvent<IcacheMiss>();
+            if (BreakPending()) [[ unlikely ]] {
+                retired += i;
+                retiredThisBlock = 0;
+                return i;
+            }
             __uint32_t encoding;
             if (!Transact<__uint32_t, AccessType::X>(state.pc, (char*)&encoding))
                 continue;
             DecodedInstruction<XLEN_t> decoded = Decode(encoding);
+            if (traceFilter != nullptr) [[ unlikely ]] {
+                if (traceFilter->Matches(state.pc, state.privilegeMode, state.satp.asid))
+                    decoded = TraceTrampoline;
+            }
             if constexpr (!icache_disabled)
-                icache[icacheIndex] = { state.pc, encoding, decoded };
+                if (Cacheable(encoding))
+                    icache[icacheIndex] = FillEntry(encoding, decoded);
+            retiredThisBlock = i;
             decoded(encoding, this);
         }
-        return fastLoopTicks;
+        retired += ticks;
+        retiredThisBlock = 0;
+        return ticks;
     };
 
+    // The icache entry for the instruction at pc, fused with the one after
+    // if they make one of the fusions, share a page, and the next is already
+    // in reach
+    inline ICacheEntry FillEntry(__uint32_t encoding, DecodedInstruction<XLEN_t> decoded) {
+        if constexpr (!fusion_disabled) {
+            if (std::any_of(std::begin(fusions), std::end(fusions), [decoded](const Fusion& fusion) { return fusion.first == decoded; })) {
+                XLEN_t nextPc = state.pc + (RISCV::isCompressed(encoding) ? 2 : 4);
+                __uint32_t next;
+                if (nextPc >> 12 == state.pc >> 12 && nextPc != breakpointPc && traceFilter == nullptr &&
+                    PeekFetch(nextPc, &next)) {
+                    DecodedInstruction<XLEN_t> nextDecoded = Decode(next);
+                    for (const Fusion& fusion : fusions) {
+                        if (fusion.first == decoded && fusion.second == nextDecoded) {
+                            return { state.pc, encoding, next, fusion.fused };
+                        }
+                    }
+                }
+            }
+        }
+        return { state.pc, encoding, 0, decoded };
+    }
+
+    // Reads the instruction at address if a fetch would find it through the
+    // direct window or translation caches, without walking, faulting or
+    // counting anything
+    inline bool PeekFetch(XLEN_t address, __uint32_t* encoding) {
+        char* host = nullptr;
+        if (fetchPaging == RISCV::PagingMode::Bare) {
+            host = ThroughWindow<__uint32_t, AccessType::X>(address);
+        } else {
+            TranslationCacheEntry* entry = &cacheX[(address >> 12) & ((1 << cacheBits) - 1)];
+            if (entry->virtPageStart >> 12 == address >> 12 && entry->hostPageStart != nullptr &&
+                (address & 0xfff) <= 0x1000 - sizeof(__uint32_t)) {
+                host = entry->hostPageStart + address - entry->virtPageStart;
+            }
+        }
+        if (host == nullptr) {
+            return false;
+        }
+        memcpy(encoding, host, sizeof(__uint32_t));
+        return true;
+    }
+
+    // Instructions retired since the hart was made, not counting the one
+    // running now.
+    inline __uint64_t InstructionsRetired() {
+        return retired + retiredThisBlock;
+    }
+
+    inline __uint64_t EventCount(unsigned int event) {
+        return event < NumPerformanceEvents ? eventCounts[event] : 0;
+    }
+
+    // True when the next instruction shouldn't run until the run loop has
+    // dealt with a breakpoint or requested break.
+    inline bool BreakPending() {
+        return breakRequested || state.pc == breakpointPc;
+    }
+
+    void SetBreakpoint(XLEN_t pc) {
+        breakpointPc = pc;
+        // Nor may it stay the second half of a fused pair
+        icache[ICacheIndex(pc)] = { };
+        icache[ICacheIndex(pc - 2)] = { };
+        icache[ICacheIndex(pc - 4)] = { };
+    }
+
+    void ClearBreaks() {
+        breakpointPc = noBreakpoint;
+        breakRequested = false;
+        breakOnPrivilegeChange = false;
+    }
+
+    // Stops Tick() before the next instruction.
+    void RequestBreak() {
+        breakRequested = true;
+        memset(icache, 0, sizeof(icache));
+    }
+
+    void BreakOnPrivilegeChange(bool enable) {
+        breakOnPrivilegeChange = enable;
+    }
+
     unsigned int TickOnceAndPrintDisasm(std::ostream* disasm_pipe) {
 
-        ICacheEntry *inst = &icache[(state.pc >> 1) & ((1<<icacheBits)-1)];
+        // These run one instruction at a time, so take a fused pair as a miss
+        ICacheEntry *inst = &icache[ICacheIndex(state.pc)];
         XLEN_t print_pc = state.pc;
         if constexpr (!icache_disabled) {
-            if (inst->instruction != nullptr && inst->full_pc == state.pc) [[ likely ]] {
+            if (inst->instruction != nullptr && inst->full_pc == state.pc && inst->fusedEncoding == 0) [[ likely ]] {
                 if constexpr (sizeof(XLEN_t) > 8) {
                     std::cout << "128 bit printing not supported" << std::endl;
                 } else {
@@ -106,17 +394,20 @@ public:
                                 << inst->encoding << "\t"
                                 << std::dec;
                 }
-                Instruction<XLEN_t> dinstr = decode_instruction<XLEN_t>(inst->encoding, state.misa.extensions, state.misa.mxlen);
+                Instruction<XLEN_t> dinstr = decode_instruction<XLEN_t>(inst->encoding, state.Extensions(), state.Mxlen());
                 dinstr.disassemblyFunction(inst->encoding, disasm_pipe);
                 assert(inst->instruction == dinstr.executionFunction);
                 inst->instruction(inst->encoding, this);
+                retired++;
                 return 1;
             }
         }
 
         __uint32_t encoding;
-        if (!Transact<__uint32_t, AccessType::X>(state.pc, (char*)&encoding))
+        if (!Transact<__uint32_t, AccessType::X>(state.pc, (char*)&encoding)) {
+            retired++;
             return 1;
+        }
 
         if constexpr (print_physical_pc) {
             Translation<XLEN_t> fresh_translation = TranslationAlgorithm<AccessType::X>(state.pc, target);
@@ -136,43 +427,104 @@ public:
                            << encoding << "\t"
                            << std::dec;
         }
-        Instruction<XLEN_t> dinstr = decode_instruction<XLEN_t>(encoding, state.misa.extensions, state.misa.mxlen);
+        Instruction<XLEN_t> dinstr = decode_instruction<XLEN_t>(encoding, state.Extensions(), state.Mxlen());
         dinstr.disassemblyFunction(encoding, disasm_pipe);
         DecodedInstruction<XLEN_t> decoded = Decode(encoding);
         assert(decoded == dinstr.executionFunction);
         if constexpr (!icache_disabled)
-            icache[(state.pc >> 1) & ((1<<icacheBits)-1)] = { state.pc, encoding, decoded };
+            if (Cacheable(encoding))
+                icache[ICacheIndex(state.pc)] = { state.pc, encoding, 0, decoded };
         decoded(encoding, this);
+        retired++;
         return 1;
     };
 
-    void ReconfigureDecodeTables() {
-        // Skip reconfiguration when nothing has changed.
-        if (state.misa.extensions == configured_extensions &&
-            state.misa.mxlen == configured_mxlen) {
-            return;
+    unsigned int TickOnceAndTrace(TraceWriter* tracer) {
+        unsigned int icacheIndex = ICacheIndex(state.pc);
+        ICacheEntry *inst = &icache[icacheIndex];
+        if (!icache_disabled && inst->instruction != nullptr && inst->full_pc == state.pc && inst->fusedEncoding == 0) [[ likely ]] {
+            ExecuteAndTrace(inst->encoding, inst->instruction, tracer);
+            retired++;
+            return 1;
+        }
+        __uint32_t encoding;
+        if (!Transact<__uint32_t, AccessType::X>(state.pc, (char*)&encoding)) {
+            TraceRecord record = { };
+            record.pc = (__uint64_t)state.pc;
+            record.privilege = state.privilegeMode;
+            record.flags = TraceFlag::FetchFault;
+            tracer->Record(record);
+            retired++;
+            return 1;
+        }
+        DecodedInstruction<XLEN_t> decoded = Decode(encoding);
+        if constexpr (!icache_disabled)
+            if (Cacheable(encoding))
+                icache[icacheIndex] = { state.pc, encoding, 0, decoded };
+        ExecuteAndTrace(encoding, decoded, tracer);
+        retired++;
+        return 1;
+    }
+
+    // Runs one fetched instruction and records it along with the register it
+    // wrote and the data address it accessed, or tried to, if any. Both come
+    // from the encoding, so a write of the value already there still counts.
+    inline void ExecuteAndTrace(__uint32_t encoding, DecodedInstruction<XLEN_t> decoded, TraceWriter* tracer) {
+        TraceRecord record = { };
+        record.pc = (__uint64_t)state.pc;
+        record.privilege = state.privilegeMode;
+        // A 32 bit fetch of a compressed instruction also picks up the next
+        // one's low half, which isn't part of this record.
+        record.encoding = (encoding & 0b11) == 0b11 ? encoding : encoding & 0xFFFF;
+
+        unsigned int rd = TracedDestination<XLEN_t>(encoding);
+        XLEN_t dataAddress;
+        if (TracedDataAddress<XLEN_t>(encoding, state.regs, &dataAddress)) {
+            record.flags |= TraceFlag::DataAccess;
+            record.memAddress = (__uint64_t)dataAddress;
+        }
+
+        trapped = false;
+        decoded(encoding, this);
+
+        // An instruction that trapped wrote nothing
+        if (rd != 0 && !trapped) {
+            record.rd = rd;
+            record.rdValue = (__uint64_t)state.regs[rd];
         }
-        configured_extensions = state.misa.extensions;
-        configured_mxlen = state.misa.mxlen;
-        for (__uint32_t packed_instruction = 0; packed_instruction < (1<<20); packed_instruction++) {
-            __uint32_t unpacked_encoding = 0b11 |
-                ((0b00000000000000011111 & packed_instruction) << 2) |
-                ((0b00000000000011100000 & packed_instruction) << 7) |
-                ((0b11111111111100000000 & packed_instruction) << 12);
-            uncompressed_inst_lut[packed_instruction] = decode_instruction<XLEN_t>(unpacked_encoding, state.misa.extensions, state.misa.mxlen).executionFunction;
-        }
-        for (__uint32_t encoded = 0; encoded < 1<<16; encoded++) {
-            if ((encoded & 0b11) != 0b11) {
-                compressed_inst_lut[encoded] = decode_instruction<XLEN_t>(encoded, state.misa.extensions, state.misa.mxlen).executionFunction;
+
+        tracer->Record(record);
+    }
+
+    // Turns on filtered tracing: Tick() stays the fast path, but icache fills
+    // for instructions the filter matches get TraceTrampoline instead of the
+    // decoded instruction. Pass a null tracer to turn it off again.
+    void SetTraceFilter(TraceWriter* tracer, const TraceFilter* filter) {
+        filterTracer = tracer;
+        traceFilter = tracer == nullptr ? nullptr : filter;
+        memset(icache, 0, sizeof(icache));
+    }
+
+    void ReconfigureDecodeTables() {
+        if constexpr (!fixedISA<XLEN_t>) {
+            // Skip reconfiguration when nothing has changed.
+            if (state.misa.extensions == configured_extensions &&
+                state.misa.mxlen == configured_mxlen) {
+                return;
             }
+            configured_extensions = state.misa.extensions;
+            configured_mxlen = state.misa.mxlen;
+            ownDecodeTables.Configure(configured_extensions, configured_mxlen);
         }
     }
 
     inline void Reset() {
         state.Reset();
+        reservedAddress = noReservation;
         memset(cacheR, 0, sizeof(cacheR));
         memset(cacheW, 0, sizeof(cacheW));
         memset(cacheX, 0, sizeof(cacheX));
+        UpdatePagingModes();
         ReconfigureDecodeTables();
         memset(icache, 0, sizeof(icache));
     };
@@ -227,16 +579,80 @@ public:
         std::cout << std::endl;
     }
 
+    inline RISCV::PagingMode PagingFor(AccessType accessType) {
+        return accessType == AccessType::X ? fetchPaging : dataPaging;
+    }
+
+    inline DirectWindow* WindowFor(AccessType accessType) {
+        return accessType == AccessType::X ? &fetchWindow : &dataWindow;
+    }
+
+    // Host address of an access through the direct window, or null if it
+    // falls outside
+    template <typename MEM_TYPE_t, AccessType accessType>
+    inline char* ThroughWindow(XLEN_t address) {
+        static_assert(sizeof(MEM_TYPE_t) <= directWindowSlack);
+        DirectWindow* window = WindowFor(accessType);
+        XLEN_t offset = address - window->start;
+        return offset < window->span ? window->host + offset : nullptr;
+    }
+
+    // Opens the window around a physical address that just turned out to
+    // be RAM, if the bus knows how far the RAM goes
+    void OpenWindow(AccessType accessType, XLEN_t address) {
+        __uint64_t first, last;
+        char* host;
+        if ((__uint128_t)address >> 64 || !target->DirectRange((__uint64_t)address, &first, &last, &host)) {
+            return;
+        }
+        if constexpr (sizeof(XLEN_t) < 8) {
+            last = std::min(last, (__uint64_t)(XLEN_t)~0);
+        }
+        if (last - first < directWindowSlack) {
+            return;
+        }
+        *WindowFor(accessType) = { (XLEN_t)first, (XLEN_t)(last - first - (directWindowSlack - 1)), host };
+    }
+
+    void UpdatePagingModes() {
+        RISCV::PrivilegeMode dataPrivilege = state.mstatus.mprv ? state.mstatus.mpp : state.privilegeMode;
+        fetchPaging = state.privilegeMode == RISCV::PrivilegeMode::Machine ? RISCV::PagingMode::Bare : state.satp.pagingMode;
+        dataPaging = dataPrivilege == RISCV::PrivilegeMode::Machine ? RISCV::PagingMode::Bare : state.satp.pagingMode;
+        if (fetchPaging != RISCV::PagingMode::Bare) {
+            fetchWindow = { };
+        }
+        if (dataPaging != RISCV::PagingMode::Bare) {
+            dataWindow = { };
+        }
+    }
+
     template <typename MEM_TYPE_t, AccessType accessType>
     inline bool Transact(XLEN_t startAddress, char* buf) {
+        if constexpr (accessType == AccessType::R)
+            spinLoadAddress = startAddress;
+        bool direct = PagingFor(accessType) == RISCV::PagingMode::Bare;
+        if (direct) {
+            if (char* hostAddress = ThroughWindow<MEM_TYPE_t, accessType>(startAddress)) [[ likely ]] {
+                if constexpr (accessType == AccessType::W) {
+                    *(MEM_TYPE_t*)hostAddress = *(MEM_TYPE_t*)buf;
+                    NoteStore(hostAddress, sizeof(MEM_TYPE_t));
+                } else {
+                    *(MEM_TYPE_t*)buf = *(MEM_TYPE_t*)hostAddress;
+                }
+                if constexpr (print_transactions)
+                    PrintTransaction<MEM_TYPE_t, accessType, false, false>(startAddress, 0, buf);
+                return true;
+            }
+        }
         TranslationCacheEntry* cache = accessType == AccessType::R ? cacheR : (accessType == AccessType::W ? cacheW : cacheX);
         XLEN_t index = (startAddress >> 12) & ((1 << cacheBits) - 1); // TODO assumes 4k pages, need flex for supers
         if constexpr (!memcache_disabled) {
-            if ((cache[index].virtPageStart >> 12 == startAddress >> 12) && (cache[index].hostPageStart != nullptr)) [[ likely ]] {
+            if (!direct && (cache[index].virtPageStart >> 12 == startAddress >> 12) && (cache[index].hostPageStart != nullptr)) [[ likely ]] {
                 char *hostAddress = cache[index].hostPageStart + startAddress - cache[index].virtPageStart;
                 if constexpr (accessType == AccessType::W) {
                     *(MEM_TYPE_t*)hostAddress = *(MEM_TYPE_t*)buf;
                     // memcpy(hostAddress, buf, sizeof(MEM_TYPE_t));
+                    NoteStore(hostAddress, sizeof(MEM_TYPE_t));
                 } else {
                     *(MEM_TYPE_t*)buf = *(MEM_TYPE_t*)hostAddress;
                     // memcpy(buf, hostAddress, sizeof(MEM_TYPE_t));
@@ -245,6 +661,9 @@ public:
                     PrintTransaction<MEM_TYPE_t, accessType, false, false>(startAddress, 0, buf);
                 return true;
             }
+            if (!direct) {
+                CountEvent<TranslationCacheMiss>();
+            }
         }
         Translation<XLEN_t> fresh_translation = TranslationAlgorithm<accessType>(startAddress, target);
         if (fresh_translation.generatedTrap != RISCV::TrapCause::NONE) [[ unlikely ]] {
@@ -258,7 +677,22 @@ public:
         // TODO - Transact should be in 1,2,4,8,16 bytes, not in 4,8,16. Device class needs to change. Would be nice to
         //        collapse it all into one transact function for everything for every device.
         target->template Transact<XLEN_t, accessType>(fresh_translation.translated, sizeof(MEM_TYPE_t), buf);
-        if constexpr (!memcache_disabled) {
+        if constexpr (accessType != AccessType::X) {
+            if (target->hint == nullptr) {
+                CountEvent<DeviceAccess>();
+            }
+        }
+        if constexpr (accessType == AccessType::W) {
+            NoteStore((char*)target->hint, sizeof(MEM_TYPE_t));
+        } else if constexpr (accessType == AccessType::R) {
+            slowReadAddress = startAddress;
+            slowReadHost = (char*)target->hint;
+        }
+        if (direct) {
+            if (target->hint) {
+                OpenWindow(accessType, startAddress);
+            }
+        } else if constexpr (!memcache_disabled) {
             if (target->hint) {
                 XLEN_t offset = startAddress - fresh_translation.virtPageStart;
                 cache[index].hostPageStart = (char*)target->hint - offset;
@@ -287,17 +721,278 @@ public:
         return true;
     }
 
+    // -- Atomics --
+    // LR, SC and AMOs work directly on the host memory behind guest RAM. In a
+    // multi-hart system they use host atomics and every store breaks other
+    // harts' reservations; a lone hart has no ReservationSet and does neither.
+    // Anything that isn't DMI-capable RAM gets plain transactions.
+
+    // Makes this hart's reservations visible to, and breakable by, the other
+    // harts sharing the set. Call after setting mhartid.
+    void ShareReservations(ReservationSet* set) {
+        reservations = set;
+        reservationSlot = (unsigned int)state.mhartid;
+    }
+
+    template <typename MEM_TYPE_t>
+    inline bool LoadReserved(XLEN_t address, MEM_TYPE_t* value) {
+        if (address % sizeof(MEM_TYPE_t) != 0) {
+            state.RaiseException(RISCV::TrapCause::LOAD_ADDRESS_MISALIGNED, address);
+            return false;
+        }
+        char* host;
+        if (!HostAddress<MEM_TYPE_t, AccessType::R>(address, &host))
+            return false;
+        if (host == nullptr) {
+            if (!Transact<MEM_TYPE_t, AccessType::R>(address, (char*)value))
+                return false;
+        } else if (reservations != nullptr) {
+            // Reserve before reading, so a racing store either lands before
+            // the read or breaks the reservation
+            reservations->Reserve(reservationSlot, host);
+            *value = std::atomic_ref<MEM_TYPE_t>(*(MEM_TYPE_t*)host).load();
+        } else {
+            *value = *(MEM_TYPE_t*)host;
+        }
+        reservedAddress = address;
+        reservedBytes = sizeof(MEM_TYPE_t);
+        reservedHost = host;
+        reservedValue = *value;
+        return true;
+    }
+
+    // Sets *stored to whether the store happened. Returns false if it faulted.
+    template <typename MEM_TYPE_t>
+    inline bool StoreConditional(XLEN_t address, MEM_TYPE_t value, bool* stored) {
+        if (address % sizeof(MEM_TYPE_t) != 0) {
+            state.RaiseException(RISCV::TrapCause::STORE_AMO_ADDRESS_MISALIGNED, address);
+            return false;
+        }
+        bool reserved = reservedAddress == address && reservedBytes == sizeof(MEM_TYPE_t);
+        reservedAddress = noReservation;
+        if (reservations != nullptr && reservedHost != nullptr) {
+            reserved = reservations->Release(reservationSlot, reservedHost) && reserved;
+        }
+        char* host;
+        if (!HostAddress<MEM_TYPE_t, AccessType::W>(address, &host))
+            return false;
+        *stored = false;
+        if (!reserved || host != reservedHost) {
+            return true;
+        }
+        if (host == nullptr) {
+            if (!Transact<MEM_TYPE_t, AccessType::W>(address, (char*)&value))
+                return false;
+        } else if (reservations != nullptr) {
+            // Also catches a store that raced the reservation itself
+            MEM_TYPE_t expected = (MEM_TYPE_t)reservedValue;
+            if (!std::atomic_ref<MEM_TYPE_t>(*(MEM_TYPE_t*)host).compare_exchange_strong(expected, value))
+                return true;
+            NoteStore(host, sizeof(MEM_TYPE_t));
+        } else {
+            *(MEM_TYPE_t*)host = value;
+            spinIterations = 0;
+        }
+        *stored = true;
+        return true;
+    }
+
+    // Replaces the word at address with operation(word, operand) and hands
+    // back the old word. Returns false if it faulted.
+    template <typename MEM_TYPE_t, typename Operation>
+    inline bool AtomicMemoryOperation(XLEN_t address, MEM_TYPE_t operand, MEM_TYPE_t* old) {
+        if (address % sizeof(MEM_TYPE_t) != 0) {
+            state.RaiseException(RISCV::TrapCause::STORE_AMO_ADDRESS_MISALIGNED, address);
+            return false;
+        }
+        char* host;
+        if (!HostAddress<MEM_TYPE_t, AccessType::W>(address, &host))
+            return false;
+        Operation operation;
+        if (host == nullptr) {
+            if (!Transact<MEM_TYPE_t, AccessType::R>(address, (char*)old))
+                return false;
+            MEM_TYPE_t result = operation(*old, operand);
+            return Transact<MEM_TYPE_t, AccessType::W>(address, (char*)&result);
+        }
+        if (reservations == nullptr) {
+            *old = *(MEM_TYPE_t*)host;
+            *(MEM_TYPE_t*)host = operation(*old, operand);
+            spinIterations = 0;
+            return true;
+        }
+        std::atomic_ref<MEM_TYPE_t> word(*(MEM_TYPE_t*)host);
+        if constexpr (std::is_same<Operation, std::plus<MEM_TYPE_t>>()) {
+            *old = word.fetch_add(operand);
+        } else if constexpr (std::is_same<Operation, std::bit_and<MEM_TYPE_t>>()) {
+            *old = word.fetch_and(operand);
+        } else if constexpr (std::is_same<Operation, std::bit_or<MEM_TYPE_t>>()) {
+            *old = word.fetch_or(operand);
+        } else if constexpr (std::is_same<Operation, std::bit_xor<MEM_TYPE_t>>()) {
+            *old = word.fetch_xor(operand);
+        } else if constexpr (std::is_same<Operation, rhs<MEM_TYPE_t>>()) {
+            *old = word.exchange(operand);
+        } else {
+            *old = word.load();
+            while (!word.compare_exchange_weak(*old, operation(*old, operand)));
+        }
+        NoteStore(host, sizeof(MEM_TYPE_t));
+        return true;
+    }
+
+    // -- Idle detection --
+    // A hart in WFI, or going round a short loop that keeps loading the same
+    // address and changes nothing, has no use for a host core until an
+    // interrupt or another hart's store. The instructions flag it, and the
+    // run loop collects the flag between blocks with TakeIdle() and decides
+    // whether to park. A lone hart flags the same way and nobody looks.
+
+    enum class Idle { None, Wfi, Spin };
+
+    // Branches further back than this don't close a spin loop
+    static constexpr int spinLoopBytes = 64;
+
+    inline void NoteWfi() {
+        idle = Idle::Wfi;
+    }
+
+    // Called by taken jumps and branches of at most spinLoopBytes backwards,
+    // before they move the pc. The same branch taken spinThreshold times with
+    // only loads of one address and no stores in between is a candidate, and
+    // it's a spin if one more time round leaves every register as it was.
+    inline void NoteBackwardBranch() {
+        XLEN_t watched = spinLoadAddress;
+        spinLoadAddress = noDataAddress;
+        if (state.pc != spinPc || watched != spinAddress || watched == noDataAddress) {
+            spinPc = state.pc;
+            spinAddress = watched;
+            spinIterations = 0;
+            return;
+        }
+        spinIterations++;
+        if (spinIterations == spinThreshold) {
+            memcpy(spinRegs, state.regs, sizeof(spinRegs));
+        } else if (spinIterations > spinThreshold) {
+            if (memcmp(spinRegs, state.regs, sizeof(spinRegs)) == 0) {
+                idle = Idle::Spin;
+            }
+            spinIterations = 0;
+        }
+    }
+
+    // Hands back, and forgets, whatever went idle since the last call. For a
+    // spin, *watched is the host address the loop polls, or null if that
+    // isn't DMI-capable RAM.
+    Idle TakeIdle(char** watched) {
+        Idle was = idle;
+        idle = Idle::None;
+        *watched = nullptr;
+        if (was == Idle::Spin) {
+            bool direct = dataPaging == RISCV::PagingMode::Bare;
+            TranslationCacheEntry* entry = &cacheR[(spinAddress >> 12) & ((1 << cacheBits) - 1)];
+            if (direct && ThroughWindow<__uint32_t, AccessType::R>(spinAddress) != nullptr) {
+                *watched = ThroughWindow<__uint32_t, AccessType::R>(spinAddress);
+            } else if (!direct && entry->virtPageStart >> 12 == spinAddress >> 12 && entry->hostPageStart != nullptr) {
+                *watched = entry->hostPageStart + spinAddress - entry->virtPageStart;
+            } else if (spinAddress == slowReadAddress) {
+                *watched = slowReadHost;
+            }
+        }
+        return was;
+    }
+
+    // Lets the harts parked in the lot hear about this hart's stores. Only
+    // for harts that also ShareReservations().
+    void ShareParkingLot(ParkingLot* lot) {
+        parking = lot;
+    }
+
 private:
 
+    Idle idle = Idle::None;
+
+    // Every store goes through here, to break spin detection, reservations
+    // and the sleep of harts watching the line. host is null for stores that
+    // didn't go to DMI-capable RAM.
+    inline void NoteStore(char* host, unsigned int size) {
+        spinIterations = 0;
+        if (reservations != nullptr && host != nullptr) [[ unlikely ]] {
+            reservations->Invalidate(host, size);
+            if (parking != nullptr) {
+                parking->NotifyStore(host, size);
+            }
+        }
+    }
+
+    // Finds the host memory behind a guest access, filling the translation
+    // caches on the way. Sets *host to null if it isn't DMI-capable RAM.
+    // Returns false, having raised the fault, if the access faults.
+    template <typename MEM_TYPE_t, AccessType accessType>
+    inline bool HostAddress(XLEN_t address, char** host) {
+        if constexpr (accessType == AccessType::R)
+            spinLoadAddress = address;
+        bool direct = dataPaging == RISCV::PagingMode::Bare;
+        if (direct) {
+            if ((*host = ThroughWindow<MEM_TYPE_t, accessType>(address))) [[ likely ]] {
+                return true;
+            }
+        }
+        TranslationCacheEntry* cache = accessType == AccessType::R ? cacheR : cacheW;
+        XLEN_t index = (address >> 12) & ((1 << cacheBits) - 1);
+        if constexpr (!memcache_disabled) {
+            if (!direct && (cache[index].virtPageStart >> 12 == address >> 12) && (cache[index].hostPageStart != nullptr)) [[ likely ]] {
+                *host = cache[index].hostPageStart + address - cache[index].virtPageStart;
+                return true;
+            }
+            if (!direct) {
+                CountEvent<TranslationCacheMiss>();
+            }
+        }
+        Translation<XLEN_t> fresh_translation = TranslationAlgorithm<accessType>(address, target);
+        if (fresh_translation.generatedTrap != RISCV::TrapCause::NONE) [[ unlikely ]] {
+            state.RaiseException(fresh_translation.generatedTrap, address);
+            return false;
+        }
+        // Ask for the backing memory rather than probing with an access, so
+        // devices see only the access the guest makes. Without any, the
+        // caller falls back to a real transaction.
+        __uint64_t first, last;
+        char* rangeHost;
+        if ((__uint128_t)fresh_translation.translated >> 64 ||
+            !target->DirectRange((__uint64_t)fresh_translation.translated, &first, &last, &rangeHost) ||
+            last - (__uint64_t)fresh_translation.translated < sizeof(MEM_TYPE_t) - 1) {
+            *host = nullptr;
+            return true;
+        }
+        *host = rangeHost + ((__uint64_t)fresh_translation.translated - first);
+        if constexpr (accessType == AccessType::R) {
+            slowReadAddress = address;
+            slowReadHost = *host;
+        }
+        if (direct) {
+            OpenWindow(accessType, address);
+        } else if constexpr (!memcache_disabled) {
+            // Only cache the page if the memory backs all of it
+            __uint64_t pageFirst = (__uint64_t)fresh_translation.translated & ~(__uint64_t)0xfff;
+            if (pageFirst >= first && pageFirst + 0xfff <= last) {
+                cache[index].hostPageStart = *host - (address - fresh_translation.virtPageStart);
+                cache[index].virtPageStart = fresh_translation.virtPageStart;
+                cache[index].validThrough = fresh_translation.validThrough;
+            }
+        }
+        return true;
+    }
+
     template<AccessType accessType>
     Translation<XLEN_t> TranslationAlgorithm(XLEN_t va, Device* mem) {
-        if (state.satp.pagingMode == RISCV::PagingMode::Bare)
-            return TranslationAlgorithm<RISCV::PagingMode::Bare, accessType>(va, mem);
-        if (state.satp.pagingMode == RISCV::PagingMode::Sv32)
+        RISCV::PagingMode pagingMode = PagingFor(accessType);
+        if (pagingMode == RISCV::PagingMode::Bare)
+            return { va, (XLEN_t)0, (XLEN_t)~0, RISCV::TrapCause::NONE };
+        if (pagingMode == RISCV::PagingMode::Sv32)
             return TranslationAlgorithm<RISCV::PagingMode::Sv32, accessType>(va, mem);
-        if (state.satp.pagingMode == RISCV::PagingMode::Sv39)
+        if (pagingMode == RISCV::PagingMode::Sv39)
             return TranslationAlgorithm<RISCV::PagingMode::Sv39, accessType>(va, mem);
-        if (state.satp.pagingMode == RISCV::PagingMode::Sv48)
+        if (pagingMode == RISCV::PagingMode::Sv48)
             return TranslationAlgorithm<RISCV::PagingMode::Sv48, accessType>(va, mem);
         return { }; // TODO something fatal?
     }
@@ -309,9 +1004,9 @@ private:
     // This feels.... really unlikely. There's something weird going on.
     template<RISCV::PagingMode pagingMode, AccessType accessType>
     Translation<XLEN_t> TranslationAlgorithm(XLEN_t va, Device* mem) {
-        RISCV::PrivilegeMode translationPrivilege = state.mstatus.mprv ? state.mstatus.mpp : state.privilegeMode;
-        if (translationPrivilege == RISCV::PrivilegeMode::Machine || pagingMode == RISCV::PagingMode::Bare)
-            return { va, (XLEN_t)0, (XLEN_t)~0, RISCV::TrapCause::NONE };
+        // Only reached for S and U, the dispatch above having sorted out M
+        RISCV::PrivilegeMode translationPrivilege = accessType != AccessType::X && state.mstatus.mprv ? state.mstatus.mpp : state.privilegeMode;
+        CountEvent<PageWalk>();
         static constexpr Translation<XLEN_t> page_fault =
             { 0, 0, 0, accessType == AccessType::R ? RISCV::TrapCause::LOAD_PAGE_FAULT :
                       (accessType == AccessType::W ? RISCV::TrapCause::STORE_AMO_PAGE_FAULT : 
@@ -455,23 +1150,47 @@ private:
 
     inline DecodedInstruction<XLEN_t> Decode(__uint32_t encoded) {
         if (RISCV::isCompressed(encoded)) {
-            return compressed_inst_lut[encoded & 0x0000ffff];
+            return decodeTables->compressed_inst_lut[encoded & 0x0000ffff];
         }
         __uint32_t packed_instruction = swizzle<__uint32_t, ExtendBits::Zero, 31, 20, 14, 12, 6, 2>(encoded);
-        return uncompressed_inst_lut[packed_instruction];
+        return decodeTables->uncompressed_inst_lut[packed_instruction];
     }
 
-    inline void Callback(HartCallbackArgument arg) {
-        if (arg == HartCallbackArgument::RequestedVMfence){
+    friend struct HartState<XLEN_t, Hart>;
+
+    // Instantiated once per kind of change, so that kinds with nothing to do
+    // here compile away.
+    template<HartCallbackArgument arg>
+    inline void Callback() {
+        if constexpr (arg == HartCallbackArgument::RequestedVMfence){
             memset(cacheR, 0, sizeof(cacheR));
             memset(cacheW, 0, sizeof(cacheW));
         }
-        if (arg == HartCallbackArgument::RequestedIfence || arg == HartCallbackArgument::RequestedVMfence)
+        if constexpr (arg == HartCallbackArgument::RequestedIfence || arg == HartCallbackArgument::RequestedVMfence)
             memset(icache, 0, sizeof(icache));
-        if (arg == HartCallbackArgument::ChangedMISA) {
+        if constexpr (arg == HartCallbackArgument::ChangedMISA) {
             memset(icache, 0, sizeof(icache));
             ReconfigureDecodeTables();
         }
-        return;
+        if constexpr (arg == HartCallbackArgument::TookTrap) {
+            trapped = true;
+            CountEvent<TrapTaken>();
+        }
+        if constexpr (arg == HartCallbackArgument::ChangedPrivilege ||
+                      arg == HartCallbackArgument::ChangedMSTATUS ||
+                      arg == HartCallbackArgument::ChangedSATP) {
+            UpdatePagingModes();
+        }
+        if constexpr (arg == HartCallbackArgument::ChangedPrivilege) {
+            if (breakOnPrivilegeChange) {
+                RequestBreak();
+            }
+        }
+        if constexpr (arg == HartCallbackArgument::ChangedPrivilege || arg == HartCallbackArgument::ChangedSATP) {
+            if (traceFilter != nullptr && traceFilter->DependsOnContext()) {
+                // Filter decisions baked into the icache were made for the old context
+                memset(icache, 0, sizeof(icache));
+            }
+        }
     }
 };
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
-#include <functional>
+#include <type_traits>
+#include <utility>
 
+#include <FixedISA.hpp>
+#include <PerformanceEvents.hpp>
 #include <RiscV.hpp>
 
 enum class HartCallbackArgument {
@@ -15,50 +19,177 @@ enum class HartCallbackArgument {
     TookTrap
 };
 
-template<typename XLEN_t>
+// Owner is the hart model holding the state, told of changes that affect
+// what it has cached through its Callback<HartCallbackArgument>(). Each kind
+// of change is a separate instantiation, so the call inlines and kinds the
+// owner ignores cost nothing. With no owner, changes go unheard.
+template<typename XLEN_t, typename Owner = void>
 struct HartState {
 
 public:
 
     // TODO, bug, MIP MIE MIDELEG MEDELEG are MXLEN bits wide, not XLEN... etc.
-    // TODO Maybe move counters and such out of the struct for speed - not used
-    // often, and it's a 24->23 mips perf impact to keep them here! Or pareidolia.
     // TODO, an experiment with actually good scientific stats comparing packed
     // bits vs. broken out fields for these registers. First wrap in accessors.
 
-    XLEN_t pc;
-    XLEN_t resetVector;
+    // Fields are laid out by how often the fast path touches them, going by
+    // which code reads them rather than by profiling. The hot ones, used by
+    // nearly every instruction or block, start on a cache line of their own,
+    // the warm ones used on icache and translation misses follow, and the
+    // trap and delegation CSRs come last. grim-bench prints where they land.
+
+    // -- Hot --
 
+    alignas(64) XLEN_t pc;
     XLEN_t regs[RISCV::NumRegs];
     RISCV::PrivilegeMode privilegeMode = RISCV::PrivilegeMode::Machine;
-    RISCV::misaReg misa;
+
+    // Whether ServiceInterrupts() would find an interrupt to take. It only
+    // depends on mip, mie, the delegation registers, mstatus and the
+    // privilege mode, so it is worked out again when one of them changes,
+    // not every time interrupts are checked. WriteCSR(), TakeTrap() and
+    // ReturnFromTrap() keep it up to date; anything else writing those calls
+    // UpdateInterruptSummary().
+    bool interruptDeliverable = false;
+
+    Owner* owner;
+
+    // -- Warm --
+
     RISCV::mstatusReg mstatus;
+    RISCV::satpReg<XLEN_t> satp;
+    RISCV::misaReg misa;
     RISCV::interruptReg mie, mip;
+
+    // -- Cold --
+
+    XLEN_t resetVector;
+    XLEN_t mhartid = 0; // Fixed by the platform, so Reset() leaves it alone
     RISCV::causeReg<XLEN_t> mcause, scause, ucause;
     RISCV::tvecReg<XLEN_t> mtvec, stvec, utvec;
     XLEN_t mepc, sepc, uepc;
     XLEN_t mtval, stval, utval;
     XLEN_t mscratch, sscratch, uscratch;
     XLEN_t mideleg, medeleg, sideleg, sedeleg; // TODO are these "interruptReg"?
-    RISCV::satpReg<XLEN_t> satp;
     RISCV::fcsrReg fcsr; // TODO float regs
-    // __uint64_t counters[32];
-    // __uint32_t mcounteren;
-    // __uint32_t scounteren;
-    // __uint32_t mcountinhibit;
+    // The counters aren't counted one by one. Each is worked out when read,
+    // from what the owner has counted of its source plus counterBase, or is
+    // counterBase itself while mcountinhibit stops it. The source of mcycle
+    // and minstret is instructions retired, and of each hpm counter the
+    // event its mhpmevent selects. Index 1 is time, which is mtime and
+    // belongs to the CLINT.
+    __uint64_t counterBase[32];
+    __uint32_t mhpmevent[32];
+    __uint32_t mcounteren, scounteren, mcountinhibit;
     // XLEN_t hpmevents[32];
     // RISCV::pmpEntry pmpentry[16];
 
-    std::function<void(HartCallbackArgument)> implCallback;
-    void emptyCallback(HartCallbackArgument arg) { return; }
-
-    HartState(__uint32_t allSupportedExtensions)
-        : misa(allSupportedExtensions){
-        implCallback = std::bind(&HartState::emptyCallback, this, std::placeholders::_1);
+    HartState(__uint32_t allSupportedExtensions, Owner* stateOwner = nullptr)
+        : owner(stateOwner), misa(fixedISA<XLEN_t> ? fixedExtensions<XLEN_t> : allSupportedExtensions) {
         privilegeMode = RISCV::PrivilegeMode::Machine;
         // TODO just reset instead?
     }
 
+    // Every instruction takes one cycle, so cycle and instret both follow this
+    inline __uint64_t InstructionsRetired() {
+        if constexpr (std::is_void<Owner>()) {
+            return 0;
+        } else {
+            return owner->InstructionsRetired();
+        }
+    }
+
+    inline __uint64_t EventCount(unsigned int event) {
+        if constexpr (std::is_void<Owner>()) {
+            return 0;
+        } else {
+            return owner->EventCount(event);
+        }
+    }
+
+    inline __uint64_t CounterSource(unsigned int counter) {
+        if (counter == 0 || counter == 2) {
+            return InstructionsRetired();
+        }
+        return EventCount(mhpmevent[counter]);
+    }
+
+    inline __uint64_t ReadCounter(unsigned int counter) {
+        if (mcountinhibit & (1 << counter)) {
+            return counterBase[counter];
+        }
+        return CounterSource(counter) + counterBase[counter];
+    }
+
+    // From a CSR instruction, so the value is what the next instruction
+    // reads, and that instruction's retirement isn't counted on top of it
+    inline void WriteCounter(unsigned int counter, __uint64_t value) {
+        if (mcountinhibit & (1 << counter)) {
+            counterBase[counter] = value;
+        } else {
+            counterBase[counter] = value - CounterSource(counter) - (counter == 0 || counter == 2);
+        }
+    }
+
+    inline void WriteCountInhibit(__uint32_t value) {
+        value &= ~(__uint32_t)0b10; // time can't be stopped
+        for (unsigned int counter = 0; counter < 32; counter++) {
+            __uint32_t bit = 1 << counter;
+            if ((value & bit) && !(mcountinhibit & bit)) {
+                counterBase[counter] += CounterSource(counter);
+            } else if (!(value & bit) && (mcountinhibit & bit)) {
+                counterBase[counter] -= CounterSource(counter);
+            }
+        }
+        mcountinhibit = value;
+    }
+
+    // Events that aren't counted select nothing, and the counter keeps its value
+    inline void WriteEventSelector(unsigned int counter, __uint32_t event) {
+        __uint64_t value = ReadCounter(counter);
+        mhpmevent[counter] = performanceEventCounted(event) ? event : NoEvent;
+        if (!(mcountinhibit & (1 << counter))) {
+            counterBase[counter] = value - CounterSource(counter);
+        }
+    }
+
+    // The extensions and width misa holds, constants when they're fixed
+    inline __uint32_t Extensions() {
+        if constexpr (fixedISA<XLEN_t>) {
+            return fixedExtensions<XLEN_t>;
+        } else {
+            return misa.extensions;
+        }
+    }
+
+    inline RISCV::XlenMode Mxlen() {
+        if constexpr (fixedISA<XLEN_t>) {
+            return RISCV::xlenTypeToMode<XLEN_t>();
+        } else {
+            return misa.mxlen;
+        }
+    }
+
+    // Whether the user level counter shadows can be read in the current mode
+    inline bool CounterEnabled(RISCV::CSRAddress csrAddress) {
+        __uint32_t bit = 1 << (csrAddress & 0x1f);
+        if (privilegeMode < RISCV::PrivilegeMode::Machine && !(mcounteren & bit)) {
+            return false;
+        }
+        if (privilegeMode < RISCV::PrivilegeMode::Supervisor &&
+            RISCV::vectorHasExtension(Extensions(), 'S') && !(scounteren & bit)) {
+            return false;
+        }
+        return true;
+    }
+
+    template<HartCallbackArgument arg>
+    inline void Notify() {
+        if constexpr (!std::is_void<Owner>()) {
+            owner->template Callback<arg>();
+        }
+    }
+
     void Reset() {
 
         pc = resetVector;
@@ -93,190 +224,218 @@ public:
         sedeleg = 0;
         satp.Reset();
         fcsr.Reset();
+        mcountinhibit = 0;
+        mcounteren = 0;
+        scounteren = 0;
+        for (unsigned int counter = 0; counter < 32; counter++) {
+            mhpmevent[counter] = NoEvent;
+            counterBase[counter] = 0 - CounterSource(counter);
+        }
+        counterBase[1] = 0;
+        UpdateInterruptSummary();
     }
 
     // Note, I think that any hardwiring has to happen on notify, not in reg.
 
-    template<bool Writing>
-    inline void BankedCSR(RISCV::CSRAddress csrAddress, XLEN_t* value) {
-        if (csrAddress >= RISCV::CSRAddress::MCYCLE &&
-            csrAddress <= RISCV::CSRAddress::MHPMCOUNTER31) {
-            // unsigned int counterID = csrAddress - RISCV::CSRAddress::CYCLE;
-            // TODO XLEN truncation
-            // TODO MTIME carveout
-        }
+    // How one CSR is read and written, and who may. Every one of the 4096
+    // addresses has an entry, so any access is a lookup and a call.
+    struct CSRHandler {
+        XLEN_t (*read)(HartState*);
+        void (*write)(HartState*, XLEN_t);
+        RISCV::PrivilegeMode privilege; // The least privileged mode allowed
+        bool readOnly;
+        bool gatedByCounteren; // Also needs CounterEnabled()
+    };
 
-        if (csrAddress >= RISCV::CSRAddress::MCYCLEH &&
-            csrAddress <= RISCV::CSRAddress::MHPMCOUNTER31H) {
-            // unsigned int counterID = csrAddress - RISCV::CSRAddress::CYCLEH;
-            // TODO shifting
-            // TODO MTIME carveout
-        }
+    static const std::array<CSRHandler, 4096> csrTable;
 
-        if (csrAddress >= RISCV::CSRAddress::CYCLE &&
-            csrAddress <= RISCV::CSRAddress::HPMCOUNTER31) {
-            // unsigned int counterID = csrAddress - RISCV::CSRAddress::CYCLE;
-            // TODO XLEN truncation
-            // TODO counter passthrough
-        }
+    static inline const CSRHandler* CSR(RISCV::CSRAddress csrAddress) {
+        return &csrTable[csrAddress & 0xfff];
+    }
 
-        if (csrAddress >= RISCV::CSRAddress::CYCLEH &&
-            csrAddress <= RISCV::CSRAddress::HPMCOUNTER31H) {
-            // unsigned int counterID = csrAddress - RISCV::CSRAddress::CYCLEH;
-            // TODO shifting
-            // TODO counter passthrough
-        }
+    inline XLEN_t ReadCSR(RISCV::CSRAddress csrAddress) {
+        return CSR(csrAddress)->read(this);
+    }
 
-        if (csrAddress >= RISCV::CSRAddress::MHPMEVENT3 &&
-            csrAddress <= RISCV::CSRAddress::MHPMEVENT31) {
-            // unsigned int counterID = csrAddress - RISCV::CSRAddress::MHPMEVENT3 + 3;
-            // TODO events
-        }
+    inline void WriteCSR(RISCV::CSRAddress csrAddress, XLEN_t value) {
+        CSR(csrAddress)->write(this, value);
+    }
+
+    // -- CSR handlers --
+
+    static XLEN_t ReadZero(HartState* state) { return 0; }
+    static void WriteIgnored(HartState* state, XLEN_t value) { }
+
+    template<XLEN_t HartState::*field>
+    static XLEN_t ReadField(HartState* state) { return state->*field; }
+
+    template<XLEN_t HartState::*field>
+    static void WriteField(HartState* state, XLEN_t value) { state->*field = value; }
+
+    template<__uint32_t HartState::*field>
+    static XLEN_t ReadField32(HartState* state) { return state->*field; }
 
-        if (csrAddress >= RISCV::CSRAddress::PMPADDR0 &&
-            csrAddress <= RISCV::CSRAddress::PMPADDR15) {
-            // unsigned int pmpEntryID = csrAddress - RISCV::CSRAddress::PMPADDR0;
-            // TODO pmp address
+    template<__uint32_t HartState::*field>
+    static void WriteField32(HartState* state, XLEN_t value) { state->*field = (__uint32_t)value; }
+
+    // Interrupt delegation changes where pending interrupts would go
+    template<XLEN_t HartState::*field>
+    static void WriteInterruptDelegation(HartState* state, XLEN_t value) {
+        state->*field = value;
+        state->UpdateInterruptSummary();
+    }
+
+    template<RISCV::PrivilegeMode view>
+    static XLEN_t ReadStatus(HartState* state) { return state->mstatus.template Read<XLEN_t, view>(); }
+
+    template<RISCV::PrivilegeMode view>
+    static void WriteStatus(HartState* state, XLEN_t value) {
+        state->mstatus.template Write<XLEN_t, view>(value);
+        state->UpdateInterruptSummary();
+        state->template Notify<HartCallbackArgument::ChangedMSTATUS>();
+    }
+
+    template<RISCV::interruptReg HartState::*reg, RISCV::PrivilegeMode view>
+    static XLEN_t ReadInterrupts(HartState* state) { return (state->*reg).template Read<XLEN_t, view>(); }
+
+    template<RISCV::interruptReg HartState::*reg, RISCV::PrivilegeMode view>
+    static void WriteInterrupts(HartState* state, XLEN_t value) {
+        (state->*reg).template Write<XLEN_t, view>(value);
+        state->UpdateInterruptSummary();
+    }
+
+    // For the cause, tvec and satp registers, which pack fields of their own
+    template<typename REG_t, REG_t HartState::*reg>
+    static XLEN_t ReadPacked(HartState* state) { return (state->*reg).Read(); }
+
+    template<typename REG_t, REG_t HartState::*reg>
+    static void WritePacked(HartState* state, XLEN_t value) { (state->*reg).Write(value); }
+
+    template<unsigned int counter, bool high>
+    static XLEN_t ReadCounterCSR(HartState* state) {
+        __uint64_t value = state->ReadCounter(counter);
+        if constexpr (high) {
+            return (XLEN_t)(value >> 32);
         }
+        return (XLEN_t)value;
+    }
 
-        if (csrAddress >= RISCV::CSRAddress::PMPCFG0 &&
-            csrAddress <= RISCV::CSRAddress::PMPCFG3) {
-            // TODO four pmp entries at once
+    template<unsigned int counter, bool high>
+    static void WriteCounterCSR(HartState* state, XLEN_t value) {
+        __uint64_t combined = (__uint64_t)value;
+        if constexpr (high) {
+            combined = (state->ReadCounter(counter) & 0xffffffff) | combined << 32;
+        } else if constexpr (sizeof(XLEN_t) == 4) {
+            combined = (state->ReadCounter(counter) & ~(__uint64_t)0xffffffff) | combined;
         }
+        state->WriteCounter(counter, combined);
     }
 
-    inline XLEN_t ReadCSR(RISCV::CSRAddress csrAddress) {
-        switch (csrAddress) {
-            case RISCV::CSRAddress::MISA: return misa.Read<XLEN_t>(); break;
-            case RISCV::CSRAddress::SATP: return satp.Read(); break;
-            case RISCV::CSRAddress::MSTATUS: return mstatus.Read<XLEN_t, RISCV::PrivilegeMode::Machine>(); break;
-            case RISCV::CSRAddress::SSTATUS: return mstatus.Read<XLEN_t, RISCV::PrivilegeMode::Supervisor>(); break;
-            case RISCV::CSRAddress::USTATUS: return mstatus.Read<XLEN_t, RISCV::PrivilegeMode::User>(); break;
-            case RISCV::CSRAddress::MIE: return mie.Read<XLEN_t, RISCV::PrivilegeMode::Machine>(); break;
-            case RISCV::CSRAddress::SIE: return mie.Read<XLEN_t, RISCV::PrivilegeMode::Supervisor>(); break;
-            case RISCV::CSRAddress::UIE: return mie.Read<XLEN_t, RISCV::PrivilegeMode::User>(); break;
-            case RISCV::CSRAddress::MIP: return mip.Read<XLEN_t, RISCV::PrivilegeMode::Machine>(); break;
-            case RISCV::CSRAddress::SIP: return mip.Read<XLEN_t, RISCV::PrivilegeMode::Supervisor>(); break;
-            case RISCV::CSRAddress::UIP: return mip.Read<XLEN_t, RISCV::PrivilegeMode::User>(); break;
-            case RISCV::CSRAddress::MTVEC: return mtvec.Read(); break;
-            case RISCV::CSRAddress::MSCRATCH: return mscratch; break;
-            case RISCV::CSRAddress::MEPC: return mepc; break;
-            case RISCV::CSRAddress::MCAUSE: return mcause.Read(); break;
-            case RISCV::CSRAddress::MTVAL: return mtval; break;
-            case RISCV::CSRAddress::MEDELEG: return medeleg; break;
-            case RISCV::CSRAddress::MIDELEG: return mideleg; break;
-            case RISCV::CSRAddress::STVEC: return stvec.Read(); break;
-            case RISCV::CSRAddress::SSCRATCH: return sscratch; break;
-            case RISCV::CSRAddress::SEPC: return sepc; break;
-            case RISCV::CSRAddress::SCAUSE: return scause.Read(); break;
-            case RISCV::CSRAddress::STVAL: return stval; break;
-            case RISCV::CSRAddress::SEDELEG: return sedeleg; break;
-            case RISCV::CSRAddress::SIDELEG: return sideleg; break;
-            case RISCV::CSRAddress::UTVEC: return utvec.Read(); break;
-            case RISCV::CSRAddress::USCRATCH: return uscratch; break;
-            case RISCV::CSRAddress::UEPC: return uepc; break;
-            case RISCV::CSRAddress::UCAUSE: return ucause.Read(); break;
-            case RISCV::CSRAddress::UTVAL: return utval; break;
-            case RISCV::CSRAddress::MHARTID: return 0; break; // TODO multihart, non-zero mhartid option.
-            case RISCV::CSRAddress::MVENDORID: break;
-            case RISCV::CSRAddress::MARCHID: break;
-            case RISCV::CSRAddress::MIMPID: break;
-            case RISCV::CSRAddress::FFLAGS: break;
-            case RISCV::CSRAddress::FRM: break;
-            case RISCV::CSRAddress::FCSR: break;
-            case RISCV::CSRAddress::SCOUNTEREN: break;
-            case RISCV::CSRAddress::MCOUNTEREN: break;
-            case RISCV::CSRAddress::MCOUNTINHIBIT: break;
-            case RISCV::CSRAddress::TSELECT: break;
-            case RISCV::CSRAddress::TDATA1: break;
-            case RISCV::CSRAddress::TDATA2: break;
-            case RISCV::CSRAddress::TDATA3: break;
-            case RISCV::CSRAddress::DCSR: break;
-            case RISCV::CSRAddress::DPC: break;
-            case RISCV::CSRAddress::DSCRATCH0: break;
-            case RISCV::CSRAddress::DSCRATCH1: break;
-            case RISCV::CSRAddress::INVALID_CSR: break;
-            default:
-                XLEN_t value;
-                BankedCSR<false>(csrAddress, &value);
-                return value;
-                break;
+    static void WriteCountInhibitCSR(HartState* state, XLEN_t value) { state->WriteCountInhibit((__uint32_t)value); }
+
+    template<unsigned int counter>
+    static XLEN_t ReadEventSelector(HartState* state) { return state->mhpmevent[counter]; }
+
+    template<unsigned int counter>
+    static void WriteEventSelector(HartState* state, XLEN_t value) {
+        state->WriteEventSelector(counter, value >= NumPerformanceEvents ? NoEvent : (__uint32_t)value);
+    }
+
+    // Sets up counter number counter's machine and user CSRs
+    template<unsigned int counter>
+    static constexpr void SetCounterCSRs(std::array<CSRHandler, 4096>& table) {
+        using RISCV::CSRAddress;
+        table[CSRAddress::MCYCLE + counter].read = ReadCounterCSR<counter, false>;
+        table[CSRAddress::MCYCLE + counter].write = WriteCounterCSR<counter, false>;
+        table[CSRAddress::CYCLE + counter].read = ReadCounterCSR<counter, false>;
+        if constexpr (sizeof(XLEN_t) == 4) {
+            table[CSRAddress::MCYCLEH + counter].read = ReadCounterCSR<counter, true>;
+            table[CSRAddress::MCYCLEH + counter].write = WriteCounterCSR<counter, true>;
+            table[CSRAddress::CYCLEH + counter].read = ReadCounterCSR<counter, true>;
+        }
+        if constexpr (counter >= 3) {
+            table[CSRAddress::MCOUNTINHIBIT + counter].read = ReadEventSelector<counter>;
+            table[CSRAddress::MCOUNTINHIBIT + counter].write = WriteEventSelector<counter>;
         }
-        // TODO error here
-        return 0;
     }
 
-    inline void WriteCSR(RISCV::CSRAddress csrAddress, XLEN_t value) {
-        switch (csrAddress) {
-            case RISCV::CSRAddress::MISA:
-                misa.Write<XLEN_t>(value);
-                implCallback(HartCallbackArgument::ChangedMISA);
-                break;
-            case RISCV::CSRAddress::SATP:
-                satp.Write(value);
-                implCallback(HartCallbackArgument::ChangedSATP);
-                break;
-            case RISCV::CSRAddress::MSTATUS:
-                mstatus.Write<XLEN_t, RISCV::PrivilegeMode::Machine>(value);
-                implCallback(HartCallbackArgument::ChangedMSTATUS);
-                break;
-            case RISCV::CSRAddress::SSTATUS:
-                mstatus.Write<XLEN_t, RISCV::PrivilegeMode::Supervisor>(value);
-                implCallback(HartCallbackArgument::ChangedMSTATUS);
-                break;
-            case RISCV::CSRAddress::USTATUS:
-                mstatus.Write<XLEN_t, RISCV::PrivilegeMode::User>(value);
-                implCallback(HartCallbackArgument::ChangedMSTATUS);
-                break;
-            case RISCV::CSRAddress::MIE: mie.Write<XLEN_t, RISCV::PrivilegeMode::Machine>(value); break;
-            case RISCV::CSRAddress::SIE: mie.Write<XLEN_t, RISCV::PrivilegeMode::Supervisor>(value); break;
-            case RISCV::CSRAddress::UIE: mie.Write<XLEN_t, RISCV::PrivilegeMode::User>(value); break;
-            case RISCV::CSRAddress::MIP: mip.Write<XLEN_t, RISCV::PrivilegeMode::Machine>(value); break;
-            case RISCV::CSRAddress::SIP: mip.Write<XLEN_t, RISCV::PrivilegeMode::Supervisor>(value); break;
-            case RISCV::CSRAddress::UIP: mip.Write<XLEN_t, RISCV::PrivilegeMode::User>(value); break;
-            case RISCV::CSRAddress::MTVEC: mtvec.Write(value); break;
-            case RISCV::CSRAddress::MSCRATCH: mscratch = value; break;
-            case RISCV::CSRAddress::MEPC: mepc = value; break;
-            case RISCV::CSRAddress::MCAUSE: mcause.Write(value); break;
-            case RISCV::CSRAddress::MTVAL: mtval = value; break;
-            case RISCV::CSRAddress::MEDELEG: medeleg = value; break;
-            case RISCV::CSRAddress::MIDELEG: mideleg = value; break;
-            case RISCV::CSRAddress::STVEC: stvec.Write(value); break;
-            case RISCV::CSRAddress::SSCRATCH: sscratch = value; break;
-            case RISCV::CSRAddress::SEPC: sepc = value; break;
-            case RISCV::CSRAddress::SCAUSE: scause.Write(value); break;
-            case RISCV::CSRAddress::STVAL: stval = value; break;
-            case RISCV::CSRAddress::SEDELEG: sedeleg = value; break;
-            case RISCV::CSRAddress::SIDELEG: sideleg = value; break;
-            case RISCV::CSRAddress::UTVEC: utvec.Write(value); break;
-            case RISCV::CSRAddress::USCRATCH: uscratch = value; break;
-            case RISCV::CSRAddress::UEPC: uepc = value; break;
-            case RISCV::CSRAddress::UCAUSE: ucause.Write(value); break;
-            case RISCV::CSRAddress::UTVAL: utval = value; break;
-            case RISCV::CSRAddress::MHARTID: break; // TODO invalid? read the spec, what happens when you write to MHARTID
-            case RISCV::CSRAddress::MVENDORID: break; // TODO all the others
-            case RISCV::CSRAddress::MARCHID: break;
-            case RISCV::CSRAddress::MIMPID: break;
-            case RISCV::CSRAddress::FFLAGS: break;
-            case RISCV::CSRAddress::FRM: break;
-            case RISCV::CSRAddress::FCSR: break;
-            case RISCV::CSRAddress::SCOUNTEREN: break;
-            case RISCV::CSRAddress::MCOUNTEREN: break;
-            case RISCV::CSRAddress::MCOUNTINHIBIT: break;
-            case RISCV::CSRAddress::TSELECT: break;
-            case RISCV::CSRAddress::TDATA1: break;
-            case RISCV::CSRAddress::TDATA2: break;
-            case RISCV::CSRAddress::TDATA3: break;
-            case RISCV::CSRAddress::DCSR: break;
-            case RISCV::CSRAddress::DPC: break;
-            case RISCV::CSRAddress::DSCRATCH0: break;
-            case RISCV::CSRAddress::DSCRATCH1: break;
-            case RISCV::CSRAddress::INVALID_CSR: break;
-            default:
-                BankedCSR<true>(csrAddress, &value);
-                break;
+    static XLEN_t ReadMISA(HartState* state) { return state->misa.template Read<XLEN_t>(); }
+
+    static void WriteMISA(HartState* state, XLEN_t value) {
+        state->misa.template Write<XLEN_t>(value);
+        state->UpdateInterruptSummary();
+        state->template Notify<HartCallbackArgument::ChangedMISA>();
+    }
+
+    static void WriteSATP(HartState* state, XLEN_t value) {
+        state->satp.Write(value);
+        state->template Notify<HartCallbackArgument::ChangedSATP>();
+    }
+
+    static constexpr std::array<CSRHandler, 4096> MakeCSRTable() {
+        using RISCV::CSRAddress;
+        using RISCV::PrivilegeMode;
+        using causeReg = RISCV::causeReg<XLEN_t>;
+        using tvecReg = RISCV::tvecReg<XLEN_t>;
+        using satpReg = RISCV::satpReg<XLEN_t>;
+
+        // Anything not listed reads as zero and ignores writes, including
+        // the ID registers, fcsr, the debug and trigger registers, time, and
+        // for now PMP.
+        // TODO error here instead, for CSRs that don't exist at all
+        std::array<CSRHandler, 4096> table;
+        for (unsigned int address = 0; address < table.size(); address++) {
+            bool counterShadow = (CSRAddress)(address & 0xf60) == CSRAddress::CYCLE;
+            table[address] = { ReadZero, WriteIgnored,
+                               RISCV::csrRequiredPrivilege((CSRAddress)address),
+                               RISCV::csrIsReadOnly((CSRAddress)address),
+                               counterShadow };
         }
-        // TODO error here
+        auto set = [&table](CSRAddress address, XLEN_t (*read)(HartState*), void (*write)(HartState*, XLEN_t)) {
+            table[address].read = read;
+            table[address].write = write;
+        };
+
+        set(CSRAddress::MISA, ReadMISA, fixedISA<XLEN_t> ? WriteIgnored : WriteMISA);
+        set(CSRAddress::SATP, ReadPacked<satpReg, &HartState::satp>, WriteSATP);
+        set(CSRAddress::MSTATUS, ReadStatus<PrivilegeMode::Machine>, WriteStatus<PrivilegeMode::Machine>);
+        set(CSRAddress::SSTATUS, ReadStatus<PrivilegeMode::Supervisor>, WriteStatus<PrivilegeMode::Supervisor>);
+        set(CSRAddress::USTATUS, ReadStatus<PrivilegeMode::User>, WriteStatus<PrivilegeMode::User>);
+        set(CSRAddress::MIE, ReadInterrupts<&HartState::mie, PrivilegeMode::Machine>, WriteInterrupts<&HartState::mie, PrivilegeMode::Machine>);
+        set(CSRAddress::SIE, ReadInterrupts<&HartState::mie, PrivilegeMode::Supervisor>, WriteInterrupts<&HartState::mie, PrivilegeMode::Supervisor>);
+        set(CSRAddress::UIE, ReadInterrupts<&HartState::mie, PrivilegeMode::User>, WriteInterrupts<&HartState::mie, PrivilegeMode::User>);
+        set(CSRAddress::MIP, ReadInterrupts<&HartState::mip, PrivilegeMode::Machine>, WriteInterrupts<&HartState::mip, PrivilegeMode::Machine>);
+        set(CSRAddress::SIP, ReadInterrupts<&HartState::mip, PrivilegeMode::Supervisor>, WriteInterrupts<&HartState::mip, PrivilegeMode::Supervisor>);
+        set(CSRAddress::UIP, ReadInterrupts<&HartState::mip, PrivilegeMode::User>, WriteInterrupts<&HartState::mip, PrivilegeMode::User>);
+        set(CSRAddress::MTVEC, ReadPacked<tvecReg, &HartState::mtvec>, WritePacked<tvecReg, &HartState::mtvec>);
+        set(CSRAddress::MSCRATCH, ReadField<&HartState::mscratch>, WriteField<&HartState::mscratch>);
+        set(CSRAddress::MEPC, ReadField<&HartState::mepc>, WriteField<&HartState::mepc>);
+        set(CSRAddress::MCAUSE, ReadPacked<causeReg, &HartState::mcause>, WritePacked<causeReg, &HartState::mcause>);
+        set(CSRAddress::MTVAL, ReadField<&HartState::mtval>, WriteField<&HartState::mtval>);
+        set(CSRAddress::MEDELEG, ReadField<&HartState::medeleg>, WriteField<&HartState::medeleg>);
+        set(CSRAddress::MIDELEG, ReadField<&HartState::mideleg>, WriteInterruptDelegation<&HartState::mideleg>);
+        set(CSRAddress::STVEC, ReadPacked<tvecReg, &HartState::stvec>, WritePacked<tvecReg, &HartState::stvec>);
+        set(CSRAddress::SSCRATCH, ReadField<&HartState::sscratch>, WriteField<&HartState::sscratch>);
+        set(CSRAddress::SEPC, ReadField<&HartState::sepc>, WriteField<&HartState::sepc>);
+        set(CSRAddress::SCAUSE, ReadPacked<causeReg, &HartState::scause>, WritePacked<causeReg, &HartState::scause>);
+        set(CSRAddress::STVAL, ReadField<&HartState::stval>, WriteField<&HartState::stval>);
+        set(CSRAddress::SEDELEG, ReadField<&HartState::sedeleg>, WriteField<&HartState::sedeleg>);
+        set(CSRAddress::SIDELEG, ReadField<&HartState::sideleg>, WriteInterruptDelegation<&HartState::sideleg>);
+        set(CSRAddress::UTVEC, ReadPacked<tvecReg, &HartState::utvec>, WritePacked<tvecReg, &HartState::utvec>);
+        set(CSRAddress::USCRATCH, ReadField<&HartState::uscratch>, WriteField<&HartState::uscratch>);
+        set(CSRAddress::UEPC, ReadField<&HartState::uepc>, WriteField<&HartState::uepc>);
+        set(CSRAddress::UCAUSE, ReadPacked<causeReg, &HartState::ucause>, WritePacked<causeReg, &HartState::ucause>);
+        set(CSRAddress::UTVAL, ReadField<&HartState::utval>, WriteField<&HartState::utval>);
+        set(CSRAddress::MHARTID, ReadField<&HartState::mhartid>, WriteIgnored);
+        set(CSRAddress::MCOUNTEREN, ReadField32<&HartState::mcounteren>, WriteField32<&HartState::mcounteren>);
+        set(CSRAddress::SCOUNTEREN, ReadField32<&HartState::scounteren>, WriteField32<&HartState::scounteren>);
+        set(CSRAddress::MCOUNTINHIBIT, ReadField32<&HartState::mcountinhibit>, WriteCountInhibitCSR);
+        SetCounterCSRs<0>(table);
+        SetCounterCSRs<2>(table);
+        [&table]<unsigned int... hpm>(std::integer_sequence<unsigned int, hpm...>) {
+            (SetCounterCSRs<hpm + 3>(table), ...);
+        }(std::make_integer_sequence<unsigned int, 29>());
+        return table;
     }
 
     inline void RaiseException(RISCV::TrapCause cause, XLEN_t tval) {
@@ -288,57 +447,62 @@ public:
         }
 
         RISCV::PrivilegeMode targetPrivilege = RISCV::DestinedPrivilegeForCause<XLEN_t>(
-            cause, medeleg, sedeleg, misa.extensions);
+            cause, medeleg, sedeleg, Extensions());
         TakeTrap<false>(cause, targetPrivilege, tval);
-
-        implCallback(HartCallbackArgument::TookTrap);
     }
 
-    inline void ServiceInterrupts() {
-
-        XLEN_t interruptsForM = 0;
-        XLEN_t interruptsForS = 0;
-        XLEN_t interruptsForU = 0;
+    // True if some interrupt is both pending and enabled in mie, which is
+    // what ends a WFI whatever the global enables and privilege say.
+    inline bool InterruptPending() {
+        return (mip.Read<XLEN_t, RISCV::PrivilegeMode::Machine>() &
+                mie.Read<XLEN_t, RISCV::PrivilegeMode::Machine>()) != 0;
+    }
 
-        // TODO do this without bits, just use raw values. Faster...
-        XLEN_t mipBits = mip.Read<XLEN_t, RISCV::PrivilegeMode::Machine>();
-        XLEN_t mieBits = mie.Read<XLEN_t, RISCV::PrivilegeMode::Machine>();
+    // The interrupts that could be taken right now and the mode that would
+    // take them, or zero. Pending and enabled interrupts are split by the
+    // mode they're destined for, and the most privileged mode with something
+    // it can take wins. Interrupts for a more privileged mode than the
+    // current one are always enabled; the xIE bit only masks them while
+    // running in mode x itself.
+    inline XLEN_t DeliverableInterrupts(RISCV::PrivilegeMode* targetPrivilege) {
+        XLEN_t pending = mip.Read<XLEN_t, RISCV::PrivilegeMode::Machine>() &
+                         mie.Read<XLEN_t, RISCV::PrivilegeMode::Machine>();
+        if (pending == 0) {
+            return 0;
+        }
+        XLEN_t interruptsForM, interruptsForS, interruptsForU;
+        RISCV::SplitInterruptsByPrivilege<XLEN_t>(pending, mideleg, sideleg, Extensions(),
+                                                  &interruptsForM, &interruptsForS, &interruptsForU);
+        if (interruptsForM != 0 &&
+            (privilegeMode < RISCV::PrivilegeMode::Machine || mstatus.mie)) {
+            *targetPrivilege = RISCV::PrivilegeMode::Machine;
+            return interruptsForM;
+        } else if (interruptsForS != 0 &&
+                   (privilegeMode < RISCV::PrivilegeMode::Supervisor ||
+                    (privilegeMode == RISCV::PrivilegeMode::Supervisor && mstatus.sie))) {
+            *targetPrivilege = RISCV::PrivilegeMode::Supervisor;
+            return interruptsForS;
+        } else if (interruptsForU != 0 && privilegeMode == RISCV::PrivilegeMode::User && mstatus.uie) {
+            *targetPrivilege = RISCV::PrivilegeMode::User;
+            return interruptsForU;
+        }
+        return 0;
+    }
 
-        for (unsigned int bit = 0; bit < 8*sizeof(XLEN_t); bit++) {
+    inline void UpdateInterruptSummary() {
+        RISCV::PrivilegeMode targetPrivilege;
+        interruptDeliverable = DeliverableInterrupts(&targetPrivilege) != 0;
+    }
 
-            // A deasserted or disabled interrupt is not serviceable
-            if (!(mipBits & (1<<bit)) || !(mieBits & (1<<bit))) {
-                continue;
-            }
+    inline void ServiceInterrupts() {
 
-            // Figure out the destined privilege level for the interrupt
-            RISCV::PrivilegeMode destinedPrivilege =
-                RISCV::DestinedPrivilegeForCause<XLEN_t>(
-                    (RISCV::TrapCause)bit, mideleg, sideleg, misa.extensions);
-
-            // Set the interrupt's bit in the correct mask for its privilege
-            if (destinedPrivilege == RISCV::PrivilegeMode::Machine) {
-                interruptsForM |= 1<<bit;
-            } else if (destinedPrivilege == RISCV::PrivilegeMode::Supervisor) {
-                interruptsForS |= 1<<bit;
-            } else if (destinedPrivilege == RISCV::PrivilegeMode::User) {
-                interruptsForU |= 1<<bit;
-            }
+        if (!interruptDeliverable) [[ likely ]] {
+            return;
         }
 
-        // Select the highest-privilege enabled non-empty interrupt vector that is at or higher than our own privilege, and
         RISCV::PrivilegeMode targetPrivilege;
-        XLEN_t interruptsToService = 0;
-        if (privilegeMode <= RISCV::PrivilegeMode::Machine && interruptsForM != 0 && mstatus.mie) {
-            targetPrivilege = RISCV::PrivilegeMode::Machine;
-            interruptsToService = interruptsForM;
-        } else if (privilegeMode <= RISCV::PrivilegeMode::Supervisor && interruptsForS != 0 && mstatus.sie) {
-            targetPrivilege = RISCV::PrivilegeMode::Supervisor;
-            interruptsToService = interruptsForS;
-        } else if (privilegeMode <= RISCV::PrivilegeMode::User && interruptsForU != 0 && mstatus.uie) {
-            targetPrivilege = RISCV::PrivilegeMode::User;
-            interruptsToService = interruptsForU;
-        } else {
+        XLEN_t interruptsToService = DeliverableInterrupts(&targetPrivilege);
+        if (interruptsToService == 0) {
             return;
         }
 
@@ -413,7 +577,9 @@ public:
             break;
         }
         privilegeMode = targetPrivilege;
-        implCallback(HartCallbackArgument::ChangedPrivilege);
+        UpdateInterruptSummary();
+        Notify<HartCallbackArgument::ChangedPrivilege>();
+        Notify<HartCallbackArgument::TookTrap>();
     }
 
     // TODO move this to instruction code
@@ -434,7 +600,7 @@ public:
             mstatus.mie = mstatus.mpie;
             privilegeMode = mstatus.mpp;
             mstatus.mpie = true;
-            if (RISCV::vectorHasExtension(misa.extensions, 'U')) {
+            if (RISCV::vectorHasExtension(Extensions(), 'U')) {
                 mstatus.mpp = RISCV::PrivilegeMode::User;
             } else {
                 mstatus.mpp = RISCV::PrivilegeMode::Machine;
@@ -444,7 +610,7 @@ public:
             mstatus.sie = mstatus.spie;
             privilegeMode = mstatus.spp;
             mstatus.spie = true;
-            if (RISCV::vectorHasExtension(misa.extensions, 'U')) {
+            if (RISCV::vectorHasExtension(Extensions(), 'U')) {
                 mstatus.spp = RISCV::PrivilegeMode::User;
             } else {
                 mstatus.spp = RISCV::PrivilegeMode::Machine;
@@ -458,7 +624,12 @@ public:
             // fatal("Return from nonsense-privilege-mode trap"); // TODO
         }
 
-        implCallback(HartCallbackArgument::ChangedPrivilege);
+        UpdateInterruptSummary();
+        Notify<HartCallbackArgument::ChangedPrivilege>();
     }
 
 };
+
+template<typename XLEN_t, typename Owner>
+constinit const std::array<typename HartState<XLEN_t, Owner>::CSRHandler, 4096> HartState<XLEN_t, Owner>::csrTable =
+    HartState<XLEN_t, Owner>::MakeCSRTable();
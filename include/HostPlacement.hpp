@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Where a multi-hart run lives on the host: which CPUs each hart's thread may
+ * run on, and which NUMA nodes back guest RAM. Both go straight to the kernel
+ * through syscalls, so there is no libnuma to link.
+ */
+
+// Accepts a comma separated list of ids and FIRST-LAST inclusive ranges.
+inline bool ParseIdList(std::string spec, std::vector<unsigned int>* ids) {
+    size_t start = 0;
+    while (start <= spec.size()) {
+        size_t comma = spec.find(',', start);
+        std::string item = spec.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        size_t dash = item.find('-');
+        char* end;
+        unsigned long first = strtoul(item.substr(0, dash).c_str(), &end, 0);
+        if (*end != '\0' || item.empty() || dash == 0) {
+            return false;
+        }
+        unsigned long last = first;
+        if (dash != std::string::npos) {
+            last = strtoul(item.substr(dash + 1).c_str(), &end, 0);
+            if (*end != '\0' || dash + 1 == item.size() || last < first) {
+                return false;
+            }
+        }
+        for (unsigned long id = first; id <= last; id++) {
+            ids->push_back((unsigned int)id);
+        }
+        if (comma == std::string::npos) {
+            break;
+        }
+        start = comma + 1;
+    }
+    return true;
+}
+
+// The node of the CPU the calling thread is on right now, or -1.
+inline int CurrentHostNode() {
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+        return -1;
+    }
+    return (int)node;
+}
+
+struct ThreadPinning {
+
+    std::vector<cpu_set_t> sets; // Hart i gets sets[i % size], empty pins nothing
+
+    // Accepts CPU lists separated by colons, one per hart, as in 0:1:2-3.
+    // Harts beyond the last list start over from the first.
+    bool Parse(std::string spec) {
+        size_t start = 0;
+        while (start <= spec.size()) {
+            size_t colon = spec.find(':', start);
+            std::vector<unsigned int> cpus;
+            if (!ParseIdList(spec.substr(start, colon == std::string::npos ? std::string::npos : colon - start), &cpus)) {
+                return false;
+            }
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (unsigned int cpu : cpus) {
+                if (cpu >= CPU_SETSIZE) {
+                    return false;
+                }
+                CPU_SET(cpu, &set);
+            }
+            sets.push_back(set);
+            if (colon == std::string::npos) {
+                break;
+            }
+            start = colon + 1;
+        }
+        return true;
+    }
+
+    // Pins the calling thread to the CPUs of the given hart. Returns false if
+    // the kernel refused, say for a CPU that doesn't exist.
+    bool PinCurrentThread(unsigned int hartid) const {
+        if (sets.empty()) {
+            return true;
+        }
+        const cpu_set_t* set = &sets[hartid % sets.size()];
+        return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set) == 0;
+    }
+};
+
+struct MemoryPlacement {
+
+    static constexpr unsigned int maxNodes = 8 * sizeof(unsigned long);
+
+    int policy = MPOL_DEFAULT; // First touch
+    unsigned long nodeMask = 0;
+
+    // Accepts bind:LIST to keep pages on those nodes, or interleave:LIST to
+    // spread them round-robin across them, where LIST is as for ParseIdList.
+    bool Parse(std::string spec) {
+        size_t colon = spec.find(':');
+        std::string mode = spec.substr(0, colon);
+        if (mode == "bind") {
+            policy = MPOL_BIND;
+        } else if (mode == "interleave") {
+            policy = MPOL_INTERLEAVE;
+        } else {
+            return false;
+        }
+        std::vector<unsigned int> nodes;
+        if (colon == std::string::npos || !ParseIdList(spec.substr(colon + 1), &nodes)) {
+            return false;
+        }
+        for (unsigned int node : nodes) {
+            if (node >= maxNodes) {
+                return false;
+            }
+            nodeMask |= 1ul << node;
+        }
+        return true;
+    }
+
+    // Sets the policy for a range no page of which has been touched yet.
+    bool Apply(void* start, size_t size) const {
+        if (policy == MPOL_DEFAULT) {
+            return true;
+        }
+        return syscall(SYS_mbind, start, size, policy, &nodeMask, maxNodes + 1, 0) == 0;
+    }
+
+    // Counts which node each of a sample of resident pages in a range is on,
+    // looking at no more than maxSamples pages spread evenly across it.
+    // Untouched pages aren't counted. Returns false if the kernel can't say.
+    static bool SampleNodes(const void* start, size_t size, std::vector<__uint64_t>* pagesPerNode, size_t maxSamples = 65536) {
+        size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+        size_t pages = size / pageSize;
+        size_t stride = pages > maxSamples ? pages / maxSamples : 1;
+        std::vector<void*> addresses;
+        for (size_t page = 0; page < pages; page += stride) {
+            addresses.push_back((char*)start + page * pageSize);
+        }
+        std::vector<int> status(addresses.size());
+        if (syscall(SYS_move_pages, 0, addresses.size(), addresses.data(), nullptr, status.data(), 0) != 0) {
+            return false;
+        }
+        pagesPerNode->assign(maxNodes, 0);
+        for (int node : status) {
+            if (node >= 0 && node < (int)maxNodes) {
+                (*pagesPerNode)[node]++;
+            }
+        }
+        return true;
+    }
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+
 #include <Swizzle.hpp>
 
 #include <RiscV.hpp>
@@ -61,7 +63,7 @@ struct left_shift { constexpr T operator()(const T& lhs, const T& rhs) const { r
 template< class T = void >
 struct right_shift { constexpr T operator()(const T& lhs, const T& rhs) const { return lhs >> rhs; } };
 template< class T = void >
-struct lhs { constexpr T operator()(const T& lhs, const T& rhs) const { return lhs; } };
+struct rhs { constexpr T operator()(const T& lhs, const T& rhs) const { return rhs; } };
 template< class T = void >
 struct min { constexpr T operator()(const T& lhs, const T& rhs) const { return (lhs < rhs) ? lhs : rhs; } };
 template< class T = void >
@@ -193,7 +195,13 @@ inline void ex_branch_generic(__uint32_t encoding, Hart<XLEN_t> *hart) {
     __uint32_t rs2 = swizzle<__uint32_t, RS2>(encoding);
     __int32_t imm = swizzle<__uint32_t, B_IMM>(encoding);
     ComparisonOp compare;
-    hart->state.pc += compare(hart->state.regs[rs1], hart->state.regs[rs2]) ? imm : 4;
+    if (!compare(hart->state.regs[rs1], hart->state.regs[rs2])) {
+        hart->state.pc += 4;
+        return;
+    }
+    if (imm < 0 && imm >= -Hart<XLEN_t>::spinLoopBytes) [[ unlikely ]]
+        hart->NoteBackwardBranch();
+    hart->state.pc += imm;
 }
 
 template<typename XLEN_t, bool add_pc>
@@ -210,6 +218,8 @@ template<typename XLEN_t>
 inline void ex_jal(__uint32_t encoding, Hart<XLEN_t> *hart) {
     __uint32_t rd = swizzle<__uint32_t, RD>(encoding);
     __int32_t imm = swizzle<__uint32_t, J_IMM>(encoding);
+    if (imm < 0 && imm >= -Hart<XLEN_t>::spinLoopBytes) [[ unlikely ]]
+        hart->NoteBackwardBranch();
     hart->state.regs[rd] = hart->state.pc + 4;
     hart->state.regs[0] = 0;
     hart->state.pc = hart->state.pc + imm;
@@ -265,6 +275,22 @@ inline void ex_store_generic(__uint32_t encoding, Hart<XLEN_t> *hart) {
     hart->state.pc += 4;
 }
 
+template<typename XLEN_t, typename MEM_TYPE_t>
+inline void ex_lr_generic(__uint32_t encoding, Hart<XLEN_t> *hart) {
+    if constexpr (sizeof(XLEN_t) < sizeof(MEM_TYPE_t)) {
+        hart->state.RaiseException(RISCV::TrapCause::ILLEGAL_INSTRUCTION, encoding);
+        return;
+    }
+    __uint32_t rd = swizzle<__uint32_t, RD>(encoding);
+    __uint32_t rs1 = swizzle<__uint32_t, RS1>(encoding);
+    MEM_TYPE_t read_value;
+    if (!hart->template LoadReserved<MEM_TYPE_t>(hart->state.regs[rs1], &read_value))
+        return;
+    hart->state.regs[rd] = read_value;
+    hart->state.regs[0] = 0;
+    hart->state.pc += 4;
+}
+
 template<typename XLEN_t, typename MEM_TYPE_t>
 inline void ex_sc_generic(__uint32_t encoding, Hart<XLEN_t> *hart) {
     if constexpr (sizeof(XLEN_t) < sizeof(MEM_TYPE_t)) {
@@ -274,10 +300,11 @@ inline void ex_sc_generic(__uint32_t encoding, Hart<XLEN_t> *hart) {
     __uint32_t rd = swizzle<__uint32_t, RD>(encoding);
     __uint32_t rs1 = swizzle<__uint32_t, RS1>(encoding);
     __uint32_t rs2 = swizzle<__uint32_t, RS2>(encoding);
-    MEM_TYPE_t tmp = hart->state.regs[rs2];
-    if (!hart->template Transact<__uint32_t, AccessType::W>(hart->state.regs[rs1], (char*)&tmp))
+    bool stored;
+    if (!hart->template StoreConditional<MEM_TYPE_t>(hart->state.regs[rs1], hart->state.regs[rs2], &stored))
         return;
-    hart->state.regs[rd] = 0; // NOTE, zero means sc succeeded - for now it always does!
+    hart->state.regs[rd] = stored ? 0 : 1;
+    hart->state.regs[0] = 0;
     hart->state.pc += 4;
 }
 
@@ -290,16 +317,12 @@ inline void ex_amo_generic(__uint32_t encoding, Hart<XLEN_t> *hart) {
     __uint32_t rd = swizzle<__uint32_t, RD>(encoding);
     __uint32_t rs1 = swizzle<__uint32_t, RS1>(encoding);
     __uint32_t rs2 = swizzle<__uint32_t, RS2>(encoding);
-    MEM_TYPE_t mem_value = 0;
-    XLEN_t mem_address = hart->state.regs[rs1];
-    if (!hart->template Transact<MEM_TYPE_t, AccessType::R>(mem_address, (char*)&mem_value))
+    MEM_TYPE_t mem_value;
+    if (!hart->template AtomicMemoryOperation<MEM_TYPE_t, Operation>(hart->state.regs[rs1], hart->state.regs[rs2], &mem_value))
         return;
-    hart->state.regs[rd] = mem_value;
+    // The old value is sign extended, even for the unsigned operations
+    hart->state.regs[rd] = (std::make_signed_t<MEM_TYPE_t>)mem_value;
     hart->state.regs[0] = 0;
-    Operation operation;
-    mem_value = operation(mem_value, hart->state.regs[rs2]);
-    if (!hart->template Transact<MEM_TYPE_t, AccessType::W>(mem_address, (char*)&mem_value))
-        return;
     hart->state.pc += 4;
 }
 
@@ -310,7 +333,7 @@ inline void ex_fence(__uint32_t encoding, Hart<XLEN_t> *hart) {
 
 template<typename XLEN_t>
 inline void ex_fencei(__uint32_t encoding, Hart<XLEN_t> *hart) {
-    hart->state.implCallback(HartCallbackArgument::RequestedIfence);
+    hart->state.template Notify<HartCallbackArgument::RequestedIfence>();
     hart->state.pc += 4;
 }
 
@@ -331,36 +354,37 @@ inline void ex_ebreak(__uint32_t encoding, Hart<XLEN_t> *hart) {
 template<typename XLEN_t, bool sets_bits, bool clears_bits, bool rs1_is_immediate>
 inline void ex_csr_generic(__uint32_t encoding, Hart<XLEN_t> *hart) {
     RISCV::CSRAddress csr = (RISCV::CSRAddress)swizzle<__uint32_t, ExtendBits::Zero, I_IMM>(encoding);
-    if (hart->state.privilegeMode < RISCV::csrRequiredPrivilege(csr)) {
+    auto handler = hart->state.CSR(csr);
+    __uint32_t rd = swizzle<__uint32_t, RD>(encoding);
+    __uint32_t rs1 = swizzle<__uint32_t, RS1>(encoding);
+    bool read_required = sets_bits || clears_bits || rd;
+    bool write_required = !(sets_bits || clears_bits) || rs1;
+    if (hart->state.privilegeMode < handler->privilege || (write_required && handler->readOnly) ||
+        (handler->gatedByCounteren && !hart->state.CounterEnabled(csr))) {
         hart->state.RaiseException(RISCV::TrapCause::ILLEGAL_INSTRUCTION, encoding);
         return;
     }
-    __uint32_t rd = swizzle<__uint32_t, RD>(encoding);
-    __uint32_t rs1 = swizzle<__uint32_t, RS1>(encoding);
     XLEN_t regVal = rs1_is_immediate ? rs1 : hart->state.regs[rs1];
     XLEN_t csrValue = 0;
-    bool read_required = sets_bits || clears_bits || rd;
-    bool write_required = !(sets_bits || clears_bits) || rs1;
     if (read_required) {
-        XLEN_t csrValue = hart->state.ReadCSR(csr);
-        hart->state.regs[rd] = csrValue;
-        hart->state.regs[0] = 0;
+        csrValue = handler->read(&hart->state);
     }
-    if constexpr (sets_bits) csrValue |= regVal;
-    if constexpr (clears_bits) csrValue = ~csrValue & regVal;
     if (write_required) {
-        if (RISCV::csrIsReadOnly(csr)) {
-            hart->state.RaiseException(RISCV::TrapCause::ILLEGAL_INSTRUCTION, encoding);
-            return;
-        }
-        hart->state.WriteCSR(csr, regVal);
+        XLEN_t newValue = sets_bits ? csrValue | regVal : clears_bits ? csrValue & ~regVal : regVal;
+        handler->write(&hart->state, newValue);
+    }
+    if (read_required) {
+        hart->state.regs[rd] = csrValue;
+        hart->state.regs[0] = 0;
     }
     hart->state.pc += 4;
 }
 
 template<typename XLEN_t>
 inline void ex_wfi(__uint32_t encoding, Hart<XLEN_t> *hart) {
-    hart->state.pc += 4; // NOP for now. TODO something smarter with the hart's interrupt pins
+    // Otherwise a NOP, the run loop may park the hart until an interrupt
+    hart->NoteWfi();
+    hart->state.pc += 4;
 }
 
 // TODO URET is only provided if user-mode traps are supported, and should raise an illegal encodingruction otherwise.
@@ -378,7 +402,7 @@ inline void ex_trap_return(__uint32_t encoding, Hart<XLEN_t> *hart) {
 
 template<typename XLEN_t>
 inline void ex_sfencevma(__uint32_t encoding, Hart<XLEN_t> *hart) {
-    hart->state.implCallback(HartCallbackArgument::RequestedVMfence);
+    hart->state.template Notify<HartCallbackArgument::RequestedVMfence>();
     hart->state.pc += 4;
 }
 
@@ -583,6 +607,8 @@ template<typename XLEN_t>
 inline void ex_cj(__uint32_t encoding, Hart<XLEN_t> *hart) {
     __int32_t imm = swizzle<__uint32_t, ExtendBits::Sign, 12, 12, 8, 8, 10, 9, 6, 6, 7, 7, 2, 2, 11, 11, 5, 3, 1>(encoding);
     __uint32_t rd = 0;
+    if (imm < 0 && imm >= -Hart<XLEN_t>::spinLoopBytes) [[ unlikely ]]
+        hart->NoteBackwardBranch();
     hart->state.regs[rd] = hart->state.pc + 2;
     hart->state.regs[0] = 0;
     hart->state.pc += imm;
@@ -599,7 +625,13 @@ template<typename XLEN_t>
 inline void ex_cbeqz(__uint32_t encoding, Hart<XLEN_t> *hart) {
     __int32_t imm = swizzle<__uint32_t, ExtendBits::Sign, 12, 12, 6, 5, 2, 2, 11, 10, 4, 3, 1>(encoding);
     __uint32_t rs1 = swizzle<__uint32_t, CB_RDX_RS1X>(encoding)+8;
-    hart->state.pc += hart->state.regs[rs1] ? 2 : imm;
+    if (hart->state.regs[rs1]) {
+        hart->state.pc += 2;
+        return;
+    }
+    if (imm < 0 && imm >= -Hart<XLEN_t>::spinLoopBytes) [[ unlikely ]]
+        hart->NoteBackwardBranch();
+    hart->state.pc += imm;
 }
 
 template<typename XLEN_t>
@@ -613,7 +645,13 @@ template<typename XLEN_t>
 inline void ex_cbnez(__uint32_t encoding, Hart<XLEN_t> *hart) {
     __uint32_t rs1 = swizzle<__uint32_t, CB_RDX_RS1X>(encoding)+8;
     __int32_t imm = swizzle<__uint32_t, ExtendBits::Sign, 12, 12, 6, 5, 2, 2, 11, 10, 4, 3, 1>(encoding);
-    hart->state.pc += hart->state.regs[rs1] ? imm : 2;
+    if (!hart->state.regs[rs1]) {
+        hart->state.pc += 2;
+        return;
+    }
+    if (imm < 0 && imm >= -Hart<XLEN_t>::spinLoopBytes) [[ unlikely ]]
+        hart->NoteBackwardBranch();
+    hart->state.pc += imm;
 }
 
 template<typename XLEN_t>
@@ -911,8 +949,8 @@ template<typename XLEN_t> Instruction<XLEN_t> inst_ld  { ex_load_generic<XLEN_t,
 template<typename XLEN_t> Instruction<XLEN_t> inst_lbu { ex_load_generic<XLEN_t, __uint8_t,  false>, print_load_instr<XLEN_t, __uint8_t,  true> };
 template<typename XLEN_t> Instruction<XLEN_t> inst_lhu { ex_load_generic<XLEN_t, __uint16_t, false>, print_load_instr<XLEN_t, __uint16_t, true> };
 template<typename XLEN_t> Instruction<XLEN_t> inst_lwu { ex_load_generic<XLEN_t, __uint32_t, false>, print_load_instr<XLEN_t, __uint32_t, true> };
-template<typename XLEN_t> Instruction<XLEN_t> inst_lrw { ex_load_generic<XLEN_t, __int32_t,  true>,  print_r_type_instr<"lrw"> };
-template<typename XLEN_t> Instruction<XLEN_t> inst_lrd { ex_load_generic<XLEN_t, __int64_t,  true>,  print_r_type_instr<"lrd"> };
+template<typename XLEN_t> Instruction<XLEN_t> inst_lrw { ex_lr_generic<XLEN_t, __int32_t>, print_r_type_instr<"lrw"> };
+template<typename XLEN_t> Instruction<XLEN_t> inst_lrd { ex_lr_generic<XLEN_t, __int64_t>, print_r_type_instr<"lrd"> };
 template<typename XLEN_t> Instruction<XLEN_t> inst_sb  { ex_store_generic<XLEN_t, __uint8_t>,  print_store_instr<XLEN_t, __uint8_t> };
 template<typename XLEN_t> Instruction<XLEN_t> inst_sh  { ex_store_generic<XLEN_t, __uint16_t>, print_store_instr<XLEN_t, __uint16_t> };
 template<typename XLEN_t> Instruction<XLEN_t> inst_sw  { ex_store_generic<XLEN_t, __uint32_t>, print_store_instr<XLEN_t, __uint32_t> };
@@ -921,8 +959,8 @@ template<typename XLEN_t> Instruction<XLEN_t> inst_scw { ex_sc_generic<XLEN_t, _
 template<typename XLEN_t> Instruction<XLEN_t> inst_scd { ex_sc_generic<XLEN_t, __uint64_t>, print_r_type_instr<"scd"> };
 template<typename XLEN_t> Instruction<XLEN_t> inst_amoaddw  { ex_amo_generic<XLEN_t, __uint32_t, std::plus<__uint32_t>>, print_r_type_instr<"amoadd.w"> };
 template<typename XLEN_t> Instruction<XLEN_t> inst_amoaddd  { ex_amo_generic<XLEN_t, __uint64_t, std::plus<__uint64_t>>, print_r_type_instr<"amoadd.d"> };
-template<typename XLEN_t> Instruction<XLEN_t> inst_amoswapw { ex_amo_generic<XLEN_t, __uint32_t, lhs<__uint32_t>>, print_r_type_instr<"amoswap.w"> };
-template<typename XLEN_t> Instruction<XLEN_t> inst_amoswapd { ex_amo_generic<XLEN_t, __uint64_t, lhs<__uint64_t>>, print_r_type_instr<"amoswap.d"> };
+template<typename XLEN_t> Instruction<XLEN_t> inst_amoswapw { ex_amo_generic<XLEN_t, __uint32_t, rhs<__uint32_t>>, print_r_type_instr<"amoswap.w"> };
+template<typename XLEN_t> Instruction<XLEN_t> inst_amoswapd { ex_amo_generic<XLEN_t, __uint64_t, rhs<__uint64_t>>, print_r_type_instr<"amoswap.d"> };
 template<typename XLEN_t> Instruction<XLEN_t> inst_amoxorw  { ex_amo_generic<XLEN_t, __uint32_t, std::bit_xor<__uint32_t>>, print_r_type_instr<"amoxor.w"> };
 template<typename XLEN_t> Instruction<XLEN_t> inst_amoxord  { ex_amo_generic<XLEN_t, __uint64_t, std::bit_xor<__uint64_t>>, print_r_type_instr<"amoxor.d"> };
 template<typename XLEN_t> Instruction<XLEN_t> inst_amoorw   { ex_amo_generic<XLEN_t, __uint32_t, std::bit_or<__uint32_t>>, print_r_type_instr<"amoor.w"> };
@@ -992,3 +1030,125 @@ template<typename XLEN_t> Instruction<XLEN_t> inst_uret { ex_trap_return<XLEN_t,
 template<typename XLEN_t> Instruction<XLEN_t> inst_sret { ex_trap_return<XLEN_t, RISCV::PrivilegeMode::Supervisor>, print_just_mnemonic<"sret"> };
 template<typename XLEN_t> Instruction<XLEN_t> inst_mret { ex_trap_return<XLEN_t, RISCV::PrivilegeMode::Machine>, print_just_mnemonic<"mret"> };
 template<typename XLEN_t> Instruction<XLEN_t> inst_sfencevma { ex_sfencevma<XLEN_t>, print_just_mnemonic<"sfence.vma"> };
+
+// The halves of the pairs Hart fuses, see Hart::fusions
+template<typename XLEN_t> constexpr DecodedInstruction<XLEN_t> ex_lui = ex_upper_immediate_generic<XLEN_t, false>;
+template<typename XLEN_t> constexpr DecodedInstruction<XLEN_t> ex_auipc = ex_upper_immediate_generic<XLEN_t, true>;
+template<typename XLEN_t> constexpr DecodedInstruction<XLEN_t> ex_addi = ex_op_generic<XLEN_t, XLEN_t, std::plus<XLEN_t>, RHSType::IMM>;
+template<typename XLEN_t> constexpr DecodedInstruction<XLEN_t> ex_addiw = ex_op_generic<XLEN_t, __uint32_t, std::plus<__uint32_t>, RHSType::IMM>;
+template<typename XLEN_t> constexpr DecodedInstruction<XLEN_t> ex_slli = ex_op_generic<XLEN_t, XLEN_t, left_shift<XLEN_t>, RHSType::SHAMT>;
+template<typename XLEN_t> constexpr DecodedInstruction<XLEN_t> ex_srli = ex_op_generic<XLEN_t, XLEN_t, right_shift<XLEN_t>, RHSType::SHAMT>;
+
+// What the tracer records of an instruction besides its pc and encoding,
+// read off the encoding before it runs, as the print_* functions do. The
+// integer register it writes, or zero for none or x0.
+template<typename XLEN_t>
+inline unsigned int TracedDestination(__uint32_t encoding) {
+    if (RISCV::isCompressed(encoding)) {
+        __uint32_t funct3 = swizzle<__uint32_t, ExtendBits::Zero, 15, 13>(encoding);
+        switch (encoding & 0b11) {
+        case RISCV::OpcodeQuadrant::Q0:
+            switch (funct3) {
+            case 0: return swizzle<__uint32_t, CIW_RDX>(encoding) + 8;
+            case 1: return sizeof(XLEN_t) == 16 ? swizzle<__uint32_t, CL_RDX>(encoding) + 8 : 0;
+            case 2: return swizzle<__uint32_t, CL_RDX>(encoding) + 8;
+            case 3: return sizeof(XLEN_t) >= 8 ? swizzle<__uint32_t, CL_RDX>(encoding) + 8 : 0;
+            default: return 0;
+            }
+        case RISCV::OpcodeQuadrant::Q1:
+            switch (funct3) {
+            case 1: return sizeof(XLEN_t) == 4 ? (__uint32_t)RISCV::abiRegNum::ra : swizzle<__uint32_t, CI_RD_RS1>(encoding);
+            case 0: case 2: case 3: return swizzle<__uint32_t, CI_RD_RS1>(encoding);
+            case 4: return swizzle<__uint32_t, CB_RDX_RS1X>(encoding) + 8;
+            default: return 0;
+            }
+        case RISCV::OpcodeQuadrant::Q2:
+            switch (funct3) {
+            case 0: case 2: return swizzle<__uint32_t, CI_RD_RS1>(encoding);
+            case 1: return sizeof(XLEN_t) == 16 ? swizzle<__uint32_t, CI_RD_RS1>(encoding) : 0;
+            case 3: return sizeof(XLEN_t) >= 8 ? swizzle<__uint32_t, CI_RD_RS1>(encoding) : 0;
+            case 4:
+                // C.MV and C.ADD write rd, C.JALR writes ra, C.JR and C.EBREAK nothing
+                if (swizzle<__uint32_t, CR_RS2>(encoding) != 0)
+                    return swizzle<__uint32_t, CR_RD_RS1>(encoding);
+                if ((encoding & 1 << 12) && swizzle<__uint32_t, CR_RD_RS1>(encoding) != 0)
+                    return RISCV::abiRegNum::ra;
+                return 0;
+            default: return 0;
+            }
+        default: return 0;
+        }
+    }
+    switch (swizzle<__uint32_t, ExtendBits::Zero, 6, 2>(encoding)) {
+    case RISCV::MajorOpcode::LOAD:
+    case RISCV::MajorOpcode::OP_IMM:
+    case RISCV::MajorOpcode::AUIPC:
+    case RISCV::MajorOpcode::OP_IMM_32:
+    case RISCV::MajorOpcode::AMO:
+    case RISCV::MajorOpcode::OP:
+    case RISCV::MajorOpcode::LUI:
+    case RISCV::MajorOpcode::OP_32:
+    case RISCV::MajorOpcode::JALR:
+    case RISCV::MajorOpcode::JAL:
+        return swizzle<__uint32_t, RD>(encoding);
+    case RISCV::MajorOpcode::SYSTEM:
+        // Only the CSR instructions, which all have a nonzero funct3
+        return swizzle<__uint32_t, ExtendBits::Zero, 14, 12>(encoding) != 0 ? swizzle<__uint32_t, RD>(encoding) : 0;
+    default:
+        return 0;
+    }
+}
+
+// The data address an instruction reads or writes, if it's a load, store,
+// LR, SC or AMO, from the registers as they are before it runs.
+template<typename XLEN_t>
+inline bool TracedDataAddress(__uint32_t encoding, const XLEN_t* regs, XLEN_t* address) {
+    if (RISCV::isCompressed(encoding)) {
+        __uint32_t funct3 = swizzle<__uint32_t, ExtendBits::Zero, 15, 13>(encoding);
+        // Widths by the low bits of funct3, as the decoder picks them
+        unsigned int bytes = 4;
+        if ((funct3 & 0b11) == 1)
+            bytes = sizeof(XLEN_t) == 16 ? 16 : 8;
+        else if ((funct3 & 0b11) == 3)
+            bytes = sizeof(XLEN_t) == 4 ? 4 : 8;
+        if ((encoding & 0b11) == RISCV::OpcodeQuadrant::Q0 && funct3 != 0 && funct3 != 4) {
+            __uint32_t imm;
+            if (bytes == 16) imm = swizzle<__uint32_t, ExtendBits::Zero, 10, 10, 5, 6, 12, 11, 4>(encoding);
+            else if (bytes == 8) imm = swizzle<__uint32_t, ExtendBits::Zero, 6, 5, 12, 10, 3>(encoding);
+            else imm = swizzle<__uint32_t, ExtendBits::Zero, 5, 5, 12, 10, 6, 6, 2>(encoding);
+            *address = regs[swizzle<__uint32_t, CL_RS1X>(encoding) + 8] + imm;
+            return true;
+        }
+        if ((encoding & 0b11) == RISCV::OpcodeQuadrant::Q2 && funct3 != 0 && funct3 != 4) {
+            __uint32_t imm;
+            if (funct3 < 4) {
+                if (bytes == 16) imm = swizzle<__uint32_t, ExtendBits::Zero, 5, 2, 12, 12, 6, 6, 4>(encoding);
+                else if (bytes == 8) imm = swizzle<__uint32_t, ExtendBits::Zero, 4, 2, 12, 12, 6, 5, 3>(encoding);
+                else imm = swizzle<__uint32_t, ExtendBits::Zero, 3, 2, 12, 12, 6, 4, 2>(encoding);
+            } else {
+                if (bytes == 16) imm = swizzle<__uint32_t, ExtendBits::Zero, 10, 7, 12, 11, 4>(encoding);
+                else if (bytes == 8) imm = swizzle<__uint32_t, ExtendBits::Zero, 9, 7, 12, 10, 3>(encoding);
+                else imm = swizzle<__uint32_t, ExtendBits::Zero, 8, 7, 12, 9, 2>(encoding);
+            }
+            *address = regs[RISCV::abiRegNum::sp] + imm;
+            return true;
+        }
+        return false;
+    }
+    XLEN_t base = regs[swizzle<__uint32_t, RS1>(encoding)];
+    switch (swizzle<__uint32_t, ExtendBits::Zero, 6, 2>(encoding)) {
+    case RISCV::MajorOpcode::LOAD:
+    case RISCV::MajorOpcode::LOAD_FP:
+        *address = base + (__int32_t)swizzle<__uint32_t, ExtendBits::Sign, I_IMM>(encoding);
+        return true;
+    case RISCV::MajorOpcode::STORE:
+    case RISCV::MajorOpcode::STORE_FP:
+        *address = base + (__int32_t)swizzle<__uint32_t, S_IMM>(encoding);
+        return true;
+    case RISCV::MajorOpcode::AMO:
+        *address = base;
+        return true;
+    default:
+        return false;
+    }
+}
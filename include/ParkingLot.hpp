@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+/*
+ * Where the host threads of idle harts sleep in a free-running multi-hart
+ * run. A hart parks watching the cache line its spin loop polls, or nothing
+ * for WFI, and wakes on a store to that line from any hart, on Wake() from a
+ * device raising its interrupt, or when the timeout runs out. The timeout
+ * covers everything else, like a store that slipped in before the hart
+ * parked, and keeps hart zero's time moving while it sleeps.
+ */
+class ParkingLot {
+
+    static constexpr uintptr_t lineMask = ~(uintptr_t)63;
+    static constexpr uintptr_t noLine = 0;
+
+    struct alignas(64) Space {
+        std::atomic<uintptr_t> line = noLine;
+        std::mutex lock;
+        std::condition_variable wake;
+        bool woken = false;
+    };
+
+    unsigned int harts;
+    std::unique_ptr<Space[]> spaces;
+    // How many harts are parked, so stores can skip the scan when none are
+    std::atomic<unsigned int> parked = 0;
+
+public:
+
+    ParkingLot(unsigned int numHarts) :
+        harts(numHarts),
+        spaces(new Space[numHarts]) { }
+
+    // Sleeps the calling thread on behalf of a hart. Returns early, straight
+    // away even, if the hart was woken since it last parked.
+    template<typename Rep, typename Period>
+    void Park(unsigned int hartid, const char* watched, std::chrono::duration<Rep, Period> timeout) {
+        Space& space = spaces[hartid];
+        std::unique_lock<std::mutex> guard(space.lock);
+        space.line.store(watched == nullptr ? noLine : (uintptr_t)watched & lineMask, std::memory_order_relaxed);
+        parked.fetch_add(1);
+        space.wake.wait_for(guard, timeout, [&space]() { return space.woken; });
+        space.woken = false;
+        parked.fetch_sub(1);
+        space.line.store(noLine, std::memory_order_relaxed);
+    }
+
+    void Wake(unsigned int hartid) {
+        if (hartid >= harts) {
+            return;
+        }
+        Space& space = spaces[hartid];
+        std::lock_guard<std::mutex> guard(space.lock);
+        space.woken = true;
+        space.wake.notify_one();
+    }
+
+    // Wakes every hart watching a line touched by a store of size bytes.
+    inline void NotifyStore(const char* host, unsigned int size) {
+        if (parked.load(std::memory_order_relaxed) == 0) [[ likely ]] {
+            return;
+        }
+        uintptr_t first = (uintptr_t)host & lineMask;
+        uintptr_t last = ((uintptr_t)host + size - 1) & lineMask;
+        for (unsigned int i = 0; i < harts; i++) {
+            uintptr_t line = spaces[i].line.load(std::memory_order_relaxed);
+            if (line != noLine && (line == first || line == last)) {
+                Wake(i);
+            }
+        }
+    }
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+
+// Simulator events a guest can count in mhpmcounter3 through 31, by writing
+// the event's number to the matching mhpmevent. They describe the simulator
+// rather than any real microarchitecture, so a guest profiler sees what the
+// model is spending its time on.
+enum PerformanceEvent : unsigned int {
+    NoEvent = 0,
+    TranslationCacheMiss = 1, // A load, store or fetch missed the hart's translation caches
+    IcacheMiss = 2,           // An instruction was fetched and decoded, not found in the icache
+    TrapTaken = 3,            // An exception or interrupt was taken, to any mode
+    PageWalk = 4,             // A virtual address was translated through the page tables
+    DeviceAccess = 5,         // A load or store went to a device rather than RAM
+    NumPerformanceEvents
+};
+
+// The events harts count, one bit per event number. The rest aren't
+// counted at all; the code that would count them compiles away, and writing
+// them to an mhpmevent selects no event. Build with, say,
+// -DGRIM_PERFORMANCE_EVENTS=0x3e to count every event.
+#ifndef GRIM_PERFORMANCE_EVENTS
+#define GRIM_PERFORMANCE_EVENTS 0
+#endif
+constexpr __uint32_t countedPerformanceEvents = (GRIM_PERFORMANCE_EVENTS) & ((1u << NumPerformanceEvents) - 2);
+
+constexpr inline bool performanceEventCounted(unsigned int event) {
+    return event < NumPerformanceEvents && (countedPerformanceEvents & (1u << event));
+}
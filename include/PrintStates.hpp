@@ -6,8 +6,8 @@
 #include <RiscV.hpp>
 #include <RiscVDecoder.hpp>
 
-template<typename XLEN_t>
-void PrintArchDetails(HartState<XLEN_t>* state, std::ostream* out) {
+template<typename XLEN_t, typename Owner>
+void PrintArchDetails(HartState<XLEN_t, Owner>* state, std::ostream* out) {
     (*out) << "Details:" << std::endl;
     (*out) << "| misa: rv" << RISCV::xlenModeName(state->misa.mxlen)
            << RISCV::extensionsToString(state->misa.extensions)
@@ -139,13 +139,13 @@ void PrintArchDetails(HartState<XLEN_t>* state, std::ostream* out) {
     // TODO PMP
 }
 
-template<>
-void PrintArchDetails<__uint128_t>(HartState<__uint128_t>* state, std::ostream* out) {
+template<typename Owner>
+void PrintArchDetails(HartState<__uint128_t, Owner>* state, std::ostream* out) {
     (*out) << "128-bit prints not supported";
 }
 
-template<typename XLEN_t>
-void PrintRegisters(HartState<XLEN_t>* state, std::ostream* out, bool abi, unsigned int regsPerLine) {
+template<typename XLEN_t, typename Owner>
+void PrintRegisters(HartState<XLEN_t, Owner>* state, std::ostream* out, bool abi, unsigned int regsPerLine) {
     (*out) << "Registers:" << std::endl;
     for (unsigned int i = 0; i < 32; i++) {
         if (i % regsPerLine == 0) {
@@ -169,7 +169,7 @@ void PrintRegisters(HartState<XLEN_t>* state, std::ostream* out, bool abi, unsig
     }
 }
 
-template<> 
-void PrintRegisters<__uint128_t>(HartState<__uint128_t>* state, std::ostream* out, bool abi, unsigned int regsPerLine) {
+template<typename Owner>
+void PrintRegisters(HartState<__uint128_t, Owner>* state, std::ostream* out, bool abi, unsigned int regsPerLine) {
     (*out) << "128-bit prints not supported";
 }
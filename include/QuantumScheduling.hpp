@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <Devices/CoreLocalInterruptor.hpp>
+#include <EventQueue.hpp>
+#include <EventScheduler.hpp>
+#include <Hart.hpp>
+
+/*
+ * The quantum scheduling shared by the multi-hart run loops: one hart's turn
+ * of a quantum, and the round-robin driver that takes turns on the calling
+ * thread. The threaded drivers run the same turns, each on its own thread.
+ */
+
+// Counters for one hart of a multi-hart run, on a cache line of their own
+// since its thread updates them after every block.
+struct alignas(64) HartStats {
+    std::atomic<__uint64_t> retired = 0;
+    // The rest are only read after the thread exits
+    __uint64_t barrierWaitNanoseconds = 0;
+    __uint64_t parks = 0; // Times the hart went idle and its thread stopped
+    __uint64_t parkedNanoseconds = 0;
+    __uint64_t skippedTicks = 0; // Instructions of quanta given up for idling
+    bool pinned = true;
+    int node = -1; // The host NUMA node the thread finished on
+};
+
+// Runs one hart for a quantum, in blocks of at most fastLoopTicks, with hart
+// zero keeping time. If park is set, a hart that goes idle gives up the rest
+// of its quantum, with hart zero still advancing time over what it skipped,
+// so that time runs the same with or without parking.
+template <typename MXLEN_t>
+void run_quantum(Hart<MXLEN_t> *hart, EventScheduler *scheduler, unsigned int quantum, bool park, HartStats *stats) {
+    unsigned int hartid = (unsigned int)hart->state.mhartid;
+    for (unsigned int ran = 0; ran < quantum; ) {
+        if (hartid == 0) {
+            unsigned int block = hart->Tick(scheduler->Headroom(quantum - ran));
+            ran += block;
+            scheduler->Advance(block);
+        } else {
+            ran += hart->Tick(quantum - ran);
+        }
+        char *watched;
+        typename Hart<MXLEN_t>::Idle idle = park ? hart->TakeIdle(&watched) : Hart<MXLEN_t>::Idle::None;
+        if (idle == Hart<MXLEN_t>::Idle::None ||
+            (idle == Hart<MXLEN_t>::Idle::Wfi && hart->state.InterruptPending())) [[ likely ]] {
+            continue;
+        }
+        stats->parks++;
+        stats->skippedTicks += quantum - ran;
+        if (hartid == 0) {
+            scheduler->Advance(quantum - ran);
+        }
+        ran = quantum;
+    }
+}
+
+// Runs the harts on the calling thread, quantum instructions each in order of
+// hartid, sampling each one's CLINT lines just before its turn. Time only
+// moves with hart zero's instructions, so the whole run, interleaving
+// included, is a function of the program and the quantum alone. Each round
+// counts as a barrier. Returns the first event popped, if check_events is
+// set, or zero once the harts have retired more than cycle_limit between them.
+template <typename MXLEN_t>
+unsigned int tick_harts_deterministic(
+        std::vector<std::unique_ptr<Hart<MXLEN_t>>> *harts,
+        CoreLocalInterruptor *clint,
+        EventScheduler *scheduler,
+        EventQueue *eq,
+        std::vector<HartStats> *stats,
+        __uint64_t *barriers,
+        __uint64_t *ticks,
+        __uint64_t cycle_limit,
+        bool check_events,
+        unsigned int quantum,
+        bool park) {
+
+    unsigned int event = 0;
+    while (true) {
+        for (size_t i = 0; i < harts->size(); i++) {
+            Hart<MXLEN_t> *hart = (*harts)[i].get();
+            clint->UpdateInterrupts((unsigned int)hart->state.mhartid, &hart->state);
+            hart->state.ServiceInterrupts();
+            run_quantum(hart, scheduler, quantum, park, &(*stats)[i]);
+            *ticks += quantum;
+        }
+        (*barriers)++;
+        if (check_events && eq->Pending() && eq->Pop(&event)) {
+            return event;
+        }
+        if (cycle_limit > 0 && *ticks > cycle_limit) {
+            return 0;
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+/*
+ * The LR/SC reservations of every hart in a multi-hart system, so that a store
+ * from any hart can break the others'. Reservations are kept by the host
+ * address of the reserved 8 byte granule of guest RAM, one per hart. A lone
+ * hart needs none of this and doesn't get one.
+ */
+class ReservationSet {
+
+    static constexpr uintptr_t granuleMask = ~(uintptr_t)7;
+    static constexpr uintptr_t noGranule = 0;
+
+    unsigned int harts;
+    std::unique_ptr<std::atomic<uintptr_t>[]> granules;
+    // How many harts hold a reservation, so stores can skip the scan when
+    // nobody does, which is almost always.
+    std::atomic<unsigned int> held = 0;
+
+public:
+
+    ReservationSet(unsigned int numHarts) :
+        harts(numHarts),
+        granules(new std::atomic<uintptr_t>[numHarts]) {
+        for (unsigned int i = 0; i < harts; i++) {
+            granules[i] = noGranule;
+        }
+    }
+
+    void Reserve(unsigned int hartid, const char* host) {
+        if (granules[hartid].exchange((uintptr_t)host & granuleMask) == noGranule) {
+            held.fetch_add(1);
+        }
+    }
+
+    // Drops the hart's reservation. Returns true if it still held one on the
+    // granule containing host.
+    bool Release(unsigned int hartid, const char* host) {
+        uintptr_t previous = granules[hartid].exchange(noGranule);
+        if (previous != noGranule) {
+            held.fetch_sub(1);
+        }
+        return previous == ((uintptr_t)host & granuleMask);
+    }
+
+    // Breaks every reservation on a granule touched by a store of size bytes.
+    inline void Invalidate(const char* host, unsigned int size) {
+        if (held.load(std::memory_order_relaxed) == 0) [[ likely ]] {
+            return;
+        }
+        uintptr_t first = (uintptr_t)host & granuleMask;
+        uintptr_t last = ((uintptr_t)host + size - 1) & granuleMask;
+        for (unsigned int i = 0; i < harts; i++) {
+            uintptr_t granule = granules[i].load(std::memory_order_relaxed);
+            if ((granule == first || granule == last) &&
+                granules[i].compare_exchange_strong(granule, noGranule)) {
+                held.fetch_sub(1);
+            }
+        }
+    }
+};
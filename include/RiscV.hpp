@@ -1,5 +1,6 @@
 #pragma once
 
+#include <bit>
 #include <cstdint>
 #include <type_traits>
 #include <array>
@@ -764,7 +765,7 @@ inline constexpr PrivilegeMode csrRequiredPrivilege(CSRAddress addr) {
     return (PrivilegeMode) ((addr & 0b001100000000) >> 8);
 }
 
-inline bool csrIsReadOnly(CSRAddress addr) {
+inline constexpr bool csrIsReadOnly(CSRAddress addr) {
     return (addr & 0b110000000000) == 0b110000000000;
 }
 
@@ -785,7 +786,7 @@ constexpr static __uint32_t meiMask = 0b0100000000000;
 template<typename XLEN_t>
 PrivilegeMode DestinedPrivilegeForCause(TrapCause cause, XLEN_t mdeleg, XLEN_t sdeleg, __uint32_t extensions) {
 
-    XLEN_t causeMask = 1 << cause;
+    XLEN_t causeMask = (XLEN_t)1 << cause;
 
     // Without U mode, there is no S mode either, so M mode takes it.
     if (!vectorHasExtension(extensions, 'U')) {
@@ -812,31 +813,45 @@ PrivilegeMode DestinedPrivilegeForCause(TrapCause cause, XLEN_t mdeleg, XLEN_t s
     return PrivilegeMode::User;
 }
 
+// The same decision as DestinedPrivilegeForCause, for a whole word of
+// interrupt bits at once.
+template<typename XLEN_t>
+inline void SplitInterruptsByPrivilege(XLEN_t interrupts, XLEN_t mdeleg, XLEN_t sdeleg, __uint32_t extensions,
+                                       XLEN_t* forM, XLEN_t* forS, XLEN_t* forU) {
+    if (!vectorHasExtension(extensions, 'U')) {
+        *forM = interrupts;
+        *forS = *forU = 0;
+        return;
+    }
+    *forM = interrupts & ~mdeleg;
+    XLEN_t delegated = interrupts & mdeleg;
+    if (!vectorHasExtension(extensions, 'S')) {
+        *forS = 0;
+        *forU = delegated;
+        return;
+    }
+    *forS = delegated & ~sdeleg;
+    *forU = delegated & sdeleg;
+}
+
 template<typename XLEN_t>
 TrapCause highestPriorityInterrupt(XLEN_t interruptsToService) {
-    // The order in the spec is: MEI MSI MTI SEI SSI STI UEI USI UTI
-    if (interruptsToService & (1 << TrapCause::MACHINE_EXTERNAL_INTERRUPT)) {
-        return TrapCause::MACHINE_EXTERNAL_INTERRUPT;
-    } else if (interruptsToService & (1 << TrapCause::MACHINE_SOFTWARE_INTERRUPT)) {
-        return TrapCause::MACHINE_SOFTWARE_INTERRUPT;
-    } else if (interruptsToService & (1 << TrapCause::MACHINE_TIMER_INTERRUPT)) {
-        return TrapCause::MACHINE_TIMER_INTERRUPT;
-    } else if (interruptsToService & (1 << TrapCause::SUPERVISOR_EXTERNAL_INTERRUPT)) {
-        return TrapCause::SUPERVISOR_EXTERNAL_INTERRUPT;
-    } else if (interruptsToService & (1 << TrapCause::SUPERVISOR_SOFTWARE_INTERRUPT)) {
-        return TrapCause::SUPERVISOR_SOFTWARE_INTERRUPT;
-    } else if (interruptsToService & (1 << TrapCause::SUPERVISOR_TIMER_INTERRUPT)) {
-        return TrapCause::SUPERVISOR_TIMER_INTERRUPT;
-    } else if (interruptsToService & (1 << TrapCause::USER_EXTERNAL_INTERRUPT)) {
-        return TrapCause::USER_EXTERNAL_INTERRUPT;
-    } else if (interruptsToService & (1 << TrapCause::USER_SOFTWARE_INTERRUPT)) {
-        return TrapCause::USER_SOFTWARE_INTERRUPT;
-    } else if (interruptsToService & (1 << TrapCause::USER_TIMER_INTERRUPT)) {
-        return TrapCause::USER_TIMER_INTERRUPT;
-    } else {
+    // The order in the spec is: MEI MSI MTI SEI SSI STI UEI USI UTI. Each
+    // mode's software, timer and external interrupts sit at bits p, p+4 and
+    // p+8, where p is the mode's number, so fold the three nibbles into one
+    // and the highest mode with anything pending is the highest bit set.
+    // Within that mode, external beats software beats timer.
+    unsigned int software = interruptsToService & 0xf;
+    unsigned int timer = (interruptsToService >> 4) & 0xf;
+    unsigned int external = (interruptsToService >> 8) & 0xf;
+    unsigned int modes = software | timer | external;
+    if (modes == 0) {
         // This indicates custom interrupts... TODO ?
         return TrapCause::NONE;
     }
+    unsigned int mode = std::bit_width(modes) - 1;
+    unsigned int bit = 1u << mode;
+    return (TrapCause)(mode + ((external & bit) ? 8 : (software & bit) ? 0 : 4));
 }
 
 // TODO comment for what this section of the spec-knowledge is. In general I need to sort this doc...
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/*
+ * A small LZ77 byte codec for trace blocks, in the spirit of LZ4: a greedy
+ * single-probe hash matcher on the compress side and a branch-light copy loop
+ * on the decompress side. Delta-encoded trace records are extremely repetitive
+ * (the same loop bodies over and over), so this gets most of the win of a real
+ * compressor without pulling in an external dependency.
+ *
+ * Stream format, repeated until the input is exhausted:
+ *   token         high nibble literal count, low nibble match length - minMatch
+ *   [255...]      extra literal count bytes when the nibble is 15
+ *   literals
+ *   offset        16 bit little-endian distance back to the match
+ *   [255...]      extra match length bytes when the nibble is 15
+ * The final sequence carries literals only and ends at the end of the input.
+ */
+class TraceCodec {
+
+    static constexpr unsigned int hashBits = 13;
+    static constexpr unsigned int minMatch = 4;
+    static constexpr unsigned int maxOffset = 0xFFFF;
+
+    static inline __uint32_t Load32(const __uint8_t* p) {
+        __uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static inline unsigned int Hash(__uint32_t sequence) {
+        return (sequence * 2654435761u) >> (32 - hashBits);
+    }
+
+    static inline void PutLength(size_t length, std::vector<__uint8_t>* out) {
+        while (length >= 255) {
+            out->push_back(255);
+            length -= 255;
+        }
+        out->push_back((__uint8_t)length);
+    }
+
+    static inline bool GetLength(const __uint8_t** in, const __uint8_t* end, size_t* length) {
+        __uint8_t byte;
+        do {
+            if (*in == end) {
+                return false;
+            }
+            byte = *(*in)++;
+            *length += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    static void PutSequence(const __uint8_t* literals, size_t literalCount,
+                            size_t offset, size_t matchLength, std::vector<__uint8_t>* out) {
+        size_t matchCode = matchLength ? matchLength - minMatch : 0;
+        __uint8_t token = (literalCount < 15 ? literalCount : 15) << 4 |
+                          (matchCode < 15 ? matchCode : 15);
+        out->push_back(token);
+        if (literalCount >= 15) {
+            PutLength(literalCount - 15, out);
+        }
+        out->insert(out->end(), literals, literals + literalCount);
+        if (matchLength == 0) {
+            return;
+        }
+        out->push_back(offset & 0xFF);
+        out->push_back(offset >> 8);
+        if (matchCode >= 15) {
+            PutLength(matchCode - 15, out);
+        }
+    }
+
+public:
+
+    // Appends the compressed form of in[0, size) to out.
+    static void Compress(const __uint8_t* in, size_t size, std::vector<__uint8_t>* out) {
+        __uint32_t table[1 << hashBits];
+        memset(table, 0xFF, sizeof(table));
+        size_t anchor = 0;
+        size_t i = 0;
+        while (i + minMatch <= size) {
+            __uint32_t sequence = Load32(in + i);
+            unsigned int hash = Hash(sequence);
+            size_t candidate = table[hash];
+            table[hash] = i;
+            if (candidate == 0xFFFFFFFF || i - candidate > maxOffset ||
+                Load32(in + candidate) != sequence) {
+                i++;
+                continue;
+            }
+            size_t length = minMatch;
+            while (i + length < size && in[candidate + length] == in[i + length]) {
+                length++;
+            }
+            PutSequence(in + anchor, i - anchor, i - candidate, length, out);
+            i += length;
+            anchor = i;
+        }
+        PutSequence(in + anchor, size - anchor, 0, 0, out);
+    }
+
+    // Decompresses in[0, size) into out[0, outSize). Returns false if the
+    // input is malformed or doesn't decompress to exactly outSize bytes.
+    static bool Decompress(const __uint8_t* in, size_t size, __uint8_t* out, size_t outSize) {
+        const __uint8_t* inEnd = in + size;
+        size_t o = 0;
+        while (in < inEnd) {
+            __uint8_t token = *in++;
+            size_t literalCount = token >> 4;
+            if (literalCount == 15 && !GetLength(&in, inEnd, &literalCount)) {
+                return false;
+            }
+            if (literalCount > (size_t)(inEnd - in) || literalCount > outSize - o) {
+                return false;
+            }
+            memcpy(out + o, in, literalCount);
+            in += literalCount;
+            o += literalCount;
+            if (in == inEnd) {
+                break;
+            }
+            if (inEnd - in < 2) {
+                return false;
+            }
+            size_t offset = in[0] | (in[1] << 8);
+            in += 2;
+            size_t length = token & 0xF;
+            if (length == 15 && !GetLength(&in, inEnd, &length)) {
+                return false;
+            }
+            length += minMatch;
+            if (offset == 0 || offset > o || length > outSize - o) {
+                return false;
+            }
+            // Byte at a time, since matches may overlap their own output.
+            const __uint8_t* match = out + o - offset;
+            for (size_t j = 0; j < length; j++) {
+                out[o + j] = match[j];
+            }
+            o += length;
+        }
+        return o == outSize;
+    }
+};
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <RiscV.hpp>
+#include <Trace/TraceRecord.hpp>
+
+/*
+ * Delta encoding of TraceRecords, used inside Compressed trace blocks. Most
+ * fields of a record are predictable from the ones before it, so each record
+ * is a control byte followed by only the fields that weren't:
+ *
+ *   pc           omitted when it is the sequential next pc
+ *   encoding     omitted when the same pc was seen with the same encoding
+ *   rd, value    omitted when no register changed; the value is stored as a
+ *                difference from that register's last traced value
+ *   memAddress   difference from the previous data address
+ *   privilege    omitted unless it changed
+ *
+ * Differences are zigzag LEB128 varints. Encoder and decoder keep mirrored
+ * state and must both be Reset() at every block boundary.
+ */
+
+enum TraceDeltaControl : __uint8_t {
+    PcJump          = 0b000001,
+    RegisterWrite   = 0b000010,
+    MemoryAccess    = 0b000100,
+    Fault           = 0b001000,
+    PrivilegeChange = 0b010000,
+    KnownEncoding   = 0b100000
+};
+
+class TraceDeltaState {
+
+protected:
+
+    static constexpr unsigned int encodingCacheBits = 10;
+
+    struct EncodingCacheEntry { __uint64_t pc; __uint32_t encoding; };
+
+    __uint64_t expectedPc;
+    __uint64_t lastMemAddress;
+    __uint8_t privilege;
+    __uint64_t regs[RISCV::NumRegs];
+    EncodingCacheEntry encodingCache[1 << encodingCacheBits];
+
+    static inline EncodingCacheEntry* CacheSlot(EncodingCacheEntry* cache, __uint64_t pc) {
+        return &cache[(pc >> 1) & ((1 << encodingCacheBits) - 1)];
+    }
+
+    static inline unsigned int EncodingBytes(__uint32_t encoding) {
+        return (encoding & 0b11) == 0b11 ? 4 : 2;
+    }
+
+    void Advance(const TraceRecord& record) {
+        if (record.flags & TraceFlag::FetchFault) {
+            expectedPc = record.pc;
+        } else {
+            expectedPc = record.pc + EncodingBytes(record.encoding);
+        }
+        if (record.rd != 0) {
+            regs[record.rd] = record.rdValue;
+        }
+        if (record.flags & TraceFlag::DataAccess) {
+            lastMemAddress = record.memAddress;
+        }
+        privilege = record.privilege;
+    }
+
+public:
+
+    TraceDeltaState() {
+        Reset();
+    }
+
+    void Reset() {
+        expectedPc = 0;
+        lastMemAddress = 0;
+        privilege = RISCV::PrivilegeMode::Machine;
+        memset(regs, 0, sizeof(regs));
+        // An odd pc never matches a real instruction, so this marks every
+        // slot empty.
+        for (EncodingCacheEntry& entry : encodingCache) {
+            entry = { 1, 0 };
+        }
+    }
+};
+
+class TraceDeltaEncoder : public TraceDeltaState {
+
+    static inline void PutVarint(__uint64_t value, std::vector<__uint8_t>* out) {
+        while (value >= 0x80) {
+            out->push_back((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        out->push_back(value);
+    }
+
+    static inline void PutDelta(__uint64_t value, __uint64_t previous, std::vector<__uint8_t>* out) {
+        __uint64_t delta = value - previous;
+        PutVarint((delta << 1) ^ (__uint64_t)((__int64_t)delta >> 63), out);
+    }
+
+public:
+
+    void Encode(const TraceRecord& record, std::vector<__uint8_t>* out) {
+        size_t controlAt = out->size();
+        out->push_back(0);
+        __uint8_t control = 0;
+        if (record.pc != expectedPc) {
+            control |= TraceDeltaControl::PcJump;
+            PutDelta(record.pc, expectedPc, out);
+        }
+        if (record.flags & TraceFlag::FetchFault) {
+            control |= TraceDeltaControl::Fault;
+        } else {
+            EncodingCacheEntry* slot = CacheSlot(encodingCache, record.pc);
+            if (slot->pc == record.pc && slot->encoding == record.encoding) {
+                control |= TraceDeltaControl::KnownEncoding;
+            } else {
+                *slot = { record.pc, record.encoding };
+                for (unsigned int i = 0; i < EncodingBytes(record.encoding); i++) {
+                    out->push_back(record.encoding >> (8 * i));
+                }
+            }
+        }
+        if (record.rd != 0) {
+            control |= TraceDeltaControl::RegisterWrite;
+            out->push_back(record.rd);
+            PutDelta(record.rdValue, regs[record.rd], out);
+        }
+        if (record.flags & TraceFlag::DataAccess) {
+            control |= TraceDeltaControl::MemoryAccess;
+            PutDelta(record.memAddress, lastMemAddress, out);
+        }
+        if (record.privilege != privilege) {
+            control |= TraceDeltaControl::PrivilegeChange;
+            out->push_back(record.privilege);
+        }
+        (*out)[controlAt] = control;
+        Advance(record);
+    }
+};
+
+class TraceDeltaDecoder : public TraceDeltaState {
+
+    static inline bool GetVarint(const __uint8_t** in, const __uint8_t* end, __uint64_t* value) {
+        *value = 0;
+        for (unsigned int shift = 0; shift < 64; shift += 7) {
+            if (*in == end) {
+                return false;
+            }
+            __uint8_t byte = *(*in)++;
+            *value |= (__uint64_t)(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static inline bool GetDelta(const __uint8_t** in, const __uint8_t* end, __uint64_t previous, __uint64_t* value) {
+        __uint64_t zigzag;
+        if (!GetVarint(in, end, &zigzag)) {
+            return false;
+        }
+        *value = previous + ((zigzag >> 1) ^ -(zigzag & 1));
+        return true;
+    }
+
+public:
+
+    // Decodes one record from *in, advancing it. Returns false if the input
+    // ends early.
+    bool Decode(const __uint8_t** in, const __uint8_t* end, TraceRecord* record) {
+        *record = { };
+        if (*in == end) {
+            return false;
+        }
+        __uint8_t control = *(*in)++;
+        record->pc = expectedPc;
+        if ((control & TraceDeltaControl::PcJump) && !GetDelta(in, end, expectedPc, &record->pc)) {
+            return false;
+        }
+        if (control & TraceDeltaControl::Fault) {
+            record->flags |= TraceFlag::FetchFault;
+        } else if (control & TraceDeltaControl::KnownEncoding) {
+            record->encoding = CacheSlot(encodingCache, record->pc)->encoding;
+        } else {
+            if (end - *in < 2) {
+                return false;
+            }
+            record->encoding = (*in)[0] | ((*in)[1] << 8);
+            if (EncodingBytes(record->encoding) == 4) {
+                if (end - *in < 4) {
+                    return false;
+                }
+                record->encoding |= ((__uint32_t)(*in)[2] << 16) | ((__uint32_t)(*in)[3] << 24);
+            }
+            *in += EncodingBytes(record->encoding);
+            *CacheSlot(encodingCache, record->pc) = { record->pc, record->encoding };
+        }
+        if (control & TraceDeltaControl::RegisterWrite) {
+            if (*in == end) {
+                return false;
+            }
+            record->rd = *(*in)++;
+            if (record->rd >= RISCV::NumRegs || !GetDelta(in, end, regs[record->rd], &record->rdValue)) {
+                return false;
+            }
+        }
+        if (control & TraceDeltaControl::MemoryAccess) {
+            record->flags |= TraceFlag::DataAccess;
+            if (!GetDelta(in, end, lastMemAddress, &record->memAddress)) {
+                return false;
+            }
+        }
+        record->privilege = privilege;
+        if (control & TraceDeltaControl::PrivilegeChange) {
+            if (*in == end) {
+                return false;
+            }
+            record->privilege = *(*in)++;
+        }
+        Advance(*record);
+        return true;
+    }
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <RiscV.hpp>
+
+/*
+ * Which instructions a filtered trace keeps, by virtual pc, privilege mode and
+ * address space. The hart evaluates this when it fills an icache entry, not
+ * per instruction: matching entries get a tracing trampoline and everything
+ * else runs on the untouched fast path.
+ */
+struct TraceFilter {
+
+    struct PcRange {
+        __uint64_t first;
+        __uint64_t last;
+    };
+
+    static constexpr unsigned int allPrivileges =
+        1 << RISCV::PrivilegeMode::User |
+        1 << RISCV::PrivilegeMode::Supervisor |
+        1 << RISCV::PrivilegeMode::Machine;
+
+    std::vector<PcRange> pcRanges; // Empty matches every pc
+    unsigned int privileges = allPrivileges; // Bit per RISCV::PrivilegeMode
+    bool matchAsid = false;
+    __uint64_t asid = 0;
+
+    // True if the filter depends on more than the pc, so cached decisions
+    // must be dropped whenever the privilege mode or address space changes.
+    bool DependsOnContext() const {
+        return privileges != allPrivileges || matchAsid;
+    }
+
+    bool Matches(__uint64_t pc, RISCV::PrivilegeMode privilege, __uint64_t currentAsid) const {
+        if (!(privileges & (1 << privilege))) {
+            return false;
+        }
+        if (matchAsid && currentAsid != asid) {
+            return false;
+        }
+        if (pcRanges.empty()) {
+            return true;
+        }
+        for (const PcRange& range : pcRanges) {
+            if (pc >= range.first && pc <= range.last) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Accepts a comma separated list of FIRST-LAST inclusive ranges.
+    bool ParsePcRanges(std::string spec) {
+        size_t start = 0;
+        while (start <= spec.size()) {
+            size_t comma = spec.find(',', start);
+            std::string range = spec.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+            size_t dash = range.find('-');
+            if (dash == std::string::npos) {
+                return false;
+            }
+            char* end;
+            PcRange parsed;
+            parsed.first = strtoull(range.substr(0, dash).c_str(), &end, 0);
+            if (*end != '\0' || dash == 0) {
+                return false;
+            }
+            parsed.last = strtoull(range.substr(dash + 1).c_str(), &end, 0);
+            if (*end != '\0' || dash + 1 == range.size() || parsed.last < parsed.first) {
+                return false;
+            }
+            pcRanges.push_back(parsed);
+            if (comma == std::string::npos) {
+                break;
+            }
+            start = comma + 1;
+        }
+        return true;
+    }
+
+    // Accepts any combination of the letters m, s and u.
+    bool ParsePrivileges(std::string spec) {
+        privileges = 0;
+        for (char letter : spec) {
+            switch (letter) {
+            case 'm': privileges |= 1 << RISCV::PrivilegeMode::Machine; break;
+            case 's': privileges |= 1 << RISCV::PrivilegeMode::Supervisor; break;
+            case 'u': privileges |= 1 << RISCV::PrivilegeMode::User; break;
+            default: return false;
+            }
+        }
+        return privileges != 0;
+    }
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+
+#include <Hart.hpp>
+#include <Trace/TraceRecord.hpp>
+
+// Formats one trace record the same way -p d prints an instruction, plus the
+// side effects the record captured. Shared by the offline trace tools.
+template<typename XLEN_t>
+void PrintRecord(const TraceRecord* record, const TraceFileHeader* header, std::ostream* out) {
+    (*out) << std::hex << std::setfill('0') << std::setw(sizeof(XLEN_t)*2)
+           << record->pc << ":\t";
+    if (record->flags & TraceFlag::FetchFault) {
+        (*out) << "(fetch fault)" << std::endl;
+        return;
+    }
+    (*out) << std::hex << std::setfill('0') << std::setw(sizeof(record->encoding)*2)
+           << record->encoding << "\t" << std::dec;
+    RISCV::XlenMode mxlen = RISCV::xlenTypeToMode<XLEN_t>();
+    Instruction<XLEN_t> instruction = decode_instruction<XLEN_t>(record->encoding, header->extensions, mxlen);
+    std::ostringstream disassembly;
+    instruction.disassemblyFunction(record->encoding, &disassembly);
+    std::string text = disassembly.str();
+    if (!text.empty() && text.back() == '\n') {
+        text.pop_back();
+    }
+    (*out) << text;
+    if (record->rd != 0) {
+        (*out) << "\t# " << RISCV::regName(record->rd) << "=0x"
+               << std::hex << std::setfill('0') << std::setw(sizeof(XLEN_t)*2)
+               << record->rdValue;
+    }
+    if (record->flags & TraceFlag::DataAccess) {
+        (*out) << (record->rd != 0 ? " " : "\t# ") << "mem=0x"
+               << std::hex << std::setfill('0') << std::setw(sizeof(XLEN_t)*2)
+               << record->memAddress;
+    }
+    (*out) << std::endl;
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <Trace/TraceCodec.hpp>
+#include <Trace/TraceDelta.hpp>
+#include <Trace/TraceRecord.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Reader for trace files of either format, with Seek() to any instruction
+ * count. The file is memory mapped, so Raw records are handed out straight
+ * from the page cache and Compressed blocks decompress directly out of it;
+ * a seek costs at most one block of decoding no matter how far it lands.
+ */
+class TraceReader {
+
+    // Raw traces have no blocks of their own, so they're handed out in spans this big
+    static constexpr unsigned int rawBlockRecords = 1 << 16;
+
+    const __uint8_t* mapping = nullptr;
+    size_t fileSize = 0;
+    TraceFileHeader header;
+    __uint64_t recordCount = 0;
+    __uint64_t position = 0;
+
+    // Compressed format state
+    std::vector<TraceIndexEntry> index;
+    std::vector<TraceRecord> block;
+    std::vector<__uint8_t> rawBytes;
+    TraceDeltaDecoder decoder;
+    size_t loadedBlock = ~(size_t)0;
+
+public:
+
+    ~TraceReader() {
+        if (mapping != nullptr) {
+            munmap((void*)mapping, fileSize);
+        }
+    }
+
+    bool Open(std::string fileName) {
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) != 0 || (size_t)fileStat.st_size < sizeof(TraceFileHeader)) {
+            close(fd);
+            return false;
+        }
+        fileSize = fileStat.st_size;
+        void* mapped = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        mapping = (const __uint8_t*)mapped;
+        madvise(mapped, fileSize, MADV_SEQUENTIAL);
+        memcpy(&header, mapping, sizeof(header));
+        if (!header.Valid()) {
+            return false;
+        }
+        switch (header.format) {
+        case TraceFormat::Raw:
+            recordCount = (fileSize - sizeof(TraceFileHeader)) / sizeof(TraceRecord);
+            return true;
+        case TraceFormat::Compressed:
+            if (!LoadIndex()) {
+                RebuildIndex();
+            }
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    const TraceFileHeader& Header() const {
+        return header;
+    }
+
+    __uint64_t RecordCount() const {
+        return recordCount;
+    }
+
+    __uint64_t Position() const {
+        return position;
+    }
+
+    bool Seek(__uint64_t recordIndex) {
+        if (recordIndex > recordCount) {
+            return false;
+        }
+        position = recordIndex;
+        return true;
+    }
+
+    // Hands out the longest run of records from the current position that is
+    // contiguous in memory, at most maxRecords long, and advances past it. The
+    // span stays valid until the next call. Returns zero at the end of the
+    // trace, or if a block fails to decode.
+    size_t NextSpan(const TraceRecord** records, size_t maxRecords) {
+        if (position >= recordCount) {
+            return 0;
+        }
+        size_t available;
+        if (header.format == TraceFormat::Raw) {
+            *records = (const TraceRecord*)(mapping + sizeof(TraceFileHeader)) + position;
+            available = std::min<__uint64_t>(rawBlockRecords - position % rawBlockRecords,
+                                              recordCount - position);
+        } else {
+            size_t blockNumber = BlockContaining(position);
+            if (blockNumber != loadedBlock && !LoadBlock(blockNumber)) {
+                return 0;
+            }
+            size_t offset = position - index[blockNumber].firstRecord;
+            *records = &block[offset];
+            available = block.size() - offset;
+        }
+        size_t count = std::min(available, maxRecords);
+        position += count;
+        return count;
+    }
+
+    bool Next(TraceRecord* record) {
+        const TraceRecord* span;
+        if (NextSpan(&span, 1) == 0) {
+            return false;
+        }
+        *record = *span;
+        return true;
+    }
+
+private:
+
+    bool LoadIndex() {
+        if (fileSize < sizeof(TraceFileHeader) + sizeof(TraceIndexFooter)) {
+            return false;
+        }
+        TraceIndexFooter footer;
+        memcpy(&footer, mapping + fileSize - sizeof(footer), sizeof(footer));
+        if (!footer.Valid() ||
+            footer.indexOffset + footer.blockCount * sizeof(TraceIndexEntry) + sizeof(footer) != fileSize) {
+            return false;
+        }
+        index.resize(footer.blockCount);
+        memcpy(index.data(), mapping + footer.indexOffset, index.size() * sizeof(TraceIndexEntry));
+        recordCount = footer.recordCount;
+        return true;
+    }
+
+    // Recovers a trace whose writer was killed before it wrote the index, by
+    // walking the chain of block headers up to the last complete block.
+    void RebuildIndex() {
+        index.clear();
+        recordCount = 0;
+        __uint64_t offset = sizeof(TraceFileHeader);
+        TraceBlockHeader blockHeader;
+        while (offset + sizeof(blockHeader) <= fileSize) {
+            memcpy(&blockHeader, mapping + offset, sizeof(blockHeader));
+            if (blockHeader.records == 0 ||
+                offset + sizeof(blockHeader) + blockHeader.payloadBytes > fileSize) {
+                break;
+            }
+            index.push_back({ recordCount, offset });
+            recordCount += blockHeader.records;
+            offset += sizeof(blockHeader) + blockHeader.payloadBytes;
+        }
+    }
+
+    size_t BlockContaining(__uint64_t recordIndex) {
+        auto after = std::upper_bound(index.begin(), index.end(), recordIndex,
+            [](__uint64_t value, const TraceIndexEntry& entry) { return value < entry.firstRecord; });
+        return (after - index.begin()) - 1;
+    }
+
+    bool LoadBlock(size_t blockNumber) {
+        loadedBlock = ~(size_t)0;
+        TraceBlockHeader blockHeader;
+        __uint64_t offset = index[blockNumber].fileOffset;
+        if (offset + sizeof(blockHeader) > fileSize) {
+            return false;
+        }
+        memcpy(&blockHeader, mapping + offset, sizeof(blockHeader));
+        const __uint8_t* payload = mapping + offset + sizeof(blockHeader);
+        if (offset + sizeof(blockHeader) + blockHeader.payloadBytes > fileSize) {
+            return false;
+        }
+        const __uint8_t* encoded = payload;
+        const __uint8_t* end = payload + blockHeader.payloadBytes;
+        if (!blockHeader.stored) {
+            rawBytes.resize(blockHeader.rawBytes);
+            if (!TraceCodec::Decompress(payload, blockHeader.payloadBytes, rawBytes.data(), rawBytes.size())) {
+                return false;
+            }
+            encoded = rawBytes.data();
+            end = encoded + rawBytes.size();
+        }
+        decoder.Reset();
+        block.resize(blockHeader.records);
+        for (TraceRecord& record : block) {
+            if (!decoder.Decode(&encoded, end, &record)) {
+                return false;
+            }
+        }
+        loadedBlock = blockNumber;
+        return true;
+    }
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+/*
+ * One retired (or faulted) instruction, as captured by the hart's tracing
+ * tick. Records are fixed-size so they can be copied around the ring buffer
+ * and straight onto disk without any formatting work on the simulation thread.
+ * Disassembly happens offline, see tracedump.cpp.
+ */
+
+enum TraceFlag : __uint8_t {
+    DataAccess = 0b01, // memAddress holds the address of a load, store or AMO
+    FetchFault = 0b10  // The fetch itself trapped; encoding is meaningless
+};
+
+struct TraceRecord {
+    __uint64_t pc;
+    __uint64_t rdValue;
+    __uint64_t memAddress;
+    __uint32_t encoding;
+    __uint8_t rd;        // Zero when the instruction wrote no register, or only x0
+    __uint8_t flags;     // TraceFlag bits
+    __uint8_t privilege; // RISCV::PrivilegeMode the instruction executed in
+    __uint8_t reserved;
+};
+
+static_assert(sizeof(TraceRecord) == 32, "TraceRecord is written to disk as-is");
+
+enum TraceFormat : __uint32_t {
+    Raw = 0,       // A flat array of TraceRecords follows the header
+    Compressed = 1 // Delta-encoded, compressed blocks and a block index, see below
+};
+
+struct TraceFileHeader {
+
+    static constexpr char expectedMagic[8] = { 'G', 'R', 'I', 'M', 'T', 'R', 'C', '\0' };
+    static constexpr __uint32_t currentVersion = 1;
+
+    char magic[8];
+    __uint32_t version;
+    __uint32_t format;
+    __uint32_t xlenBytes;  // Width of the traced hart, for the offline decoder
+    __uint32_t extensions; // misa.extensions at the start of the trace
+
+    TraceFileHeader() : TraceFileHeader(TraceFormat::Raw, 0, 0) { }
+
+    TraceFileHeader(TraceFormat traceFormat, __uint32_t xlen, __uint32_t extensionsVector) :
+        version(currentVersion),
+        format(traceFormat),
+        xlenBytes(xlen),
+        extensions(extensionsVector) {
+        memcpy(magic, expectedMagic, sizeof(magic));
+    }
+
+    bool Valid() const {
+        return memcmp(magic, expectedMagic, sizeof(magic)) == 0 &&
+               version == currentVersion;
+    }
+};
+
+static_assert(sizeof(TraceFileHeader) == 24, "TraceFileHeader is written to disk as-is");
+
+/*
+ * Layout of a Compressed trace after the file header:
+ *
+ *   TraceBlockHeader, payload    one per block of up to blockRecords records
+ *   ...
+ *   TraceIndexEntry[blockCount]  where each block starts
+ *   TraceIndexFooter             last thing in the file
+ *
+ * Each block's delta state starts fresh, so any block decodes on its own and
+ * a reader can seek to an instruction count by binary searching the index.
+ * If the writer never got to write the index (grim was killed), readers can
+ * still rebuild it by walking the block headers.
+ */
+
+struct TraceBlockHeader {
+    __uint32_t payloadBytes; // Bytes following this header
+    __uint32_t rawBytes;     // Size of the delta-encoded records before compression
+    __uint32_t records;
+    __uint32_t stored;       // Nonzero if the payload is the delta encoding itself
+};
+
+static_assert(sizeof(TraceBlockHeader) == 16, "TraceBlockHeader is written to disk as-is");
+
+struct TraceIndexEntry {
+    __uint64_t firstRecord;
+    __uint64_t fileOffset;   // Of the block's TraceBlockHeader
+};
+
+static_assert(sizeof(TraceIndexEntry) == 16, "TraceIndexEntry is written to disk as-is");
+
+struct TraceIndexFooter {
+
+    static constexpr char expectedMagic[8] = { 'G', 'R', 'I', 'M', 'I', 'D', 'X', '\0' };
+
+    __uint64_t indexOffset;
+    __uint64_t blockCount;
+    __uint64_t recordCount;
+    char magic[8];
+
+    TraceIndexFooter() : TraceIndexFooter(0, 0, 0) { }
+
+    TraceIndexFooter(__uint64_t offset, __uint64_t blocks, __uint64_t records) :
+        indexOffset(offset),
+        blockCount(blocks),
+        recordCount(records) {
+        memcpy(magic, expectedMagic, sizeof(magic));
+    }
+
+    bool Valid() const {
+        return memcmp(magic, expectedMagic, sizeof(magic)) == 0;
+    }
+};
+
+static_assert(sizeof(TraceIndexFooter) == 32, "TraceIndexFooter is written to disk as-is");
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+
+/*
+ * Single-producer, single-consumer lock-free ring buffer. The simulation thread
+ * pushes records and a background thread drains them in contiguous spans, so
+ * neither side ever takes a lock. Each side keeps a cached copy of the other
+ * side's index and only reloads the shared atomic when the cache says the ring
+ * looks full (producer) or empty (consumer).
+ */
+template<typename T, unsigned int capacityBits>
+class TraceRingBuffer {
+
+    static constexpr size_t capacity = (size_t)1 << capacityBits;
+    static constexpr size_t mask = capacity - 1;
+
+    std::unique_ptr<T[]> slots;
+
+    alignas(64) std::atomic<size_t> head = 0; // Next slot the producer fills
+    size_t cachedTail = 0;
+
+    alignas(64) std::atomic<size_t> tail = 0; // Next slot the consumer drains
+    size_t cachedHead = 0;
+
+public:
+
+    TraceRingBuffer() : slots(new T[capacity]) { }
+
+    // Producer side. Spins (politely) while the consumer catches up, since
+    // dropping trace records would make the trace useless.
+    inline void Push(const T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - cachedTail == capacity) [[ unlikely ]] {
+            while ((cachedTail = tail.load(std::memory_order_acquire)) + capacity == h) {
+                std::this_thread::yield();
+            }
+        }
+        slots[h & mask] = item;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    // Consumer side. Hands each contiguous run of ready items to sink, then
+    // releases the slots. Returns the number of items drained.
+    template<typename Sink>
+    size_t Drain(Sink sink) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == cachedHead) {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (t == cachedHead) {
+                return 0;
+            }
+        }
+        size_t available = cachedHead - t;
+        size_t firstSpan = capacity - (t & mask);
+        if (firstSpan > available) {
+            firstSpan = available;
+        }
+        sink(&slots[t & mask], firstSpan);
+        if (available > firstSpan) {
+            sink(&slots[0], available - firstSpan);
+        }
+        tail.store(t + available, std::memory_order_release);
+        return available;
+    }
+};
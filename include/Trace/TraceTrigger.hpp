@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdlib>
+#include <string>
+
+#include <RiscV.hpp>
+
+/*
+ * A condition that switches binary tracing on or off in the middle of a run,
+ * as given to grim's --trace-start and --trace-stop. The run loop arms one
+ * trigger at a time and swaps tickers when it fires, so the untraced stretch
+ * runs on the ordinary fast Tick().
+ */
+struct TraceTrigger {
+
+    enum class Kind {
+        None,      // Never fires
+        Count,     // Instruction count reaches value
+        Pc,        // About to execute the instruction at value
+        Privilege, // Hart enters RISCV::PrivilegeMode value
+        Signal     // The simulator receives SIGUSR1
+    };
+
+    Kind kind = Kind::None;
+    __uint64_t value = 0;
+
+    // Accepts "count:N", "pc:ADDRESS", "priv:m", "priv:s", "priv:u" or
+    // "signal". Numbers may be decimal or 0x-prefixed hex.
+    bool Parse(std::string spec) {
+        if (spec == "signal") {
+            kind = Kind::Signal;
+            return true;
+        }
+        size_t colon = spec.find(':');
+        if (colon == std::string::npos || colon + 1 == spec.size()) {
+            return false;
+        }
+        std::string name = spec.substr(0, colon);
+        std::string argument = spec.substr(colon + 1);
+        if (name == "priv") {
+            kind = Kind::Privilege;
+            if (argument == "m") {
+                value = RISCV::PrivilegeMode::Machine;
+            } else if (argument == "s") {
+                value = RISCV::PrivilegeMode::Supervisor;
+            } else if (argument == "u") {
+                value = RISCV::PrivilegeMode::User;
+            } else {
+                return false;
+            }
+            return true;
+        }
+        char* end;
+        value = strtoull(argument.c_str(), &end, 0);
+        if (*end != '\0') {
+            return false;
+        }
+        if (name == "count") {
+            kind = Kind::Count;
+        } else if (name == "pc") {
+            kind = Kind::Pc;
+        } else {
+            return false;
+        }
+        return true;
+    }
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Trace/TraceCodec.hpp>
+#include <Trace/TraceDelta.hpp>
+#include <Trace/TraceRecord.hpp>
+#include <Trace/TraceRingBuffer.hpp>
+
+/*
+ * Owns the trace file and the background thread that drains the ring buffer
+ * into it. The simulation thread only ever calls Record(), which is a copy into
+ * the ring; all file IO, and for Compressed traces all encoding work, happens
+ * on the writer thread.
+ */
+class TraceWriter {
+
+    static constexpr unsigned int ringBits = 16;
+    static constexpr std::chrono::microseconds idleSleep { 100 };
+
+    TraceRingBuffer<TraceRecord, ringBits> ring;
+    std::ofstream file;
+    std::thread drainer;
+    std::atomic<bool> stopRequested = false;
+    __uint64_t recordsWritten = 0;
+    __uint64_t fileOffset = 0;
+
+    // Compressed format state, only touched by the writer thread
+    TraceFormat format;
+    unsigned int blockRecords;
+    TraceDeltaEncoder encoder;
+    std::vector<__uint8_t> blockBytes;
+    std::vector<__uint8_t> compressedBytes;
+    __uint32_t blockRecordCount = 0;
+    std::vector<TraceIndexEntry> index;
+
+public:
+
+    static constexpr unsigned int defaultBlockRecords = 1 << 16;
+
+    TraceWriter(std::string fileName, TraceFileHeader header, unsigned int recordsPerBlock = defaultBlockRecords) :
+        format((TraceFormat)header.format),
+        blockRecords(recordsPerBlock) {
+        file.open(fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            return;
+        }
+        Write(&header, sizeof(header));
+        drainer = std::thread(&TraceWriter::DrainLoop, this);
+    }
+
+    ~TraceWriter() {
+        Close();
+    }
+
+    bool IsOpen() {
+        return file.is_open();
+    }
+
+    inline void Record(const TraceRecord& record) {
+        ring.Push(record);
+    }
+
+    // Flushes everything recorded so far and closes the file. Safe to call
+    // more than once.
+    void Close() {
+        if (!drainer.joinable()) {
+            return;
+        }
+        stopRequested.store(true, std::memory_order_release);
+        drainer.join();
+        if (format == TraceFormat::Compressed) {
+            FlushBlock();
+            WriteIndex();
+        }
+        file.close();
+    }
+
+    __uint64_t RecordsWritten() {
+        return recordsWritten;
+    }
+
+private:
+
+    void Write(const void* data, size_t size) {
+        file.write((const char*)data, size);
+        fileOffset += size;
+    }
+
+    void FlushBlock() {
+        if (blockRecordCount == 0) {
+            return;
+        }
+        compressedBytes.clear();
+        TraceCodec::Compress(blockBytes.data(), blockBytes.size(), &compressedBytes);
+        bool stored = compressedBytes.size() >= blockBytes.size();
+        std::vector<__uint8_t>* payload = stored ? &blockBytes : &compressedBytes;
+        TraceBlockHeader blockHeader = {
+            (__uint32_t)payload->size(), (__uint32_t)blockBytes.size(), blockRecordCount, stored };
+        index.push_back({ recordsWritten - blockRecordCount, fileOffset });
+        Write(&blockHeader, sizeof(blockHeader));
+        Write(payload->data(), payload->size());
+        blockBytes.clear();
+        blockRecordCount = 0;
+        encoder.Reset();
+    }
+
+    void WriteIndex() {
+        TraceIndexFooter footer(fileOffset, index.size(), recordsWritten);
+        Write(index.data(), index.size() * sizeof(TraceIndexEntry));
+        Write(&footer, sizeof(footer));
+    }
+
+    void DrainLoop() {
+        auto sink = [this](TraceRecord* records, size_t count) {
+            if (format == TraceFormat::Raw) {
+                Write(records, count * sizeof(TraceRecord));
+                recordsWritten += count;
+                return;
+            }
+            for (size_t i = 0; i < count; i++) {
+                encoder.Encode(records[i], &blockBytes);
+                recordsWritten++;
+                if (++blockRecordCount == blockRecords) {
+                    FlushBlock();
+                }
+            }
+        };
+        while (!stopRequested.load(std::memory_order_acquire)) {
+            if (ring.Drain(sink) == 0) {
+                std::this_thread::sleep_for(idleSleep);
+            }
+        }
+        // The producer has stopped by the time Close() is called, so one last
+        // drain picks up whatever it pushed before then.
+        while (ring.Drain(sink) != 0);
+    }
+};
@@ -0,0 +1,216 @@
+#include <gtest/gtest.h>
+#include <HartFixture.hpp>
+
+// The CSRRW (Atomic Read/Write CSR) instruction atomically swaps values in
+// the CSRs and integer registers. If rd=x0, then the instruction shall not
+// read the CSR. The CSRRS (Atomic Read and Set Bits in CSR) and CSRRC (Atomic
+// Read and Clear Bits in CSR) instructions set or clear the bits of the CSR
+// that are high in rs1. If rs1=x0, then the instruction will not write to
+// the CSR at all. Attempts to write a read-only register raise an illegal
+// instruction exception.
+
+/* @EncodeAsm: InstructionCSR.rv32gc
+    li t0, 0xf0
+    csrw mscratch, t0
+    li t1, 0x3c
+    csrrs a0, mscratch, t1
+    csrrc a1, mscratch, t1
+    csrrw a2, mscratch, zero
+    csrr a3, mscratch
+    csrrs a4, mhartid, zero
+    csrrw a5, mhartid, t0
+    j 0
+*/
+#include <InstructionCSR.rv32gc.h>
+TEST_F(HartTest32, InstructionCSR) {
+    bus.Write32(0x80000000, sizeof(InstructionCSR_rv32gc_bytes), (char*)InstructionCSR_rv32gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.state.mhartid = 3;
+    hart.Reset();
+    hart.state.mtvec.base = 0x80000024;
+    hart.state.regs[RISCV::abiRegNum::a5] = 0xa5a5'a5a5;
+    RunAtLeast(10);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], (__uint32_t)0xf0);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a1], (__uint32_t)0xfc);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a2], (__uint32_t)0xc0);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a3], (__uint32_t)0x00);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a4], (__uint32_t)3);
+    // The write to mhartid trapped before touching rd
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a5], (__uint32_t)0xa5a5'a5a5);
+    ASSERT_EQ(hart.state.mepc, (__uint32_t)0x80000020);
+    ASSERT_EQ(hart.state.mcause.exceptionCode, RISCV::TrapCause::ILLEGAL_INSTRUCTION);
+    ASSERT_EQ(hart.state.mhartid, (__uint32_t)3);
+}
+
+// The counters aren't stepped per instruction but must still read exactly,
+// wherever in a block of the fast path the read falls.
+
+/* @EncodeAsm: InstructionCounters.rv32gc
+    csrr a0, instret
+    nop
+    nop
+    csrr a1, instret
+    csrr a2, cycle
+    li t0, 100
+    csrw minstret, t0
+    csrr a3, minstret
+    li t0, 4
+    csrw 0x320, t0
+    nop
+    csrr a4, minstret
+    csrw 0x320, zero
+    csrr a5, minstret
+    csrr a6, instreth
+    j 0
+*/
+#include <InstructionCounters.rv32gc.h>
+TEST_F(HartTest32, InstructionCounters) {
+    bus.Write32(0x80000000, sizeof(InstructionCounters_rv32gc_bytes), (char*)InstructionCounters_rv32gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+    hart.state.regs[RISCV::abiRegNum::a6] = 0xa6a6'a6a6;
+    RunAtLeast(15);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], (__uint32_t)0);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a1], (__uint32_t)3);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a2], (__uint32_t)4);
+    // A write is what the next instruction reads
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a3], (__uint32_t)100);
+    // Stopped by mcountinhibit.IR two instructions later, then started again
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a4], (__uint32_t)102);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a5], (__uint32_t)103);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a6], (__uint32_t)0);
+}
+
+/* @EncodeAsm: CounterEnable.rv64gc
+    .option norvc
+    csrr a0, cycle
+    j 0
+*/
+#include <CounterEnable.rv64gc.h>
+TEST_F(HartTest64, CounterEnable) {
+    bus.Write32(0x80000000, sizeof(CounterEnable_rv64gc_bytes), (char*)CounterEnable_rv64gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+    hart.state.mtvec.base = 0x80000004;
+
+    // User mode needs both mcounteren and scounteren to read cycle, if
+    // there's an S mode at all
+    hart.state.mcounteren = 1;
+    if (RISCV::vectorHasExtension(hart.state.Extensions(), 'S')) {
+        hart.state.privilegeMode = RISCV::PrivilegeMode::User;
+        hart.Tick(1);
+        ASSERT_EQ(hart.state.pc, 0x80000004u);
+        ASSERT_EQ(hart.state.mcause.exceptionCode, RISCV::TrapCause::ILLEGAL_INSTRUCTION);
+    }
+
+    hart.state.scounteren = 1;
+    hart.state.pc = 0x80000000;
+    hart.state.privilegeMode = RISCV::PrivilegeMode::User;
+    hart.state.regs[RISCV::abiRegNum::a0] = 0xa0;
+    __uint64_t retired = hart.InstructionsRetired();
+    hart.Tick(1);
+    ASSERT_EQ(hart.state.pc, 0x80000004u);
+    ASSERT_EQ(hart.state.privilegeMode, RISCV::PrivilegeMode::User);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], retired);
+}
+
+// The hpm counters count simulator events, if the build counts them, and
+// otherwise selecting an event selects nothing and the counter holds still.
+
+/* @EncodeAsm: PerformanceEvents.rv64gc
+    .option norvc
+    li t0, 3
+    csrw 0x323, t0
+    csrw 0xb03, zero
+    ecall
+    csrr a0, 0xb03
+    csrr a1, 0x323
+    j 0
+*/
+#include <PerformanceEvents.rv64gc.h>
+TEST_F(HartTest64, PerformanceEvents) {
+    bus.Write32(0x80000000, sizeof(PerformanceEvents_rv64gc_bytes), (char*)PerformanceEvents_rv64gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+    hart.state.mtvec.base = 0x80000010;
+    RunAtLeast(10);
+    ASSERT_EQ(hart.state.pc, 0x80000018u);
+    if constexpr (performanceEventCounted(TrapTaken)) {
+        ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], 1u);
+        ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a1], (__uint64_t)TrapTaken);
+    } else {
+        ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], 0u);
+        ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a1], (__uint64_t)NoEvent);
+    }
+}
+
+// Clearing a misa bit turns the extension off, unless the build fixed the
+// ISA, and then the write is ignored. Without U, MRET leaves MPP at M
+// rather than dropping it to U. Assembled uncompressed, like CounterEnable,
+// so both run on builds whose fixed ISA leaves out C.
+
+/* @EncodeAsm: MISAWrite.rv32gc
+    .option norvc
+    csrc misa, t0
+    csrr a0, misa
+    csrw mepc, t1
+    mret
+    csrr a1, mstatus
+    j 0
+*/
+#include <MISAWrite.rv32gc.h>
+TEST_F(HartTest32, MISAWrite) {
+    bus.Write32(0x80000000, sizeof(MISAWrite_rv32gc_bytes), (char*)MISAWrite_rv32gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+    hart.state.mstatus.mpp = RISCV::PrivilegeMode::Machine;
+    hart.state.regs[RISCV::abiRegNum::t0] = RISCV::stringToExtensions("u");
+    hart.state.regs[RISCV::abiRegNum::t1] = 0x80000010;
+    RunAtLeast(10);
+    __uint32_t extensions = fixedISA<__uint32_t> ? fixedExtensions<__uint32_t> : RISCV::stringToExtensions("imacs");
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], (__uint32_t)1 << 30 | extensions);
+    ASSERT_EQ(hart.state.privilegeMode, RISCV::PrivilegeMode::Machine);
+    ASSERT_EQ(hart.state.pc, 0x80000014u);
+    __uint32_t mpp = RISCV::vectorHasExtension(extensions, 'U') ? 0 : 3;
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a1] >> 11 & 3, mpp);
+}
+
+// Interrupts are traps too, and count as TrapTaken as much as exceptions.
+
+/* @EncodeAsm: InterruptEvents.rv64gc
+    .option norvc
+    li t0, 3
+    csrw 0x323, t0
+    csrw 0xb03, zero
+    li t0, 0x8
+    csrw mie, t0
+    csrs mstatus, t0
+    j 0
+    csrr a0, 0xb03
+    j 0
+*/
+#include <InterruptEvents.rv64gc.h>
+TEST_F(HartTest64, InterruptEvents) {
+    bus.Write32(0x80000000, sizeof(InterruptEvents_rv64gc_bytes), (char*)InterruptEvents_rv64gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+    hart.state.mtvec.base = 0x8000001c;
+    hart.state.regs[RISCV::abiRegNum::a0] = 0xa0;
+    RunAtLeast(10);
+    ASSERT_EQ(hart.state.pc, 0x80000018u);
+
+    hart.state.mip.msi = true;
+    hart.state.UpdateInterruptSummary();
+    hart.state.ServiceInterrupts();
+    ASSERT_EQ(hart.state.pc, 0x8000001cu);
+    ASSERT_TRUE(hart.state.mcause.interrupt);
+    hart.state.mip.msi = false;
+    hart.state.UpdateInterruptSummary();
+    RunAtLeast(5);
+    ASSERT_EQ(hart.state.pc, 0x80000020u);
+    if constexpr (performanceEventCounted(TrapTaken)) {
+        ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], 1u);
+    } else {
+        ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], 0u);
+    }
+}
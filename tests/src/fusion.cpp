@@ -0,0 +1,90 @@
+#include <gtest/gtest.h>
+#include <HartFixture.hpp>
+
+// Common pairs of instructions are fused into one icache entry once the
+// icache has seen them, but must run exactly as the two would apart: the
+// same results, the same count of instructions retired, and stopping
+// between the halves when a block runs out or a breakpoint sits on the
+// second. auipc then jalr isn't fused, since jalr can trap, and runs as
+// two entries among them.
+
+/* @EncodeAsm: Fusion.rv64gc
+    .option norvc
+    lui a0, 0x12345
+    addi a0, a0, 0x678
+    auipc a1, 0
+    addi a1, a1, 16
+    slli a2, a3, 32
+    srli a2, a2, 32
+    auipc t0, 0
+    jalr ra, 12(t0)
+    j 0
+    j 0
+*/
+#include <Fusion.rv64gc.h>
+TEST_F(HartTest64, Fusion) {
+    bus.Write64(0x80000000, sizeof(Fusion_rv64gc_bytes), (char*)Fusion_rv64gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+
+    // The first pass fills the icache, and the rest run from it
+    for (unsigned int pass = 0; pass < 3; pass++) {
+        hart.state.pc = 0x80000000;
+        hart.state.regs[RISCV::abiRegNum::a3] = 0xa3a3'a3a3'8765'4321;
+        __uint64_t retired = hart.InstructionsRetired();
+        ASSERT_EQ(hart.Tick(8), 8u);
+        ASSERT_EQ(hart.InstructionsRetired(), retired + 8);
+        ASSERT_EQ(hart.state.pc, 0x80000024u);
+        ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], 0x1234'5678u);
+        ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a1], 0x8000'0018u);
+        ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a2], 0x8765'4321u);
+        ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::ra], 0x8000'0020u);
+    }
+
+    // A block ending on a first half leaves the second for the next one
+    hart.state.pc = 0x80000000;
+    ASSERT_EQ(hart.Tick(7), 7u);
+    ASSERT_EQ(hart.state.pc, 0x8000001cu);
+    ASSERT_EQ(hart.Tick(1), 1u);
+    ASSERT_EQ(hart.state.pc, 0x80000024u);
+
+    hart.state.pc = 0x80000000;
+    hart.state.regs[RISCV::abiRegNum::a0] = 0xa0;
+    hart.SetBreakpoint(0x80000004);
+    ASSERT_EQ(hart.Tick(8), 1u);
+    ASSERT_EQ(hart.state.pc, 0x80000004u);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], 0x1234'5000u);
+}
+
+// The compressed pairs fuse the same way, two bytes to a half.
+
+/* @EncodeAsm: FusionCompressed.rv64gc
+    c.lui a0, 0x12
+    c.addi a0, 5
+    c.slli a2, 32
+    c.srli a2, 32
+    c.j 0
+*/
+#include <FusionCompressed.rv64gc.h>
+TEST_F(HartTest64, FusionCompressed) {
+    bus.Write64(0x80000000, sizeof(FusionCompressed_rv64gc_bytes), (char*)FusionCompressed_rv64gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+
+    for (unsigned int pass = 0; pass < 3; pass++) {
+        hart.state.pc = 0x80000000;
+        hart.state.regs[RISCV::abiRegNum::a2] = 0xa2a2'a2a2'8765'4321;
+        __uint64_t retired = hart.InstructionsRetired();
+        ASSERT_EQ(hart.Tick(4), 4u);
+        ASSERT_EQ(hart.InstructionsRetired(), retired + 4);
+        ASSERT_EQ(hart.state.pc, 0x80000008u);
+        ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], 0x1'2005u);
+        ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a2], 0x8765'4321u);
+    }
+
+    hart.state.pc = 0x80000000;
+    ASSERT_EQ(hart.Tick(3), 3u);
+    ASSERT_EQ(hart.state.pc, 0x80000006u);
+    ASSERT_EQ(hart.Tick(1), 1u);
+    ASSERT_EQ(hart.state.pc, 0x80000008u);
+}
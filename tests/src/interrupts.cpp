@@ -0,0 +1,124 @@
+#include <gtest/gtest.h>
+#include <HartFixture.hpp>
+
+TEST(Interrupts, ArbitrationMatchesSpecOrder) {
+    const RISCV::TrapCause order[] = {
+        RISCV::TrapCause::MACHINE_EXTERNAL_INTERRUPT, RISCV::TrapCause::MACHINE_SOFTWARE_INTERRUPT,
+        RISCV::TrapCause::MACHINE_TIMER_INTERRUPT, RISCV::TrapCause::SUPERVISOR_EXTERNAL_INTERRUPT,
+        RISCV::TrapCause::SUPERVISOR_SOFTWARE_INTERRUPT, RISCV::TrapCause::SUPERVISOR_TIMER_INTERRUPT,
+        RISCV::TrapCause::USER_EXTERNAL_INTERRUPT, RISCV::TrapCause::USER_SOFTWARE_INTERRUPT,
+        RISCV::TrapCause::USER_TIMER_INTERRUPT
+    };
+
+    // Every combination of the standard interrupts picks the first in order
+    for (__uint64_t subset = 0; subset < (1 << 9); subset++) {
+        __uint64_t interrupts = 0;
+        for (unsigned int i = 0; i < 9; i++) {
+            if (subset & (1 << i)) {
+                interrupts |= (__uint64_t)1 << order[i];
+            }
+        }
+        RISCV::TrapCause expected = RISCV::TrapCause::NONE;
+        for (unsigned int i = 0; i < 9 && expected == RISCV::TrapCause::NONE; i++) {
+            if (subset & (1 << i)) {
+                expected = order[i];
+            }
+        }
+        ASSERT_EQ(RISCV::highestPriorityInterrupt(interrupts), expected) << std::hex << interrupts;
+    }
+
+    // Splitting a word by delegation agrees with asking cause by cause
+    const __uint32_t extensionSets[] = {
+        RISCV::stringToExtensions("IMA"), RISCV::stringToExtensions("IMAU"), RISCV::stringToExtensions("IMASU")
+    };
+    for (__uint32_t extensions : extensionSets) {
+        for (__uint64_t mdeleg : { 0x000ull, 0x222ull, 0xbbbull, 0xfffull }) {
+            for (__uint64_t sdeleg : { 0x000ull, 0x111ull, 0xfffull }) {
+                __uint64_t forM, forS, forU;
+                RISCV::SplitInterruptsByPrivilege<__uint64_t>(0xfff, mdeleg, sdeleg, extensions, &forM, &forS, &forU);
+                for (unsigned int cause = 0; cause < 12; cause++) {
+                    RISCV::PrivilegeMode mode = RISCV::DestinedPrivilegeForCause<__uint64_t>(
+                        (RISCV::TrapCause)cause, mdeleg, sdeleg, extensions);
+                    __uint64_t bit = (__uint64_t)1 << cause;
+                    ASSERT_EQ((forM & bit) != 0, mode == RISCV::PrivilegeMode::Machine);
+                    ASSERT_EQ((forS & bit) != 0, mode == RISCV::PrivilegeMode::Supervisor);
+                    ASSERT_EQ((forU & bit) != 0, mode == RISCV::PrivilegeMode::User);
+                }
+            }
+        }
+    }
+}
+
+// An interrupt for a more privileged mode than the one running is taken
+// whatever that mode's xIE bit says, which only masks it while running in
+// the mode itself. The program enables one interrupt in mie, delegates as
+// told, and MRETs to a spin loop in a less privileged mode with mstatus.mie
+// and mstatus.sie both clear.
+
+/* @EncodeAsm: LowerPrivilegeInterrupts.rv64gc
+    .option norvc
+    csrw mie, t2
+    csrw mideleg, t3
+    csrw mstatus, t1
+    csrw mepc, t0
+    mret
+    j 0
+    j 0
+*/
+#include <LowerPrivilegeInterrupts.rv64gc.h>
+TEST_F(HartTest64, MachineInterruptTakenFromSupervisorWithMIEClear) {
+    bus.Write64(0x80000000, sizeof(LowerPrivilegeInterrupts_rv64gc_bytes), (char*)LowerPrivilegeInterrupts_rv64gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+    hart.state.mtvec.base = 0x80000018;
+    hart.state.regs[RISCV::abiRegNum::t0] = 0x80000014;
+    hart.state.regs[RISCV::abiRegNum::t1] = (__uint64_t)RISCV::PrivilegeMode::Supervisor << 11;
+    hart.state.regs[RISCV::abiRegNum::t2] = RISCV::msiMask;
+    hart.state.regs[RISCV::abiRegNum::t3] = 0;
+    hart.state.mip.msi = true;
+
+    // In M itself mstatus.mie=0 masks it
+    ASSERT_EQ(hart.Tick(1), 1u);
+    hart.state.UpdateInterruptSummary();
+    hart.state.ServiceInterrupts();
+    ASSERT_EQ(hart.state.privilegeMode, RISCV::PrivilegeMode::Machine);
+    ASSERT_FALSE(hart.state.mcause.interrupt);
+
+    RunAtLeast(10);
+    ASSERT_EQ(hart.state.pc, 0x80000014u);
+    ASSERT_EQ(hart.state.privilegeMode, RISCV::PrivilegeMode::Supervisor);
+    ASSERT_FALSE(hart.state.mstatus.mie);
+    hart.state.UpdateInterruptSummary();
+    hart.state.ServiceInterrupts();
+    ASSERT_EQ(hart.state.pc, 0x80000018u);
+    ASSERT_EQ(hart.state.privilegeMode, RISCV::PrivilegeMode::Machine);
+    ASSERT_TRUE(hart.state.mcause.interrupt);
+    ASSERT_EQ(hart.state.mcause.exceptionCode, RISCV::TrapCause::MACHINE_SOFTWARE_INTERRUPT);
+    ASSERT_EQ(hart.state.mepc, 0x80000014u);
+    ASSERT_EQ(hart.state.mstatus.mpp, RISCV::PrivilegeMode::Supervisor);
+}
+
+TEST_F(HartTest64, SupervisorInterruptTakenFromUserWithSIEClear) {
+    bus.Write64(0x80000000, sizeof(LowerPrivilegeInterrupts_rv64gc_bytes), (char*)LowerPrivilegeInterrupts_rv64gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+    hart.state.stvec.base = 0x80000018;
+    hart.state.regs[RISCV::abiRegNum::t0] = 0x80000014;
+    hart.state.regs[RISCV::abiRegNum::t1] = (__uint64_t)RISCV::PrivilegeMode::User << 11;
+    hart.state.regs[RISCV::abiRegNum::t2] = RISCV::ssiMask;
+    hart.state.regs[RISCV::abiRegNum::t3] = RISCV::ssiMask;
+    RunAtLeast(10);
+    ASSERT_EQ(hart.state.pc, 0x80000014u);
+    ASSERT_EQ(hart.state.privilegeMode, RISCV::PrivilegeMode::User);
+    ASSERT_FALSE(hart.state.mstatus.sie);
+
+    hart.state.mip.ssi = true;
+    hart.state.UpdateInterruptSummary();
+    hart.state.ServiceInterrupts();
+    ASSERT_EQ(hart.state.pc, 0x80000018u);
+    ASSERT_EQ(hart.state.privilegeMode, RISCV::PrivilegeMode::Supervisor);
+    ASSERT_TRUE(hart.state.scause.interrupt);
+    ASSERT_EQ(hart.state.scause.exceptionCode, RISCV::TrapCause::SUPERVISOR_SOFTWARE_INTERRUPT);
+    ASSERT_EQ(hart.state.sepc, 0x80000014u);
+    ASSERT_EQ(hart.state.mstatus.spp, RISCV::PrivilegeMode::User);
+}
@@ -0,0 +1,51 @@
+#include <gtest/gtest.h>
+#include <HartFixture.hpp>
+
+// M-mode accesses are never translated, and S and U mode ones are whenever
+// satp turns paging on. The hart works out which applies when satp, mstatus
+// or the privilege mode change, not on every access, so going from one to
+// the other has to switch how memory is reached.
+
+/* @EncodeAsm: PagingModeSwitch.rv64gc
+    .option norvc
+    sd a1, 0(a0)
+    csrw satp, a2
+    csrw mepc, t0
+    mret
+    ld a4, 0(a3)
+    ld a5, 0(a6)
+    j 0
+    j 0
+*/
+#include <PagingModeSwitch.rv64gc.h>
+TEST_F(HartTest64, PagingModeSwitch) {
+    bus.Write64(0x80000000, sizeof(PagingModeSwitch_rv64gc_bytes), (char*)PagingModeSwitch_rv64gc_bytes);
+
+    // Sv39 gigapages: VA 0 onto PA 0x80000000, and the code where it is
+    constexpr __uint64_t root = 0x80010000;
+    constexpr __uint64_t leaf = 0xcf; // V, R, W, X, A, D
+    __uint64_t ptes[3] = { (0x80000000 >> 12) << 10 | leaf, 0, (0x80000000 >> 12) << 10 | leaf };
+    bus.Write64(root, sizeof(ptes), (char*)ptes);
+
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+    hart.state.mtvec.base = 0x8000001c;
+    hart.state.mstatus.mpp = RISCV::PrivilegeMode::Supervisor;
+    hart.state.regs[RISCV::abiRegNum::a0] = 0x80002000;
+    hart.state.regs[RISCV::abiRegNum::a1] = 0x1234'5678'9abc'def0;
+    hart.state.regs[RISCV::abiRegNum::a2] = (__uint64_t)8 << 60 | root >> 12;
+    hart.state.regs[RISCV::abiRegNum::a3] = 0x2000;
+    hart.state.regs[RISCV::abiRegNum::a5] = 0xa5;
+    hart.state.regs[RISCV::abiRegNum::a6] = 0x40000000; // Unmapped, though it's RAM physically
+    hart.state.regs[RISCV::abiRegNum::t0] = 0x80000010;
+    RunAtLeast(10);
+
+    // Stored physically in M mode, loaded back through the page table in S
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a4], 0x1234'5678'9abc'def0u);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a5], 0xa5u);
+    ASSERT_EQ(hart.state.mcause.exceptionCode, RISCV::TrapCause::LOAD_PAGE_FAULT);
+    ASSERT_EQ(hart.state.mepc, 0x80000014u);
+    ASSERT_EQ(hart.state.mtval, 0x40000000u);
+    ASSERT_EQ(hart.state.privilegeMode, RISCV::PrivilegeMode::Machine);
+    ASSERT_EQ(hart.state.pc, 0x8000001cu);
+}
@@ -0,0 +1,541 @@
+#include <gtest/gtest.h>
+#include <HartFixture.hpp>
+
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <Devices/CoreLocalInterruptor.hpp>
+#include <Devices/IOLogger.hpp>
+#include <EventQueue.hpp>
+#include <EventScheduler.hpp>
+#include <ParkingLot.hpp>
+#include <QuantumScheduling.hpp>
+#include <ReservationSet.hpp>
+
+TEST(Smp, ClintRegistersPerHart) {
+    EventScheduler scheduler;
+    CoreLocalInterruptor clint(&scheduler, 2);
+    __uint64_t value = 0;
+    __uint32_t half = 0;
+
+    // Timers start disarmed
+    clint.Read32(0x4008, 8, (char*)&value);
+    ASSERT_EQ(value, ~(__uint64_t)0);
+
+    // mtimecmp can be written a half at a time, as RV32 harts must
+    half = 5;
+    clint.Write32(0x4000, 4, (char*)&half);
+    half = 0;
+    clint.Write32(0x4004, 4, (char*)&half);
+    clint.Read32(0x4000, 8, (char*)&value);
+    ASSERT_EQ(value, 5u);
+
+    RISCV::interruptReg mip;
+    mip.Reset();
+    for (unsigned int i = 0; i < 4; i++) {
+        scheduler.Advance(1);
+    }
+    clint.Read32(0xbff8, 8, (char*)&value);
+    ASSERT_EQ(value, 4u);
+    clint.UpdateInterrupts(0, &mip);
+    ASSERT_FALSE(mip.mti);
+    scheduler.Advance(1);
+    clint.UpdateInterrupts(0, &mip);
+    ASSERT_TRUE(mip.mti);
+    ASSERT_FALSE(mip.msi);
+
+    // Only bit zero of msip exists
+    half = 0xffffffff;
+    clint.Write32(0x4, 4, (char*)&half);
+    clint.Read32(0x4, 4, (char*)&half);
+    ASSERT_EQ(half, 1u);
+    clint.UpdateInterrupts(1, &mip);
+    ASSERT_TRUE(mip.msi);
+    ASSERT_FALSE(mip.mti);
+
+    // There is no third hart
+    half = 1;
+    clint.Write32(0x8, 4, (char*)&half);
+    clint.Read32(0x8, 4, (char*)&half);
+    ASSERT_EQ(half, 0u);
+}
+
+TEST(Smp, MemoryViewsShareRam) {
+    MappedPhysicalMemory mem(0x10000);
+    MappedPhysicalMemory view(&mem);
+    __uint32_t value = 0x12345678;
+    mem.Write32(0x100, 4, (char*)&value);
+    value = 0;
+    view.Read32(0x100, 4, (char*)&value);
+    ASSERT_EQ(value, 0x12345678u);
+    ASSERT_EQ(view.hint, mem.hint);
+    mem.Read32(0x200, 4, (char*)&value);
+    ASSERT_NE(view.hint, mem.hint);
+}
+
+TEST(Smp, EventQueueFromManyThreads) {
+    EventQueue eq;
+    unsigned int event = 0;
+    ASSERT_FALSE(eq.Pending());
+    ASSERT_FALSE(eq.Pop(&event));
+
+    // Fill it from several threads, then it refuses more
+    std::thread threads[4];
+    for (unsigned int i = 0; i < 4; i++) {
+        threads[i] = std::thread([&eq, i]() {
+            for (unsigned int j = 0; j < 16; j++) {
+                eq.Push(i * 16 + j + 1);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    ASSERT_TRUE(eq.Pending());
+    ASSERT_FALSE(eq.Push(100));
+
+    unsigned int sum = 0;
+    unsigned int popped = 0;
+    while (eq.Pop(&event)) {
+        sum += event;
+        popped++;
+    }
+    ASSERT_EQ(popped, 64u);
+    ASSERT_EQ(sum, 64u * 65u / 2);
+    ASSERT_FALSE(eq.Pending());
+
+    // Slots come back around
+    ASSERT_TRUE(eq.Push(7));
+    ASSERT_TRUE(eq.Pop(&event));
+    ASSERT_EQ(event, 7u);
+}
+
+/* @EncodeAsm: SoftwareAndTimerInterrupts.rv64gc
+    csrr a0, mhartid
+    li t0, 0x88
+    csrw mie, t0
+    li t0, 0x8
+    csrs mstatus, t0
+    li t1, 0x02000004
+    li t2, 1
+    sw t2, 0(t1)
+spin:
+    j spin
+*/
+#include <SoftwareAndTimerInterrupts.rv64gc.h>
+TEST_F(HartTest64, SoftwareAndTimerInterrupts) {
+    EventScheduler scheduler;
+    CoreLocalInterruptor clint(&scheduler, 2);
+    bus.AddDevice64(&clint, 0x02000000, 0xfffff);
+    bus.Write64(0x80000000, sizeof(SoftwareAndTimerInterrupts_rv64gc_bytes), (char*)SoftwareAndTimerInterrupts_rv64gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.state.mhartid = 1;
+    hart.Reset();
+    hart.state.mtvec.base = 0x80001000;
+    RunAtLeast(20);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], 1u);
+
+    // The hart sent itself an IPI
+    __uint64_t spinPc = hart.state.pc;
+    clint.UpdateInterrupts(1, &hart.state);
+    ASSERT_TRUE(hart.state.mip.msi);
+    hart.state.ServiceInterrupts();
+    ASSERT_EQ(hart.state.pc, 0x80001000u);
+    ASSERT_EQ(hart.state.mepc, spinPc);
+    ASSERT_TRUE(hart.state.mcause.interrupt);
+    ASSERT_EQ(hart.state.mcause.exceptionCode, RISCV::TrapCause::MACHINE_SOFTWARE_INTERRUPT);
+    ASSERT_FALSE(hart.state.mstatus.mie);
+
+    // Clear the IPI and arm the timer, which stays masked until MIE is back
+    __uint32_t zero = 0;
+    clint.Write32(0x4, 4, (char*)&zero);
+    __uint64_t now = 0;
+    clint.Write32(0x4008, 8, (char*)&now);
+    clint.UpdateInterrupts(1, &hart.state);
+    ASSERT_FALSE(hart.state.mip.msi);
+    ASSERT_TRUE(hart.state.mip.mti);
+    ASSERT_FALSE(hart.state.interruptDeliverable);
+    hart.state.pc = spinPc;
+    hart.state.ServiceInterrupts();
+    ASSERT_EQ(hart.state.pc, spinPc);
+    hart.state.mstatus.mie = true;
+    hart.state.UpdateInterruptSummary();
+    ASSERT_TRUE(hart.state.interruptDeliverable);
+    hart.state.ServiceInterrupts();
+    ASSERT_EQ(hart.state.pc, 0x80001000u);
+    ASSERT_EQ(hart.state.mcause.exceptionCode, RISCV::TrapCause::MACHINE_TIMER_INTERRUPT);
+}
+
+/* @EncodeAsm: AtomicsSingleHart.rv64gc
+    li t0, 0x1000
+    li t1, -1
+    amoadd.w a0, t1, (t0)
+    lw a1, 0(t0)
+    li t1, 7
+    amoswap.d a2, t1, (t0)
+    lr.w a3, (t0)
+    sc.w a4, t1, (t0)
+    sc.w a5, t1, (t0)
+    lr.w a3, (t0)
+    sc.d a6, t1, (t0)
+    j 0
+*/
+#include <AtomicsSingleHart.rv64gc.h>
+TEST_F(HartTest64, AtomicsSingleHart) {
+    bus.Write64(0x80000000, sizeof(AtomicsSingleHart_rv64gc_bytes), (char*)AtomicsSingleHart_rv64gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+    __uint64_t start = 0x80000000;
+    bus.Write64(0x1000, 8, (char*)&start);
+    hart.Tick(13);
+
+    // The old word comes back sign extended
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], 0xffffffff80000000u);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a1], 0x7fffffffu);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a2], 0x7fffffffu);
+    // Reserved, then the reservation is gone, then the width doesn't match
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a4], 0u);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a5], 1u);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a6], 1u);
+    __uint64_t word = 0;
+    bus.Read64(0x1000, 8, (char*)&word);
+    ASSERT_EQ(word, 7u);
+}
+
+/* @EncodeAsm: AtomicsOnDevice.rv64gc
+    li t0, 0x10000000
+    li t1, 5
+    amoadd.w a0, t1, (t0)
+    lr.w a1, (t0)
+    sc.w a2, t1, (t0)
+    j 0
+*/
+#include <AtomicsOnDevice.rv64gc.h>
+TEST(Smp, AtomicsOnDevice) {
+    MappedPhysicalMemory ram(0x10000);
+    MappedPhysicalMemory registers(0x1000);
+    std::stringstream log;
+    IOLogger logger(&registers, &log);
+    logger.SetPrintContents(false);
+    Bus bus;
+    bus.AddDevice64(&ram, 0x80000000, 0xffff);
+    bus.AddDevice64(&logger, 0x10000000, 0xfff);
+    ram.Write64(0, sizeof(AtomicsOnDevice_rv64gc_bytes), (char*)AtomicsOnDevice_rv64gc_bytes);
+    __uint32_t initial = 2;
+    registers.Write64(0, 4, (char*)&initial);
+    std::unique_ptr<Hart<__uint64_t>> hart(new Hart<__uint64_t>(&bus, RISCV::stringToExtensions("imacsu")));
+    hart->state.resetVector = 0x80000000;
+    hart->Reset();
+    hart->Tick(6);
+
+    // The device sees only what the guest does: the AMO read and write, the
+    // LR read and the SC write
+    ASSERT_EQ(hart->state.regs[RISCV::abiRegNum::a0], 2u);
+    ASSERT_EQ(hart->state.regs[RISCV::abiRegNum::a1], 7u);
+    ASSERT_EQ(hart->state.regs[RISCV::abiRegNum::a2], 0u);
+    std::string line;
+    unsigned int reads = 0, writes = 0;
+    while (std::getline(log, line)) {
+        reads += line.starts_with("(Bus)Read");
+        writes += line.starts_with("(Bus)Write");
+    }
+    ASSERT_EQ(reads, 2u);
+    ASSERT_EQ(writes, 2u);
+}
+
+/* @EncodeAsm: AtomicsAcrossThreads.rv64gc
+    li t0, 0x1000
+    li t1, 0x1008
+    li t2, 1
+    li t3, 20000
+loop:
+    amoadd.w zero, t2, (t0)
+retry:
+    lr.d t4, (t1)
+    addi t4, t4, 1
+    sc.d t5, t4, (t1)
+    bnez t5, retry
+    addi t3, t3, -1
+    bnez t3, loop
+    li a0, 1
+done:
+    j done
+*/
+#include <AtomicsAcrossThreads.rv64gc.h>
+TEST(Smp, AtomicsAcrossThreads) {
+    constexpr unsigned int numHarts = 4;
+    MappedPhysicalMemory mem(0x100000000);
+    mem.Write64(0x80000000, sizeof(AtomicsAcrossThreads_rv64gc_bytes), (char*)AtomicsAcrossThreads_rv64gc_bytes);
+    ReservationSet reservations(numHarts);
+
+    std::unique_ptr<MappedPhysicalMemory> views[numHarts];
+    std::unique_ptr<Bus> buses[numHarts];
+    std::unique_ptr<Hart<__uint64_t>> harts[numHarts];
+    for (unsigned int i = 0; i < numHarts; i++) {
+        views[i].reset(new MappedPhysicalMemory(&mem));
+        buses[i].reset(new Bus());
+        buses[i]->AddDevice64(views[i].get(), 0, 0xffffffff);
+        harts[i].reset(new Hart<__uint64_t>(buses[i].get(), RISCV::stringToExtensions("imacsu")));
+        harts[i]->state.mhartid = i;
+        harts[i]->ShareReservations(&reservations);
+        harts[i]->state.resetVector = 0x80000000;
+        harts[i]->Reset();
+    }
+
+    std::thread threads[numHarts];
+    for (unsigned int i = 0; i < numHarts; i++) {
+        Hart<__uint64_t>* hart = harts[i].get();
+        threads[i] = std::thread([hart]() {
+            while (hart->state.regs[RISCV::abiRegNum::a0] == 0) {
+                hart->Tick();
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    __uint32_t amoCount = 0;
+    __uint64_t lrscCount = 0;
+    mem.Read64(0x1000, 4, (char*)&amoCount);
+    mem.Read64(0x1008, 8, (char*)&lrscCount);
+    ASSERT_EQ(amoCount, numHarts * 20000);
+    ASSERT_EQ(lrscCount, numHarts * 20000);
+}
+
+/* @EncodeAsm: DeterministicInterleaving.rv64gc
+    csrr s1, mhartid
+    li t0, 0x1000
+    li t1, 0x1008
+    li t2, 1
+    li s0, 0
+loop:
+    amoadd.w a0, t2, (t0)
+    slli s0, s0, 5
+    add s0, s0, a0
+    xor s0, s0, s1
+retry:
+    lr.d t4, (t1)
+    addi t4, t4, 1
+    sc.d t5, t4, (t1)
+    add s0, s0, t5
+    bnez t5, retry
+    add s0, s0, t4
+    j loop
+*/
+#include <DeterministicInterleaving.rv64gc.h>
+TEST(Smp, DeterministicInterleaving) {
+    constexpr unsigned int numHarts = 2;
+    constexpr unsigned int quantum = 7;
+
+    struct Outcome {
+        __uint64_t regs[numHarts][RISCV::NumRegs];
+        __uint64_t retired[numHarts];
+        __uint64_t amoCount;
+        __uint64_t lrscCount;
+    };
+
+    // Each run starts from scratch, so only the quantum ties the two together
+    auto run = []() {
+        MappedPhysicalMemory mem(0x100000000);
+        mem.Write64(0x80000000, sizeof(DeterministicInterleaving_rv64gc_bytes), (char*)DeterministicInterleaving_rv64gc_bytes);
+        ReservationSet reservations(numHarts);
+        EventScheduler scheduler;
+        CoreLocalInterruptor clint(&scheduler, numHarts);
+        EventQueue eq;
+
+        std::unique_ptr<MappedPhysicalMemory> views[numHarts];
+        std::unique_ptr<Bus> buses[numHarts];
+        std::vector<std::unique_ptr<Hart<__uint64_t>>> harts(numHarts);
+        for (unsigned int i = 0; i < numHarts; i++) {
+            views[i].reset(new MappedPhysicalMemory(&mem));
+            buses[i].reset(new Bus());
+            buses[i]->AddDevice64(views[i].get(), 0, 0xffffffff);
+            harts[i].reset(new Hart<__uint64_t>(buses[i].get(), RISCV::stringToExtensions("imacsu")));
+            harts[i]->state.mhartid = i;
+            harts[i]->ShareReservations(&reservations);
+            harts[i]->state.resetVector = 0x80000000;
+            harts[i]->Reset();
+        }
+
+        std::vector<HartStats> stats(numHarts);
+        __uint64_t barriers = 0;
+        __uint64_t ticks = 0;
+        tick_harts_deterministic<__uint64_t>(&harts, &clint, &scheduler, &eq, &stats, &barriers, &ticks, 20000, false, quantum, false);
+
+        Outcome outcome = {};
+        for (unsigned int i = 0; i < numHarts; i++) {
+            for (unsigned int r = 0; r < RISCV::NumRegs; r++) {
+                outcome.regs[i][r] = harts[i]->state.regs[r];
+            }
+            outcome.retired[i] = harts[i]->InstructionsRetired();
+        }
+        mem.Read64(0x1000, 4, (char*)&outcome.amoCount);
+        mem.Read64(0x1008, 8, (char*)&outcome.lrscCount);
+        return outcome;
+    };
+
+    Outcome first = run();
+    Outcome second = run();
+
+    // Both harts got somewhere, and got in each other's way
+    ASSERT_GT(first.amoCount, 100u);
+    ASSERT_GT(first.lrscCount, 100u);
+    ASSERT_NE(first.regs[0][RISCV::abiRegNum::s0], first.regs[1][RISCV::abiRegNum::s0]);
+    for (unsigned int i = 0; i < numHarts; i++) {
+        ASSERT_EQ(first.retired[i], second.retired[i]);
+        for (unsigned int r = 0; r < RISCV::NumRegs; r++) {
+            ASSERT_EQ(first.regs[i][r], second.regs[i][r]) << "hart " << i << " register " << r;
+        }
+    }
+    ASSERT_EQ(first.amoCount, second.amoCount);
+    ASSERT_EQ(first.lrscCount, second.lrscCount);
+}
+
+/* @EncodeAsm: IdleDetection.rv64gc
+    wfi
+    li t0, 0x1000
+    li t2, 200
+delay:
+    lw t1, 0(t0)
+    addi t2, t2, -1
+    bnez t2, delay
+spin:
+    lw t1, 0(t0)
+    beqz t1, spin
+    j 0
+*/
+#include <IdleDetection.rv64gc.h>
+TEST_F(HartTest64, IdleDetection) {
+    bus.Write64(0x80000000, sizeof(IdleDetection_rv64gc_bytes), (char*)IdleDetection_rv64gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+    char* watched;
+
+    hart.Tick(1);
+    ASSERT_EQ(hart.TakeIdle(&watched), Hart<__uint64_t>::Idle::Wfi);
+    ASSERT_EQ(hart.TakeIdle(&watched), Hart<__uint64_t>::Idle::None);
+
+    // A countdown loads one address but changes a register each time round
+    hart.Tick(3 + 3*200);
+    ASSERT_EQ(hart.TakeIdle(&watched), Hart<__uint64_t>::Idle::None);
+
+    // Polling a word nobody writes is a spin, watching that word
+    hart.Tick(200);
+    ASSERT_EQ(hart.TakeIdle(&watched), Hart<__uint64_t>::Idle::Spin);
+    __uint32_t value = 0;
+    mem.Read64(0x1000, 4, (char*)&value);
+    ASSERT_EQ(watched, (char*)mem.hint);
+}
+
+TEST(Smp, ParkingLotWakesOnStoreToWatchedLine) {
+    ParkingLot lot(2);
+    alignas(64) char line[128];
+    auto begin = std::chrono::steady_clock::now();
+    std::thread storer([&lot, &line]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        lot.NotifyStore(&line[0], 4); // Not watched by anyone
+        lot.NotifyStore(&line[64], 4);
+    });
+    lot.Park(1, &line[68], std::chrono::seconds(10));
+    storer.join();
+    ASSERT_LT(std::chrono::steady_clock::now() - begin, std::chrono::seconds(5));
+
+    // A wake before parking isn't lost
+    lot.Wake(0);
+    begin = std::chrono::steady_clock::now();
+    lot.Park(0, nullptr, std::chrono::seconds(10));
+    ASSERT_LT(std::chrono::steady_clock::now() - begin, std::chrono::seconds(5));
+}
+
+TEST(Smp, ClintTimersAreScheduledEvents) {
+    EventScheduler scheduler;
+    CoreLocalInterruptor clint(&scheduler, 2, 10);
+    RISCV::interruptReg mip;
+    mip.Reset();
+
+    // Nothing to skip to while the timers are disarmed
+    ASSERT_EQ(scheduler.NextDeadline(), EventScheduler::never);
+    ASSERT_EQ(scheduler.SkipToNextDeadline(), 0u);
+
+    // Ten instructions to an mtime tick
+    __uint64_t deadline = 100;
+    clint.Write32(0x4008, 8, (char*)&deadline);
+    ASSERT_EQ(scheduler.NextDeadline(), 1000u);
+    ASSERT_EQ(scheduler.Headroom(Hart<__uint64_t>::fastLoopTicks), 1000u);
+    scheduler.Advance(10);
+    ASSERT_EQ(clint.Mtime(), 1u);
+    ASSERT_EQ(scheduler.Headroom(Hart<__uint64_t>::fastLoopTicks), 990u);
+    clint.UpdateInterrupts(1, &mip);
+    ASSERT_FALSE(mip.mti);
+    ASSERT_EQ(scheduler.SkipToNextDeadline(), 990u);
+    clint.UpdateInterrupts(1, &mip);
+    ASSERT_TRUE(mip.mti);
+    ASSERT_EQ(clint.Mtime(), 100u);
+    ASSERT_EQ(scheduler.NextDeadline(), EventScheduler::never);
+
+    // A deadline already passed raises the line straight away, and time
+    // never goes backwards for it
+    deadline = 10;
+    clint.Write32(0x4008, 8, (char*)&deadline);
+    ASSERT_EQ(scheduler.SkipToNextDeadline(), 0u);
+    clint.UpdateInterrupts(1, &mip);
+    ASSERT_TRUE(mip.mti);
+
+    // Winding mtime back drops the line and schedules the deadline again
+    __uint64_t now = 0;
+    clint.Write32(0xbff8, 8, (char*)&now);
+    clint.UpdateInterrupts(1, &mip);
+    ASSERT_FALSE(mip.mti);
+    ASSERT_EQ(scheduler.NextDeadline(), 1000u + 10 * 10);
+}
+
+TEST(Smp, ClintTimerWakesParkedHart) {
+    EventScheduler scheduler;
+    CoreLocalInterruptor clint(&scheduler, 2);
+    ParkingLot lot(2);
+    clint.WakeOnSoftwareInterrupt(&lot);
+    __uint64_t deadline = 1000;
+    clint.Write32(0x4008, 8, (char*)&deadline);
+
+    // Hart zero's thread keeps time while hart one sleeps in WFI
+    auto begin = std::chrono::steady_clock::now();
+    std::thread timekeeper([&scheduler]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        scheduler.Advance(1000);
+    });
+    lot.Park(1, nullptr, std::chrono::seconds(10));
+    timekeeper.join();
+    ASSERT_LT(std::chrono::steady_clock::now() - begin, std::chrono::seconds(5));
+    RISCV::interruptReg mip;
+    mip.Reset();
+    clint.UpdateInterrupts(1, &mip);
+    ASSERT_TRUE(mip.mti);
+}
+
+TEST(Smp, SchedulerRunsEventsInOrder) {
+    EventScheduler scheduler;
+    std::vector<unsigned int> ran;
+    unsigned int first = scheduler.Register([&ran]() { ran.push_back(0); });
+    unsigned int second = scheduler.Register([&ran]() { ran.push_back(1); });
+
+    // Rescheduling replaces the old time, and cancelled events never run
+    scheduler.Schedule(first, 50);
+    scheduler.Schedule(second, 20);
+    scheduler.Schedule(first, 10);
+    scheduler.Advance(30);
+    ASSERT_EQ(ran, (std::vector<unsigned int>{ 0, 1 }));
+    scheduler.Schedule(first, 40);
+    scheduler.Cancel(first);
+    scheduler.Advance(100);
+    ASSERT_EQ(ran.size(), 2u);
+
+    // An event scheduled in the past is overdue, so the timekeeper gets one
+    // instruction before it runs
+    scheduler.Schedule(second, 0);
+    ASSERT_EQ(scheduler.Headroom(1000), 1u);
+    scheduler.Advance(1);
+    ASSERT_EQ(ran.size(), 3u);
+}
@@ -0,0 +1,342 @@
+#include <gtest/gtest.h>
+#include <HartFixture.hpp>
+
+#include <fstream>
+#include <vector>
+
+#include <Trace/TraceCodec.hpp>
+#include <Trace/TraceFilter.hpp>
+#include <Trace/TraceReader.hpp>
+#include <Trace/TraceRingBuffer.hpp>
+#include <Trace/TraceTrigger.hpp>
+#include <Trace/TraceWriter.hpp>
+
+TEST(Trace, RingBufferKeepsOrderAcrossWraparound) {
+    TraceRingBuffer<unsigned int, 4> ring;
+    std::vector<unsigned int> drained;
+    auto sink = [&drained](unsigned int* items, size_t count) {
+        drained.insert(drained.end(), items, items + count);
+    };
+    for (unsigned int round = 0; round < 5; round++) {
+        for (unsigned int i = 0; i < 12; i++) {
+            ring.Push(round * 12 + i);
+        }
+        ring.Drain(sink);
+    }
+    ASSERT_EQ(drained.size(), (size_t)60);
+    for (unsigned int i = 0; i < drained.size(); i++) {
+        ASSERT_EQ(drained[i], i);
+    }
+}
+
+/* @EncodeAsm: TraceSideEffects.rv32gc
+    li a0, 5
+    li a1, 0x100
+    sw a0, 0(a1)
+    lw a2, 0(a1)
+    j 0
+*/
+#include <TraceSideEffects.rv32gc.h>
+TEST_F(HartTest32, TraceSideEffects) {
+    bus.Write32(0x80000000, sizeof(TraceSideEffects_rv32gc_bytes), (char*)TraceSideEffects_rv32gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+
+    std::string fileName = ::testing::TempDir() + "TraceSideEffects.grimtrace";
+    TraceFileHeader header(TraceFormat::Raw, sizeof(__uint32_t), hart.state.misa.extensions);
+    TraceWriter tracer(fileName, header);
+    ASSERT_TRUE(tracer.IsOpen());
+    for (unsigned int i = 0; i < 4; i++) {
+        hart.TickOnceAndTrace(&tracer);
+    }
+    tracer.Close();
+    ASSERT_EQ(tracer.RecordsWritten(), (__uint64_t)4);
+
+    std::ifstream in(fileName, std::ios::in | std::ios::binary);
+    TraceFileHeader readHeader;
+    in.read((char*)&readHeader, sizeof(readHeader));
+    ASSERT_TRUE(readHeader.Valid());
+    ASSERT_EQ(readHeader.xlenBytes, (__uint32_t)4);
+    TraceRecord records[4];
+    in.read((char*)records, sizeof(records));
+    ASSERT_EQ(in.gcount(), (std::streamsize)sizeof(records));
+
+    ASSERT_EQ(records[0].pc, (__uint64_t)0x80000000);
+    ASSERT_EQ(records[0].rd, RISCV::abiRegNum::a0);
+    ASSERT_EQ(records[0].rdValue, (__uint64_t)5);
+    ASSERT_FALSE(records[0].flags & TraceFlag::DataAccess);
+
+    ASSERT_EQ(records[2].rd, 0);
+    ASSERT_TRUE(records[2].flags & TraceFlag::DataAccess);
+    ASSERT_EQ(records[2].memAddress, (__uint64_t)0x100);
+
+    ASSERT_EQ(records[3].rd, RISCV::abiRegNum::a2);
+    ASSERT_EQ(records[3].rdValue, (__uint64_t)5);
+    ASSERT_TRUE(records[3].flags & TraceFlag::DataAccess);
+    ASSERT_EQ(records[3].memAddress, (__uint64_t)0x100);
+    ASSERT_EQ(records[3].privilege, RISCV::PrivilegeMode::Machine);
+}
+
+// The destination comes from the encoding, so an instruction that writes
+// back the value a register already holds still records it, and one that
+// traps records none.
+
+/* @EncodeAsm: TraceUnchangedWrites.rv32gc
+    li a0, 5
+    li a1, 0x100
+    sw a0, 0(a1)
+    lw a0, 0(a1)
+    mv a0, a0
+    li a0, 5
+    csrrw a3, mhartid, a0
+    j 0
+*/
+#include <TraceUnchangedWrites.rv32gc.h>
+TEST_F(HartTest32, TraceUnchangedWrites) {
+    bus.Write32(0x80000000, sizeof(TraceUnchangedWrites_rv32gc_bytes), (char*)TraceUnchangedWrites_rv32gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+    hart.state.regs[RISCV::abiRegNum::a3] = 0xa3;
+
+    std::string fileName = ::testing::TempDir() + "TraceUnchangedWrites.grimtrace";
+    TraceFileHeader header(TraceFormat::Raw, sizeof(__uint32_t), hart.state.misa.extensions);
+    TraceWriter tracer(fileName, header);
+    ASSERT_TRUE(tracer.IsOpen());
+    for (unsigned int i = 0; i < 7; i++) {
+        hart.TickOnceAndTrace(&tracer);
+    }
+    tracer.Close();
+
+    std::ifstream in(fileName, std::ios::in | std::ios::binary);
+    TraceFileHeader readHeader;
+    in.read((char*)&readHeader, sizeof(readHeader));
+    TraceRecord records[7];
+    in.read((char*)records, sizeof(records));
+    ASSERT_EQ(in.gcount(), (std::streamsize)sizeof(records));
+
+    for (unsigned int i = 3; i < 6; i++) {
+        ASSERT_EQ(records[i].rd, RISCV::abiRegNum::a0) << "record " << i;
+        ASSERT_EQ(records[i].rdValue, (__uint64_t)5) << "record " << i;
+    }
+    ASSERT_TRUE(records[3].flags & TraceFlag::DataAccess);
+    ASSERT_EQ(records[3].memAddress, (__uint64_t)0x100);
+    ASSERT_FALSE(records[4].flags & TraceFlag::DataAccess);
+
+    ASSERT_EQ(hart.state.mcause.exceptionCode, RISCV::TrapCause::ILLEGAL_INSTRUCTION);
+    ASSERT_EQ(records[6].rd, 0);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a3], (__uint32_t)0xa3);
+}
+
+TEST(Trace, CodecRoundTrip) {
+    std::vector<__uint8_t> input;
+    for (unsigned int i = 0; i < 20000; i++) {
+        // Repetitive with a little noise, like a delta-encoded loop
+        input.push_back((i % 37) < 30 ? (i % 7) : (__uint8_t)(i * 2654435761u >> 24));
+    }
+    std::vector<__uint8_t> compressed;
+    TraceCodec::Compress(input.data(), input.size(), &compressed);
+    ASSERT_LT(compressed.size(), input.size());
+    std::vector<__uint8_t> output(input.size());
+    ASSERT_TRUE(TraceCodec::Decompress(compressed.data(), compressed.size(), output.data(), output.size()));
+    ASSERT_EQ(input, output);
+    ASSERT_FALSE(TraceCodec::Decompress(compressed.data(), compressed.size() / 2, output.data(), output.size()));
+}
+
+TraceRecord SyntheticRecord(__uint64_t i) {
+    TraceRecord record = { };
+    record.pc = 0x80000000 + (i % 100) * 4;
+    record.encoding = (i % 3) ? 0x00a50533 : 0x4501;
+    record.privilege = (i / 5000) % 2 ? RISCV::PrivilegeMode::User : RISCV::PrivilegeMode::Machine;
+    if (i % 2) {
+        record.rd = 1 + i % 31;
+        record.rdValue = i * 0x10001;
+    }
+    if (i % 5 == 0) {
+        record.flags |= TraceFlag::DataAccess;
+        record.memAddress = 0x1000 + i * 8;
+    }
+    if (i % 997 == 0) {
+        record.flags = TraceFlag::FetchFault;
+        record.encoding = 0;
+        record.memAddress = 0;
+    }
+    return record;
+}
+
+TEST(Trace, CompressedSeek) {
+    std::string fileName = ::testing::TempDir() + "CompressedSeek.grimtrace";
+    constexpr __uint64_t records = 10000;
+    {
+        TraceFileHeader header(TraceFormat::Compressed, sizeof(__uint64_t), 0);
+        TraceWriter tracer(fileName, header, 1024);
+        ASSERT_TRUE(tracer.IsOpen());
+        for (__uint64_t i = 0; i < records; i++) {
+            tracer.Record(SyntheticRecord(i));
+        }
+        tracer.Close();
+        ASSERT_EQ(tracer.RecordsWritten(), records);
+    }
+
+    TraceReader reader;
+    ASSERT_TRUE(reader.Open(fileName));
+    ASSERT_EQ(reader.Header().format, TraceFormat::Compressed);
+    ASSERT_EQ(reader.RecordCount(), records);
+
+    TraceRecord record;
+    for (__uint64_t i = 0; i < records; i++) {
+        ASSERT_TRUE(reader.Next(&record));
+        TraceRecord expected = SyntheticRecord(i);
+        ASSERT_EQ(memcmp(&record, &expected, sizeof(record)), 0) << "record " << i;
+    }
+    ASSERT_FALSE(reader.Next(&record));
+
+    for (__uint64_t i : { 7777, 1024, 0, 9999, 3000 }) {
+        ASSERT_TRUE(reader.Seek(i));
+        ASSERT_TRUE(reader.Next(&record));
+        TraceRecord expected = SyntheticRecord(i);
+        ASSERT_EQ(memcmp(&record, &expected, sizeof(record)), 0) << "record " << i;
+    }
+}
+
+TEST(Trace, RawReaderSpans) {
+    std::string fileName = ::testing::TempDir() + "RawReaderSpans.grimtrace";
+    constexpr __uint64_t records = 3000;
+    {
+        TraceWriter tracer(fileName, TraceFileHeader(TraceFormat::Raw, sizeof(__uint32_t), 0));
+        for (__uint64_t i = 0; i < records; i++) {
+            tracer.Record(SyntheticRecord(i));
+        }
+    }
+
+    TraceReader reader;
+    ASSERT_TRUE(reader.Open(fileName));
+    ASSERT_EQ(reader.RecordCount(), records);
+    ASSERT_TRUE(reader.Seek(1000));
+    const TraceRecord* span;
+    __uint64_t seen = 1000;
+    while (size_t count = reader.NextSpan(&span, 700)) {
+        ASSERT_LE(count, (size_t)700);
+        for (size_t i = 0; i < count; i++, seen++) {
+            TraceRecord expected = SyntheticRecord(seen);
+            ASSERT_EQ(memcmp(&span[i], &expected, sizeof(expected)), 0) << "record " << seen;
+        }
+    }
+    ASSERT_EQ(seen, records);
+}
+
+TEST(Trace, TriggerParsing) {
+    TraceTrigger trigger;
+    ASSERT_TRUE(trigger.Parse("count:1000000"));
+    ASSERT_EQ(trigger.kind, TraceTrigger::Kind::Count);
+    ASSERT_EQ(trigger.value, (__uint64_t)1000000);
+    ASSERT_TRUE(trigger.Parse("pc:0x80001234"));
+    ASSERT_EQ(trigger.kind, TraceTrigger::Kind::Pc);
+    ASSERT_EQ(trigger.value, (__uint64_t)0x80001234);
+    ASSERT_TRUE(trigger.Parse("priv:u"));
+    ASSERT_EQ(trigger.kind, TraceTrigger::Kind::Privilege);
+    ASSERT_EQ(trigger.value, (__uint64_t)RISCV::PrivilegeMode::User);
+    ASSERT_TRUE(trigger.Parse("signal"));
+    ASSERT_EQ(trigger.kind, TraceTrigger::Kind::Signal);
+    ASSERT_FALSE(trigger.Parse("pc:"));
+    ASSERT_FALSE(trigger.Parse("count:12abc"));
+    ASSERT_FALSE(trigger.Parse("priv:h"));
+    ASSERT_FALSE(trigger.Parse("instret:5"));
+}
+
+/* @EncodeAsm: BreakStopsTick.rv32gc
+loop:
+    addi a0, a0, 1
+    j loop
+*/
+#include <BreakStopsTick.rv32gc.h>
+TEST_F(HartTest32, BreakStopsTick) {
+    bus.Write32(0x80000000, sizeof(BreakStopsTick_rv32gc_bytes), (char*)BreakStopsTick_rv32gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+
+    hart.SetBreakpoint(0x80000000);
+    ASSERT_EQ(hart.Tick(), 0u);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], 0u);
+
+    hart.ClearBreaks();
+    ASSERT_EQ(hart.Tick(5), 5u);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], 3u);
+
+    // The loop head was icached while the breakpoint was clear; setting it
+    // again must still stop the hart there.
+    hart.SetBreakpoint(0x80000000);
+    ASSERT_EQ(hart.Tick(), 1u);
+    ASSERT_EQ(hart.state.pc, 0x80000000u);
+    ASSERT_TRUE(hart.BreakPending());
+
+    hart.ClearBreaks();
+    hart.RequestBreak();
+    ASSERT_EQ(hart.Tick(), 0u);
+    hart.ClearBreaks();
+    ASSERT_FALSE(hart.BreakPending());
+    ASSERT_EQ(hart.Tick(), 1000u);
+}
+
+/* @EncodeAsm: FilteredTrace.rv32gc
+loop:
+    addi a0, a0, 1
+    addi a1, a1, 2
+    j loop
+*/
+#include <FilteredTrace.rv32gc.h>
+TEST_F(HartTest32, FilteredTrace) {
+    bus.Write32(0x80000000, sizeof(FilteredTrace_rv32gc_bytes), (char*)FilteredTrace_rv32gc_bytes);
+    hart.state.resetVector = 0x80000000;
+    hart.Reset();
+
+    std::string fileName = ::testing::TempDir() + "FilteredTrace.grimtrace";
+    TraceWriter tracer(fileName, TraceFileHeader(TraceFormat::Raw, sizeof(__uint32_t), 0));
+
+    TraceFilter firstInstruction;
+    ASSERT_TRUE(firstInstruction.ParsePcRanges("0x80000000-0x80000000"));
+    hart.SetTraceFilter(&tracer, &firstInstruction);
+    ASSERT_EQ(hart.Tick(9), 9u);
+
+    // Nothing runs in user mode, so this filter must not record anything
+    TraceFilter userOnly;
+    ASSERT_TRUE(userOnly.ParsePrivileges("u"));
+    hart.SetTraceFilter(&tracer, &userOnly);
+    ASSERT_EQ(hart.Tick(9), 9u);
+
+    hart.SetTraceFilter(nullptr, nullptr);
+    ASSERT_EQ(hart.Tick(9), 9u);
+    tracer.Close();
+    ASSERT_EQ(tracer.RecordsWritten(), (__uint64_t)3);
+    ASSERT_EQ(hart.state.regs[RISCV::abiRegNum::a0], 9u);
+
+    TraceReader reader;
+    ASSERT_TRUE(reader.Open(fileName));
+    TraceRecord record;
+    for (__uint64_t i = 1; i <= 3; i++) {
+        ASSERT_TRUE(reader.Next(&record));
+        ASSERT_EQ(record.pc, (__uint64_t)0x80000000);
+        ASSERT_EQ(record.rd, RISCV::abiRegNum::a0);
+        ASSERT_EQ(record.rdValue, i);
+    }
+}
+
+TEST(Trace, FilterParsing) {
+    TraceFilter filter;
+    ASSERT_TRUE(filter.ParsePcRanges("0x1000-0x1fff,0x8000-0x8003"));
+    ASSERT_FALSE(filter.DependsOnContext());
+    ASSERT_TRUE(filter.Matches(0x1ffe, RISCV::PrivilegeMode::Machine, 0));
+    ASSERT_TRUE(filter.Matches(0x8002, RISCV::PrivilegeMode::User, 0));
+    ASSERT_FALSE(filter.Matches(0x2000, RISCV::PrivilegeMode::Machine, 0));
+    ASSERT_TRUE(filter.ParsePrivileges("su"));
+    filter.matchAsid = true;
+    filter.asid = 7;
+    ASSERT_TRUE(filter.DependsOnContext());
+    ASSERT_FALSE(filter.Matches(0x1000, RISCV::PrivilegeMode::Machine, 7));
+    ASSERT_FALSE(filter.Matches(0x1000, RISCV::PrivilegeMode::User, 6));
+    ASSERT_TRUE(filter.Matches(0x1000, RISCV::PrivilegeMode::User, 7));
+
+    TraceFilter bad;
+    ASSERT_FALSE(bad.ParsePcRanges("0x2000-0x1000"));
+    ASSERT_FALSE(bad.ParsePcRanges("0x1000"));
+    ASSERT_FALSE(bad.ParsePrivileges("mx"));
+}
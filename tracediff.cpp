@@ -0,0 +1,178 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+
+#include <cxxopts.hpp>
+
+#include <Trace/TracePrinter.hpp>
+#include <Trace/TraceReader.hpp>
+
+// Lockstep comparison of two binary traces. Both files are memory mapped and
+// compared a span of records at a time with memcmp, so matching stretches cost
+// about as much as reading the pages; only the first divergence is decoded
+// and explained.
+
+static constexpr size_t spanRecords = 1 << 16;
+
+// Replays every register write up to (not including) instruction stop, which
+// is the architectural register file the diverging instruction started with.
+void ReplayRegisters(TraceReader* reader, __uint64_t stop, __uint64_t regs[RISCV::NumRegs]) {
+    memset(regs, 0, RISCV::NumRegs * sizeof(regs[0]));
+    reader->Seek(0);
+    while (reader->Position() < stop) {
+        const TraceRecord* span;
+        size_t count = reader->NextSpan(&span, stop - reader->Position());
+        if (count == 0) {
+            return;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (span[i].rd != 0) {
+                regs[span[i].rd] = span[i].rdValue;
+            }
+        }
+    }
+}
+
+template<typename XLEN_t>
+void PrintField(std::ostream* out, const char* name, __uint64_t a, __uint64_t b, unsigned int width = sizeof(XLEN_t)*2) {
+    (*out) << "  " << (a != b ? "*" : " ") << std::setfill(' ') << std::setw(10) << std::left << name << std::right
+           << " 0x" << std::hex << std::setfill('0') << std::setw(width) << a
+           << "  0x" << std::setw(width) << b << std::dec << std::endl;
+}
+
+template<typename XLEN_t>
+void ReportDivergence(TraceReader* first, TraceReader* second, __uint64_t divergence, unsigned int context) {
+    std::ostringstream report;
+    TraceFileHeader header = first->Header();
+
+    __uint64_t contextStart = divergence > context ? divergence - context : 0;
+    report << "Traces diverge at instruction " << divergence << std::endl << std::endl;
+    report << "Common history:" << std::endl;
+    first->Seek(contextStart);
+    TraceRecord record;
+    for (__uint64_t i = contextStart; i < divergence && first->Next(&record); i++) {
+        report << std::dec << std::setfill(' ') << std::setw(12) << i << "  ";
+        PrintRecord<XLEN_t>(&record, &header, &report);
+    }
+
+    TraceRecord a = { }, b = { };
+    bool haveA = first->Seek(divergence) && first->Next(&a);
+    bool haveB = second->Seek(divergence) && second->Next(&b);
+    report << std::endl << "First trace:" << std::endl << std::dec << std::setfill(' ') << std::setw(12) << divergence << "  ";
+    if (haveA) {
+        PrintRecord<XLEN_t>(&a, &header, &report);
+    } else {
+        report << "(end of trace)" << std::endl;
+    }
+    report << "Second trace:" << std::endl << std::dec << std::setfill(' ') << std::setw(12) << divergence << "  ";
+    if (haveB) {
+        PrintRecord<XLEN_t>(&b, &header, &report);
+    } else {
+        report << "(end of trace)" << std::endl;
+    }
+
+    if (haveA && haveB) {
+        report << std::endl << "Fields (* differs):" << std::endl;
+        PrintField<XLEN_t>(&report, "pc", a.pc, b.pc);
+        PrintField<XLEN_t>(&report, "encoding", a.encoding, b.encoding, 8);
+        report << "  " << (a.privilege != b.privilege ? "*" : " ") << "privilege  "
+               << RISCV::privilegeModeName((RISCV::PrivilegeMode)a.privilege) << "  "
+               << RISCV::privilegeModeName((RISCV::PrivilegeMode)b.privilege) << std::endl;
+        PrintField<XLEN_t>(&report, "flags", a.flags, b.flags, 2);
+        PrintField<XLEN_t>(&report, "rd", a.rd, b.rd, 2);
+        PrintField<XLEN_t>(&report, "rd value", a.rdValue, b.rdValue);
+        PrintField<XLEN_t>(&report, "mem", a.memAddress, b.memAddress);
+    }
+
+    __uint64_t regsA[RISCV::NumRegs], regsB[RISCV::NumRegs];
+    ReplayRegisters(first, divergence, regsA);
+    ReplayRegisters(second, divergence, regsB);
+    report << std::endl << "Registers before instruction " << divergence << " (* differs):" << std::endl;
+    for (unsigned int i = 1; i < RISCV::NumRegs; i++) {
+        PrintField<XLEN_t>(&report, RISCV::regName(i).c_str(), regsA[i], regsB[i]);
+    }
+    std::cout << report.str();
+}
+
+int main(int argc, char **argv) {
+
+    cxxopts::Options options("grim-tracediff", "Find the first divergence between two GRIM binary instruction traces");
+    options.add_options()
+    ("a,first", "Name of the first trace file", cxxopts::value<std::string>())
+    ("b,second", "Name of the second trace file", cxxopts::value<std::string>())
+    ("c,context", "Number of instructions before the divergence to print", cxxopts::value<unsigned int>())
+    ("h,help", "Print help message");
+
+    cxxopts::ParseResult parsed_arguments = options.parse(argc, argv);
+
+    if (parsed_arguments.count("help") || !parsed_arguments.count("first") || !parsed_arguments.count("second")) {
+        std::cout << options.help() << std::endl;
+        return 0;
+    }
+
+    unsigned int context = 8;
+    if (parsed_arguments.count("context")) {
+        context = parsed_arguments["context"].as<unsigned int>();
+    }
+
+    std::string firstFileName = parsed_arguments["first"].as<std::string>();
+    std::string secondFileName = parsed_arguments["second"].as<std::string>();
+    TraceReader first, second;
+    if (!first.Open(firstFileName)) {
+        std::cerr << "Fatal: Can't open trace file, or it isn't a GRIM trace: " << firstFileName << std::endl;
+        return 2;
+    }
+    if (!second.Open(secondFileName)) {
+        std::cerr << "Fatal: Can't open trace file, or it isn't a GRIM trace: " << secondFileName << std::endl;
+        return 2;
+    }
+    if (first.Header().xlenBytes != second.Header().xlenBytes) {
+        std::cerr << "Fatal: Traces are of different XLENs" << std::endl;
+        return 2;
+    }
+
+    const TraceRecord *spanA = nullptr, *spanB = nullptr;
+    size_t countA = 0, countB = 0;
+    __uint64_t compared = 0;
+    while (true) {
+        if (countA == 0) {
+            countA = first.NextSpan(&spanA, spanRecords);
+        }
+        if (countB == 0) {
+            countB = second.NextSpan(&spanB, spanRecords);
+        }
+        size_t count = std::min(countA, countB);
+        if (count == 0) {
+            break;
+        }
+        if (memcmp(spanA, spanB, count * sizeof(TraceRecord)) != 0) {
+            while (memcmp(spanA, spanB, sizeof(TraceRecord)) == 0) {
+                spanA++;
+                spanB++;
+                compared++;
+            }
+            countA = countB = 1;
+            break;
+        }
+        spanA += count;
+        spanB += count;
+        countA -= count;
+        countB -= count;
+        compared += count;
+    }
+
+    if (countA == 0 && countB == 0 &&
+        compared == first.RecordCount() && compared == second.RecordCount()) {
+        std::cout << "Traces match for all " << compared << " instructions" << std::endl;
+        return 0;
+    }
+
+    switch (first.Header().xlenBytes) {
+    case 4: ReportDivergence<__uint32_t>(&first, &second, compared, context); break;
+    case 8: ReportDivergence<__uint64_t>(&first, &second, compared, context); break;
+    default:
+        std::cerr << "Fatal: Unsupported trace XLEN of " << first.Header().xlenBytes << " bytes" << std::endl;
+        return 2;
+    }
+    return 1;
+}
@@ -0,0 +1,75 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+
+#include <cxxopts.hpp>
+
+#include <Trace/TracePrinter.hpp>
+#include <Trace/TraceReader.hpp>
+
+// Offline half of binary tracing: turns the records grim wrote with --trace
+// back into the same text that -p d prints, plus the captured side effects.
+
+template<typename XLEN_t>
+void DumpTrace(TraceReader* reader, __uint64_t skip, __uint64_t count) {
+    constexpr unsigned int recordsPerChunk = 4096;
+    TraceFileHeader header = reader->Header();
+    TraceRecord record;
+    reader->Seek(skip);
+    __uint64_t printed = 0;
+    bool more = true;
+    while (more && (count == 0 || printed < count)) {
+        std::ostringstream chunk;
+        for (unsigned int i = 0; i < recordsPerChunk && (count == 0 || printed < count); i++, printed++) {
+            if (!(more = reader->Next(&record))) {
+                break;
+            }
+            PrintRecord<XLEN_t>(&record, &header, &chunk);
+        }
+        std::cout << chunk.str();
+    }
+    std::cout.flush();
+}
+
+int main(int argc, char **argv) {
+
+    cxxopts::Options options("grim-tracedump", "Disassemble a GRIM binary instruction trace");
+    options.add_options()
+    ("t,trace", "Name of the trace file written by grim --trace", cxxopts::value<std::string>())
+    ("s,skip", "Number of instructions to skip before printing", cxxopts::value<__uint64_t>())
+    ("n,count", "Number of instructions to print, 0 for all", cxxopts::value<__uint64_t>())
+    ("h,help", "Print help message");
+
+    cxxopts::ParseResult parsed_arguments = options.parse(argc, argv);
+
+    if (parsed_arguments.count("help") || !parsed_arguments.count("trace")) {
+        std::cout << options.help() << std::endl;
+        return 0;
+    }
+
+    __uint64_t skip = 0;
+    if (parsed_arguments.count("skip")) {
+        skip = parsed_arguments["skip"].as<__uint64_t>();
+    }
+
+    __uint64_t count = 0;
+    if (parsed_arguments.count("count")) {
+        count = parsed_arguments["count"].as<__uint64_t>();
+    }
+
+    std::string traceFileName = parsed_arguments["trace"].as<std::string>();
+    TraceReader reader;
+    if (!reader.Open(traceFileName)) {
+        std::cerr << "Fatal: Can't open trace file, or it isn't a GRIM trace: " << traceFileName << std::endl;
+        return 1;
+    }
+
+    switch (reader.Header().xlenBytes) {
+    case 4: DumpTrace<__uint32_t>(&reader, skip, count); break;
+    case 8: DumpTrace<__uint64_t>(&reader, skip, count); break;
+    default:
+        std::cerr << "Fatal: Unsupported trace XLEN of " << reader.Header().xlenBytes << " bytes" << std::endl;
+        return 1;
+    }
+    return 0;
+}